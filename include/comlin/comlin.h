@@ -18,7 +18,9 @@
 #    endif
 #endif
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -45,6 +47,7 @@ typedef enum {
     COMLIN_BAD_READ,     ///< Failed to read from input
     COMLIN_BAD_WRITE,    ///< Failed to write to output
     COMLIN_BAD_TERMINAL, ///< Failed to configure terminal
+    COMLIN_BAD_ARG,      ///< Invalid argument
 } ComlinStatus;
 
 /**
@@ -63,8 +66,16 @@ typedef struct ComlinStateImpl ComlinState;
 
 /// A flag to configure the presentation of the command line
 typedef enum {
-    COMLIN_MODE_MASKED = 1U << 0U,
-    COMLIN_MODE_MULTI_LINE = 1U << 1U,
+    COMLIN_MODE_MASKED = 1U << 0U,           ///< Show asterisks for input
+    COMLIN_MODE_MULTI_LINE = 1U << 1U,       ///< Wrap long lines onto new rows
+    COMLIN_MODE_HISTORY_METADATA = 1U << 2U, ///< Record history metadata
+    COMLIN_MODE_HISTORY_FRECENCY = 1U << 3U, ///< Rank history by frecency
+    COMLIN_MODE_AUTOSUGGEST = 1U << 4U,      ///< Suggest lines from history
+    COMLIN_MODE_HISTORY_WORDS = 1U << 5U,    ///< Complete words from history
+    COMLIN_MODE_NARROWING = 1U << 6U,        ///< Filter previous completions
+    COMLIN_MODE_COMMON_PREFIX = 1U << 7U,    ///< Tab inserts common prefix
+    COMLIN_MODE_COMPLETION_MENU = 1U << 8U,  ///< Show completions in a menu
+    COMLIN_MODE_PATHS = 1U << 9U,            ///< Complete file paths
 } ComlinModeFlag;
 
 /// Bitwise OR of ComlinModeFlag values
@@ -108,6 +119,40 @@ comlin_free_state(ComlinState* state);
  * This can be used to adjust the behaviour of the command line.  The changed
  * mode will be applied on the next call to a read or edit function.
  *
+ * With #COMLIN_MODE_AUTOSUGGEST, the rest of the most recent history entry
+ * that starts with the current line is shown dimmed after it, and can be
+ * accepted with Right or End at the end of the line.  Entries are found with
+ * an index that is built when first needed and updated as the history
+ * changes, so suggestions are fast regardless of the size of the history.
+ *
+ * With #COMLIN_MODE_HISTORY_WORDS, if the completion callback has no
+ * completions, then Tab completes the last word of the line from the words
+ * in the history, most recently used first.  Words are indexed similarly.
+ *
+ * With #COMLIN_MODE_NARROWING, the application promises that the
+ * completions for a line are the completions for any shorter prefix of it
+ * that start with the whole line.  Then, when more is typed at the end of a
+ * line that has been completed, the previous completions are filtered rather
+ * than calling the completion callback again, which is only called when the
+ * line no longer extends the previous one, or no completions are left.
+ *
+ * With #COMLIN_MODE_COMMON_PREFIX, the first Tab inserts the longest prefix
+ * that all completions share, if it's longer than the text they replace, as
+ * in many shells.  Otherwise, or when pressed again, Tab cycles through the
+ * completions as usual.
+ *
+ * With #COMLIN_MODE_COMPLETION_MENU, completions are also shown in columns
+ * below the line while cycling through them, with the proposed one
+ * highlighted.  Only the page of the menu that contains it is drawn, so
+ * showing the menu takes time proportional to the size of the screen, not
+ * the number of completions.
+ *
+ * With #COMLIN_MODE_PATHS, if there are no other completions, then Tab
+ * completes the word before the cursor as a file path, with a trailing slash
+ * for directories.  Hidden entries are only offered if the word after the
+ * last slash starts with a dot.  Directory listings are cached until the
+ * directory is modified, so completing in large directories is fast.
+ *
  * @return #COMLIN_SUCCESS.
  */
 COMLIN_API ComlinStatus
@@ -231,10 +276,22 @@ comlin_read_line(ComlinState* state, char const* prompt);
    @{
 */
 
+/// A range of bytes in the line
+typedef struct {
+    size_t start; ///< Offset of the first byte
+    size_t end;   ///< Offset one past the last byte
+} ComlinRange;
+
 /** A sequence of applicable completions.
  *
  * This is passed to the completion callback, which can add completions to it
- * with #comlin_add_completion.
+ * with #comlin_add_completion, #comlin_add_completion_len, or
+ * #comlin_add_completion_range.  The strings are allocated together in large
+ * blocks, so they can only be added with these functions, and must be freed
+ * with #comlin_free_completions.  Completions made by the application must be
+ * zero-initialised before the first completion is added.  The strings in
+ * `cvec` may be reordered, and `len` may be reduced to remove some, but
+ * strings can't be replaced by others.
  */
 typedef struct {
     size_t len;  ///< Number of elements in cvec
@@ -244,11 +301,185 @@ typedef struct {
 /// Completion callback
 typedef void(ComlinCompletionCallback)(char const*, ComlinCompletions*);
 
+/** Range completion callback.
+ *
+ * This is called with the line, its length, and the cursor position, so that
+ * completions for the word at the cursor can be added with
+ * #comlin_add_completion_range without copying the rest of the line.
+ */
+typedef void(ComlinRangeCompletionCallback)(char const*,
+                                            size_t,
+                                            size_t,
+                                            ComlinCompletions*);
+
 /// Register a callback function to be called for tab-completion
 COMLIN_API void
 comlin_set_completion_callback(ComlinState* state,
                                ComlinCompletionCallback* fn);
 
+/** Register a callback function to be called for range completion.
+ *
+ * When this is set, it's used instead of the completion callback.
+ */
+COMLIN_API void
+comlin_set_range_completion_callback(ComlinState* state,
+                                     ComlinRangeCompletionCallback* fn);
+
+/** Streaming completion callback.
+ *
+ * This is called with the line, the number of completions already added for
+ * it, and the maximum number to add.  It should add at most that many of the
+ * following completions to the end of the given sequence, and return true if
+ * there are more after them.
+ */
+typedef bool(ComlinStreamCompletionCallback)(char const*,
+                                             size_t,
+                                             size_t,
+                                             ComlinCompletions*);
+
+/** Register a callback function to stream completions from.
+ *
+ * When this is set, it's used instead of the completion callback, and
+ * completions are pulled from it in batches.  The first batch is fetched
+ * when Tab is first pressed, and the next is only fetched when cycling past
+ * the last completion fetched so far, so any number of completions can be
+ * provided without generating them all up front.
+ *
+ * Since the completions are incomplete until the last batch, they aren't
+ * narrowed with #COMLIN_MODE_NARROWING, and no common prefix is inserted
+ * with #COMLIN_MODE_COMMON_PREFIX, while more are available.
+ *
+ * @param state The state to set the callback of.
+ * @param fn The callback, or null to remove it.
+ * @param batch_size The maximum number of completions to fetch at once.
+ * @param limit The maximum number of completions to fetch for a line, or
+ * zero for no limit.
+ * @return #COMLIN_SUCCESS, or #COMLIN_BAD_ARG if `batch_size` is zero.
+ */
+COMLIN_API ComlinStatus
+comlin_set_stream_completion_callback(ComlinState* state,
+                                      ComlinStreamCompletionCallback* fn,
+                                      size_t batch_size,
+                                      size_t limit);
+
+/** Set a dictionary of words to complete.
+ *
+ * If the completion callback has no completions, then Tab completes the word
+ * before the cursor with any of these words that start with it.  The words
+ * are copied and sorted once, so completions are found with a binary search,
+ * and the words aren't copied again for each completion.
+ *
+ * @param state The state to set the dictionary of.
+ * @param words Array of null-terminated words, which may be in any order.
+ * @param n_words Number of words, or zero to remove the dictionary.
+ *
+ * @return #COMLIN_SUCCESS, or #COMLIN_NO_MEMORY if memory allocation failed.
+ */
+COMLIN_API ComlinStatus
+comlin_set_dictionary(ComlinState* state,
+                      char const* const* words,
+                      size_t n_words);
+
+/** A command grammar compiled into an automaton.
+ *
+ * This describes a command language, and can be used for completion with
+ * #comlin_set_grammar, and to check lines with #comlin_grammar_check.
+ */
+typedef struct ComlinGrammarImpl ComlinGrammar;
+
+/** Compile a command grammar.
+ *
+ * Each rule is a sequence of tokens separated by spaces, which describes one
+ * form of a complete command.  A token is a keyword like `show`, an
+ * enumeration of keywords like `(on|off)`, an integer argument `<int>`, or
+ * any other word in angle brackets like `<name>`, which matches any token.
+ * For example, `set mode (fast|slow)` and `show table <name>`.
+ *
+ * Rules are compiled into a deterministic automaton once, so a line is
+ * checked or completed in a single pass over its tokens.  A line matches if
+ * it matches any one rule, so a keyword may also be an argument of another
+ * rule, and alternatives only lead to the rest of the rules they appear in.
+ *
+ * @return A new grammar that must be freed with #comlin_grammar_free, or null
+ * if a rule is invalid or memory allocation failed.
+ */
+COMLIN_API ComlinGrammar*
+comlin_grammar_new(char const* const* rules, size_t n_rules);
+
+/// Free a grammar
+COMLIN_API void
+comlin_grammar_free(ComlinGrammar* grammar);
+
+/** Check a line against a grammar.
+ *
+ * @return #COMLIN_SUCCESS if the line is a complete command,
+ * #COMLIN_EDITING if it is the start of one, or #COMLIN_BAD_ARG if it
+ * doesn't match the grammar.
+ */
+COMLIN_API ComlinStatus
+comlin_grammar_check(ComlinGrammar const* grammar,
+                     char const* line,
+                     size_t len);
+
+/** Set a grammar to complete commands from.
+ *
+ * If the completion callback has no completions, then Tab completes the word
+ * before the cursor with the keywords that can follow the preceding tokens.
+ * The grammar isn't copied, so it must outlive the state, or be unset by
+ * passing null first.
+ */
+COMLIN_API void
+comlin_set_grammar(ComlinState* state, ComlinGrammar const* grammar);
+
+/** Asynchronous completion request callback.
+ *
+ * This is called with the state, a generation number that identifies the
+ * request, and the current line.  It should start fetching completions and
+ * return immediately, then pass the result to #comlin_submit_completions
+ * later.
+ */
+typedef void(ComlinCompletionRequestCallback)(ComlinState*,
+                                              uint64_t,
+                                              char const*);
+
+/** Register a callback function to request completions asynchronously.
+ *
+ * When this is set, it's used instead of the completion callback, so a slow
+ * source of completions doesn't block input.  Pressing Tab issues a request,
+ * and when the completions are submitted, they're shown on the next call to
+ * #comlin_edit_feed or #comlin_show, so an application that waits for input
+ * and completions at once can show them immediately with #comlin_hide and
+ * #comlin_show.  The request is cancelled if the line or cursor position
+ * changes before then, or when a new request is made.
+ */
+COMLIN_API void
+comlin_set_completion_request_callback(ComlinState* state,
+                                       ComlinCompletionRequestCallback* fn);
+
+/** Submit completions for an asynchronous request.
+ *
+ * This may be called from any thread, including from the request callback
+ * itself.  The completions are taken in any case, so `lc` is left empty.
+ *
+ * @return #COMLIN_SUCCESS if the completions were accepted, or
+ * #COMLIN_INTERRUPTED if the request has been cancelled.
+ */
+COMLIN_API ComlinStatus
+comlin_submit_completions(ComlinState* state,
+                          uint64_t generation,
+                          ComlinCompletions* lc);
+
+/** Check if an asynchronous completion request is still wanted.
+ *
+ * This may be called from any thread, so that a provider can stop working on
+ * a request early once the user has typed ahead.
+ *
+ * @return #COMLIN_SUCCESS if the request is still pending, or
+ * #COMLIN_INTERRUPTED if it has been cancelled.
+ */
+COMLIN_API ComlinStatus
+comlin_completion_status(ComlinState* state, uint64_t generation);
+
 /** Add completion options for the current input string.
  *
  * This is used by completion callback to add completion options given the
@@ -260,6 +491,62 @@ comlin_set_completion_callback(ComlinState* state,
 COMLIN_API ComlinStatus
 comlin_add_completion(ComlinCompletions* lc, char const* str);
 
+/** Add a completion option with a known length.
+ *
+ * This is like #comlin_add_completion, but takes the length of the string,
+ * which doesn't need to be null-terminated.
+ *
+ * @return #COMLIN_SUCCESS if the completion was added, or #COMLIN_NO_MEMORY if
+ * memory allocation failed.
+ */
+COMLIN_API ComlinStatus
+comlin_add_completion_len(ComlinCompletions* lc, char const* str, size_t len);
+
+/** Add a completion option that replaces part of the line.
+ *
+ * When this completion is applied, the bytes of the line from `start` up to
+ * `end` are replaced with `str`, and the cursor is moved to the end of the
+ * inserted text.  Other completions replace the whole line.
+ *
+ * @param lc Completions to add to.
+ * @param start Offset of the first byte of the line to replace.
+ * @param end Offset one past the last byte of the line to replace.
+ * @param str Text to insert, which doesn't need to be null-terminated.
+ * @param len Length of `str` in bytes.
+ *
+ * @return #COMLIN_SUCCESS if the completion was added, #COMLIN_BAD_ARG if
+ * `end` is less than `start`, or #COMLIN_NO_MEMORY if memory allocation
+ * failed.
+ */
+COMLIN_API ComlinStatus
+comlin_add_completion_range(ComlinCompletions* lc,
+                            size_t start,
+                            size_t end,
+                            char const* str,
+                            size_t len);
+
+/** Free all completions.
+ *
+ * This is only needed for completions made by the application, since those
+ * passed to the completion callback are owned by the state.  Afterwards, the
+ * completions are empty and can be reused.
+ */
+COMLIN_API void
+comlin_free_completions(ComlinCompletions* lc);
+
+/** Filter completions with a fuzzy match.
+ *
+ * This removes any completions that don't contain every character of
+ * `pattern` in order, ignoring case, and sorts the rest from best to worst
+ * match.  Matches are ranked higher if characters are at the start of words
+ * or in consecutive runs.  This can be used by a completion callback to
+ * filter a large set of candidates efficiently.
+ *
+ * @return #COMLIN_SUCCESS, or #COMLIN_NO_MEMORY if memory allocation failed.
+ */
+COMLIN_API ComlinStatus
+comlin_filter_completions(ComlinCompletions* lc, char const* pattern);
+
 /**
    @}
    @defgroup comlin_history History
@@ -277,7 +564,219 @@ comlin_add_completion(ComlinCompletions* lc, char const* str);
 COMLIN_API ComlinStatus
 comlin_history_add(ComlinState* state, char const* line);
 
+/// A direction to move through the history
+typedef enum {
+    COMLIN_HISTORY_NEXT, ///< Towards newer entries
+    COMLIN_HISTORY_PREV, ///< Towards older entries
+} ComlinHistoryDirection;
+
+/** A function called for each entry visited by #comlin_history_visit.
+ *
+ * This is called with the user data passed to the visiting function, the
+ * index of the entry where zero is the oldest, the null-terminated text of
+ * the entry, and the length of the text in bytes, not including the
+ * terminator.  It should return #COMLIN_SUCCESS to continue, or any other
+ * status to stop.
+ */
+typedef ComlinStatus(ComlinHistoryVisitor)(void*,
+                                           size_t,
+                                           char const*,
+                                           size_t);
+
+/** Return the number of entries in the history.
+ *
+ * During an edit, this includes the newest entry, which is a placeholder for
+ * the line being edited.
+ */
+COMLIN_API size_t
+comlin_history_count(ComlinState const* state);
+
+/** Return an entry in the history without copying it.
+ *
+ * This doesn't check whether a mapped binary history file has been truncated
+ * by another program, and reading an entry from a truncated file crashes the
+ * program with a bus error.  So, it's unsafe to call while other processes
+ * may rewrite the history file, in which case #comlin_history_visit, which
+ * checks the file first, should be used instead.
+ *
+ * @param state The state that contains the history.
+ *
+ * @param index The index of the entry, where zero is the oldest.
+ *
+ * @param length If not null, set to the length of the entry in bytes, not
+ * including the null terminator.
+ *
+ * @return A pointer to the null-terminated text of the entry, which is valid
+ * until the history is modified, or null if `index` is out of range.
+ */
+COMLIN_API char const*
+comlin_history_entry(ComlinState const* state, size_t index, size_t* length);
+
+/** Visit a range of history entries in order.
+ *
+ * @param state The state that contains the history.
+ *
+ * @param begin The index of the first entry in the range.
+ *
+ * @param end The index one past the last entry in the range, which is clamped
+ * to the number of entries.
+ *
+ * @param direction The direction to visit the range in, starting at
+ * `end - 1` and moving towards `begin` if it is #COMLIN_HISTORY_PREV.
+ *
+ * @param visitor A function to call for each entry.
+ *
+ * @param data User data passed to `visitor`.
+ *
+ * @return #COMLIN_SUCCESS if every entry was visited, otherwise the status
+ * returned by `visitor` which stopped iteration.
+ */
+COMLIN_API ComlinStatus
+comlin_history_visit(ComlinState const* state,
+                     size_t begin,
+                     size_t end,
+                     ComlinHistoryDirection direction,
+                     ComlinHistoryVisitor* visitor,
+                     void* data);
+
+/** Metadata about a history entry.
+ *
+ * This is recorded when #COMLIN_MODE_HISTORY_METADATA is enabled, and is
+ * otherwise zero.
+ */
+typedef struct {
+    int64_t time;      ///< Time the line was entered in seconds since epoch
+    uint32_t duration; ///< Time spent editing the line, in milliseconds
+    int32_t status;    ///< Status set by the application, like an exit code
+} ComlinHistoryMetadata;
+
+/// A way to match the status of history entries
+typedef enum {
+    COMLIN_STATUS_ANY,       ///< Match any status
+    COMLIN_STATUS_EQUAL,     ///< Match entries with the given status
+    COMLIN_STATUS_NOT_EQUAL, ///< Match entries without the given status
+} ComlinStatusMatch;
+
+/// A query for history entries with matching metadata
+typedef struct {
+    int64_t since;           ///< Earliest time (inclusive)
+    int64_t until;           ///< Latest time (exclusive), or zero for no limit
+    ComlinStatusMatch match; ///< How to match the status of entries
+    int32_t status;          ///< Status to match
+} ComlinHistoryQuery;
+
+/** Get the metadata for a history entry.
+ *
+ * @param state The state that contains the history.
+ * @param index The index of the entry, where zero is the oldest.
+ * @param[out] metadata Set to the metadata of the entry, or zeroed.
+ * @return #COMLIN_SUCCESS, or #COMLIN_BAD_ARG if `index` is out of range.
+ */
+COMLIN_API ComlinStatus
+comlin_history_metadata(ComlinState const* state,
+                        size_t index,
+                        ComlinHistoryMetadata* metadata);
+
+/** Set the application status of a history entry.
+ *
+ * This is typically used to record the exit status of a command after it has
+ * been added to the history and run.  This enables metadata for the history
+ * if it wasn't already, but doesn't record any other metadata unless
+ * #COMLIN_MODE_HISTORY_METADATA is enabled.
+ *
+ * @param state The state that contains the history.
+ * @param index The index of the entry, where zero is the oldest.
+ * @param status The status to set.
+ * @return #COMLIN_SUCCESS, #COMLIN_BAD_ARG if `index` is out of range, or
+ * #COMLIN_NO_MEMORY if metadata couldn't be allocated.
+ */
+COMLIN_API ComlinStatus
+comlin_history_set_status(ComlinState* state, size_t index, int32_t status);
+
+/** Visit history entries with metadata that matches a query.
+ *
+ * Metadata is stored in separate arrays from the text, so this is much faster
+ * than visiting every entry and filtering them.
+ *
+ * @return #COMLIN_SUCCESS if every matching entry was visited, otherwise the
+ * status returned by `visitor` which stopped iteration.
+ */
+COMLIN_API ComlinStatus
+comlin_history_query(ComlinState const* state,
+                     ComlinHistoryQuery const* query,
+                     ComlinHistoryDirection direction,
+                     ComlinHistoryVisitor* visitor,
+                     void* data);
+
+/** Return the frecency score of a history entry.
+ *
+ * When #COMLIN_MODE_HISTORY_FRECENCY is enabled, each entry has a score that
+ * is increased by one every time the line is entered, and halves every week
+ * that it isn't used.  Entering a line that is already in the history moves
+ * it to the end rather than adding a duplicate, so frequently used lines
+ * accumulate a high score.  Scores are saved with the history, and used to
+ * rank history search results.
+ *
+ * Decay is applied when the score is read, so scores are never updated in
+ * bulk.  This implicitly enables #COMLIN_MODE_HISTORY_METADATA, since the
+ * time an entry was last used is needed to decay its score.
+ *
+ * @param state The state that contains the history.
+ * @param index The index of the entry, where zero is the oldest.
+ * @param now The current time in seconds since the epoch.
+ * @return The decayed score, or zero if `index` is out of range or frecency
+ * isn't being recorded.
+ */
+COMLIN_API double
+comlin_history_frecency(ComlinState const* state, size_t index, int64_t now);
+
+/// A format for history files
+typedef enum {
+    COMLIN_HISTORY_TEXT,   ///< Plain text with one entry per line
+    COMLIN_HISTORY_BINARY, ///< Indexed binary that can be loaded lazily
+} ComlinHistoryFormat;
+
+/// A policy for choosing which history entries to remove when over budget
+typedef enum {
+    COMLIN_EVICT_OLDEST,  ///< Remove the oldest entries first
+    COMLIN_EVICT_LARGEST, ///< Remove the largest entries first
+} ComlinEvictionPolicy;
+
+/** Set limits on the memory used by the history.
+ *
+ * This limits the history by size in addition to the maximum number of entries
+ * given to #comlin_new_state.  Sizes include a null terminator, so an entry
+ * takes one byte more than its length.  When the total size exceeds the
+ * budget, entries are removed according to `policy`, except for the newest
+ * which is always kept.
+ *
+ * @param state The state to configure.
+ *
+ * @param max_bytes The maximum total size of all entries, or zero for no limit.
+ *
+ * @param max_entry_size The maximum size of a single entry, or zero for no
+ * limit.  Lines larger than this are silently not added to the history.
+ *
+ * @param policy The policy for choosing which entries to remove first.
+ *
+ * @return #COMLIN_SUCCESS.
+ */
+COMLIN_API ComlinStatus
+comlin_history_set_limits(ComlinState* state,
+                          size_t max_bytes,
+                          size_t max_entry_size,
+                          ComlinEvictionPolicy policy);
+
 /** Save the history in the specified file.
+ *
+ * This is equivalent to #comlin_history_save_as with #COMLIN_HISTORY_TEXT.
+ * If the history has metadata, then the file starts with a
+ * `#comlin-metadata` line, and each line is prefixed with it like
+ * `: TIME:DURATION:STATUS;`.  If frecency is recorded, then the score in
+ * thousandths is added as a fourth field, like `: TIME:DURATION:STATUS:SCORE;`.
+ * #comlin_history_load only parses this prefix if the file starts with that
+ * line or #COMLIN_MODE_HISTORY_METADATA is enabled, so other lines that
+ * happen to look like metadata are loaded unchanged.
  *
  * @return #COMLIN_SUCCESS if the history was saved, #COMLIN_NO_FILE if the
  * file couldn't be opened, or #COMLIN_BAD_WRITE if a write error occurred.
@@ -285,7 +784,45 @@ comlin_history_add(ComlinState* state, char const* line);
 COMLIN_API ComlinStatus
 comlin_history_save(ComlinState const* state, char const* filename);
 
+/** Save the history in the specified file with a specific format.
+ *
+ * The binary format has an index that allows entries to be accessed directly,
+ * so a large history can be loaded without reading every entry.
+ *
+ * If `filename` is a binary history file that is mapped by this state, then
+ * the history is written to a temporary file which then replaces the file
+ * that `filename` refers to, keeping its permissions, and its owner and group
+ * if possible.  Otherwise, `filename` is written in place.
+ *
+ * If indices for suggestions or word completion have been built, and
+ * `filename` is the file that the history was loaded from with
+ * #comlin_history_load, then the indices are also saved in a file with ".idx"
+ * appended to `filename`.  When the history is loaded into an empty state,
+ * these are loaded and brought up to date with any changes to the history
+ * file, rather than rebuilt from scratch.  Failure to write this file is not
+ * an error.
+ *
+ * @return #COMLIN_SUCCESS if the history was saved, #COMLIN_NO_FILE if the
+ * file couldn't be opened, or #COMLIN_BAD_WRITE if a write error occurred.
+ */
+COMLIN_API ComlinStatus
+comlin_history_save_as(ComlinState const* state,
+                       char const* filename,
+                       ComlinHistoryFormat format);
+
 /** Load the history from the specified file.
+ *
+ * The format of the file is detected automatically.  If the history is empty,
+ * then a binary history file is mapped into memory and entries are only read
+ * when they are used.  Saving history to the mapped file replaces the file
+ * rather than modifying it, so this is safe while other processes that have
+ * also mapped it save to the same file.  The size of the file is checked
+ * before the history is edited, searched, or saved, and if another program
+ * has truncated it in place, then any entries that were still only in the
+ * file are empty.  This can't prevent a crash if the file is truncated during
+ * one of these operations, so a binary history file should only be saved to
+ * by processes that have loaded it first.  Otherwise, the entries in the file
+ * are added to the history.
  *
  * @return #COMLIN_SUCCESS if the history was loaded, #COMLIN_NO_FILE if file
  * couldn't be opened, or #COMLIN_BAD_READ if a read error occurred.
@@ -14,18 +14,30 @@
  * - Add Win32 support.
  */
 
+#include "fuzzy.h"
+#include "grammar.h"
+#include "path.h"
+#include "prefix.h"
+#include "token.h"
+
 #include "comlin/comlin.h"
 
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -36,6 +48,9 @@
 // The two characters that begin a VT-100 escape sequence: `ESC [`
 #define VTESC "\x1B["
 
+// Number of entries in the kill ring
+#define N_KILLS 8U
+
 // A resizable buffer that contains a string
 typedef struct {
     char* data;    ///< Pointer to string buffer
@@ -43,11 +58,94 @@ typedef struct {
     size_t size;   ///< Size of data
 } StringBuf;
 
+/* A binary history file mapped into memory.
+ *
+ * The file starts with a header (an 8-byte magic string, a 32-bit version,
+ * 32 bits of flags, and a 64-bit entry count), followed by a table with the
+ * 64-bit offset of each entry.  If the metadata flag is set, this is followed
+ * by arrays of 64-bit times, 32-bit durations, and 32-bit statuses, then
+ * 32-bit frecency scores if the scores flag is also set.  Then come the
+ * entries themselves.  Each entry is a 32-bit length, the text, and a
+ * terminating null byte, so entries can be used directly as strings without
+ * copying.  All integers are little-endian.
+ */
+typedef struct {
+    char* data;        ///< Mapped file contents, or null
+    size_t size;       ///< Size of mapped file in bytes
+    size_t first;      ///< File index of the entry in the first history slot
+    size_t lazy_len;   ///< Number of leading history slots backed by the file
+    uint64_t* offsets; ///< Offsets of lazy entries once shifted, or null
+    bool* truncated;   ///< Set once the file is found to have been truncated
+    dev_t dev;         ///< Device of the mapped file
+    ino_t ino;         ///< Inode of the mapped file
+    int fd;            ///< Open descriptor of the mapped file
+} HistoryFile;
+
+// A history entry that matches a search, and its score
+typedef struct {
+    int32_t score; ///< Fuzzy match score
+    size_t index;  ///< Index of history entry
+} SearchMatch;
+
+// A history entry that can be evicted, ordered in a heap by size
+typedef struct {
+    size_t size; ///< Size of entry including the null terminator
+    uint64_t id; ///< Eviction ID of history entry
+} EvictionItem;
+
+// An edited copy of a history entry, discarded when the line is finished
+typedef struct {
+    size_t index; ///< Index of the original history entry
+    char* text;   ///< Edited text of the entry
+} HistoryEdit;
+
+// Killed text, as a span of the stream of all text written to the kill ring
+typedef struct {
+    size_t start; ///< Offset of the start of the text in the stream
+    size_t len;   ///< Length of the text
+} KillEntry;
+
+// An insertion or deletion of text in the line, which can be undone
+typedef struct {
+    size_t pos;    ///< Position of the text in the line
+    size_t offset; ///< Offset of the text in the undo text buffer
+    size_t len;    ///< Length of the text
+    bool insert;   ///< Text was inserted, otherwise it was deleted
+    bool joined;   ///< Part of the same step as the previous operation
+} UndoOp;
+
 typedef struct termios ComlinTerminalState;
 
 struct ComlinStateImpl {
     // Completion
     ComlinCompletionCallback* completion_callback; ///< Get completions
+    ComlinRangeCompletionCallback* range_callback; ///< Get range completions
+    ComlinStreamCompletionCallback* stream_callback; ///< Get more completions
+    size_t stream_batch;           ///< Maximum completions to stream at once
+    size_t stream_limit;           ///< Maximum completions to stream per line
+    bool stream_more;              ///< More completions can be streamed
+    ComlinGrammar const* grammar;  ///< Grammar of commands to complete
+    char* dictionary;              ///< Text of dictionary words
+    char** dictionary_words;       ///< Sorted distinct dictionary words
+    size_t* dictionary_lengths;    ///< Length of each dictionary word
+    size_t n_dictionary_words;     ///< Number of dictionary words
+    PathCache* paths;              ///< Cached directory listings, or null
+    StringBuf completion_line;     ///< Line with a completion applied
+    ComlinCompletions completions; ///< Cached completions for completion_key
+    StringBuf completion_key;      ///< Line that completions were made for
+    size_t completion_key_pos;     ///< Cursor position completions were made at
+    bool completions_cached;       ///< Completions are valid for completion_key
+
+    // Asynchronous completion
+    ComlinCompletionRequestCallback* completion_request; ///< Request them
+    StringBuf request_key;         ///< Line that completions were requested for
+    size_t request_key_pos;        ///< Cursor position of the request
+    uint64_t last_generation;      ///< Generation of the latest request
+    bool requesting;               ///< A request is outstanding
+    pthread_mutex_t mutex;         ///< Protects the following submission state
+    uint64_t pending_generation;   ///< Generation that can be submitted, or 0
+    ComlinCompletions submitted;   ///< Completions submitted for the request
+    bool has_submitted;            ///< Completions have been submitted
 
     // Terminal session state
     int ifd;       ///< Terminal stdin file descriptor
@@ -57,27 +155,106 @@ struct ComlinStateImpl {
     bool rawmode;  ///< Terminal is currently in raw mode
     bool mlmode;   ///< Multi-line mode (default is single line)
     bool dumb;     ///< True if terminal is unsupported (no features)
+    bool metamode; ///< Record history metadata
+    bool frecmode; ///< Record frecency and merge duplicate history entries
+    bool suggestmode; ///< Suggest the rest of the line from history
+    bool wordmode; ///< Complete words from history
+    bool narrowmode; ///< Filter previous completions as the line is extended
+    bool prefixmode; ///< Insert the common prefix of completions on Tab
+    bool menumode;   ///< Show completions in a menu below the line
+    bool pathmode;   ///< Complete file paths
 
     // History
-    size_t history_max_len; ///< Maximum number of history entries to keep
-    size_t history_len;     ///< Number of history entries
-    char** history;         ///< History entries
+    size_t history_max_len;   ///< Maximum number of history entries to keep
+    size_t history_max_bytes; ///< Maximum total size of entries, or zero
+    size_t history_max_entry; ///< Maximum size of a single entry, or zero
+    size_t history_bytes;     ///< Total size of entries including terminators
+    size_t history_len;       ///< Number of history entries
+    char** history;           ///< History entries (null if not yet decoded)
+    size_t* history_sizes;    ///< Entry sizes (zero if not yet decoded)
+    uint64_t* history_seqs;   ///< Entry sequence numbers in prefixes, or zero
+    HistoryFile history_file; ///< Mapped binary history file
+    ComlinEvictionPolicy history_policy; ///< Which entries to evict first
+    EvictionItem* evictions;  ///< Heap of entries by size, or null
+    size_t n_evictions;       ///< Number of entries in eviction heap
+    uint64_t* eviction_ids;   ///< Entry IDs in heap, increasing with index
+    size_t* eviction_slots;   ///< Position of each entry's item in heap
+    uint64_t eviction_id;     ///< Eviction ID of newest entry
+    PrefixIndex* prefixes;    ///< Index of entries by prefix, or null
+    PrefixIndex* words;       ///< Index of entry tokens by prefix, or null
+    uint64_t history_seq;     ///< Sequence number of newest indexed entry
+    StringBuf history_path;   ///< File the history was loaded from, or empty
+
+    // History metadata columns (null if metadata isn't recorded)
+    int64_t* history_times;      ///< Time each entry was entered
+    uint32_t* history_durations; ///< Time spent editing each entry
+    int32_t* history_statuses;   ///< Application status of each entry
+    uint32_t* history_scores;    ///< Frecency of each entry in thousandths
 
     // Terminal state
     ComlinTerminalState cooked; ///< Terminal settings before raw mode
 
     // Line editing state
-    StringBuf buf;         ///< Editing line buffer
+    StringBuf buf;         ///< Editing line buffer, with any gap at gap_pos
+    size_t gap_pos;        ///< Position of the gap in the line
+    size_t gap_len;        ///< Length of the gap in the line, or zero
     char const* prompt;    ///< Prompt to display
     size_t plen;           ///< Prompt length
     size_t pos;            ///< Current cursor position
     size_t history_index;  ///< The history index we're currently editing
+    HistoryEdit* edits;    ///< Edited history entries
+    size_t n_edits;        ///< Number of edited history entries
+    struct timespec start; ///< Time the edit started
+    ComlinHistoryMetadata entered; ///< Metadata of the entered line
+    StringBuf suggestion;  ///< Suggested rest of the line from history
     bool in_completion;    ///< Currently doing a completion
     size_t completion_idx; ///< Index of next completion to propose
-
-    // Multi-line refresh state
-    size_t oldpos;  ///< Previous refresh cursor position
-    size_t oldrows; ///< Rows used by last refreshed line (multi-line)
+    bool yanking;          ///< Last key inserted a previous argument
+    bool was_yanking;      ///< Key before this one inserted an argument
+    size_t yank_entry;     ///< Index of entry the argument was taken from
+    size_t yank_len;       ///< Length of inserted argument before cursor
+    UndoOp* undo_ops;      ///< Ring of edits that can be undone or redone
+    size_t undo_first;     ///< Slot of the oldest operation in the ring
+    size_t n_undo_ops;     ///< Number of operations in the undo log
+    size_t undo_len;       ///< Number of operations that are done
+    StringBuf undo_text;   ///< Text of all operations in the undo log
+    bool typing;           ///< Last key inserted a character
+    bool was_typing;       ///< Key before this one inserted a character
+
+    // Kill ring state
+    char* kill_text;           ///< Ring buffer of killed text, or null
+    KillEntry kills[N_KILLS];  ///< Ring of killed text entries
+    size_t n_kills;            ///< Number of entries in the kill ring
+    size_t kill_head;          ///< Index of the newest entry
+    size_t kill_end;           ///< Total length of text written to the ring
+    size_t kill_age;           ///< Age of the last yanked entry, newest is 0
+    bool killing;              ///< Last key killed text
+    bool was_killing;          ///< Key before this one killed text
+    bool kill_yanking;         ///< Last key yanked killed text
+    bool was_kill_yanking;     ///< Key before this one yanked killed text
+
+    // History search state
+    bool in_search;            ///< Currently searching history
+    StringBuf search_query;    ///< Search pattern
+    StringBuf search_prompt;   ///< Prompt shown while searching
+    StringBuf search_line;     ///< Line before the search started
+    char const* saved_prompt;  ///< Prompt to restore after searching
+    SearchMatch* matches;      ///< Matching history entries, best first
+    size_t n_matches;          ///< Number of matching history entries
+    size_t match_idx;          ///< Index of currently shown match
+
+    // Refresh state
+    size_t oldpos;        ///< Previous refresh cursor position
+    size_t oldrows;       ///< Rows used by last refreshed line (multi-line)
+    bool refresh_pending; ///< Refresh skipped while more input was ready
+
+    // Completion menu state
+    size_t menu_width;     ///< Width of menu columns, or zero if not laid out
+    size_t menu_cols;      ///< Number of menu columns
+    size_t menu_rows;      ///< Number of menu rows shown, or zero if hidden
+    size_t menu_page;      ///< Index of the menu page shown
+    size_t menu_selected;  ///< Index of the highlighted completion
+    size_t menu_line_rows; ///< Rows used by the line when the menu was shown
 };
 
 static char const* const unsupported_term[] = {"dumb", "cons25", "emacs", NULL};
@@ -85,6 +262,9 @@ static char const* const unsupported_term[] = {"dumb", "cons25", "emacs", NULL};
 static void
 buf_append(StringBuf* buf, char const* s, size_t len);
 
+static void
+buf_free(StringBuf* buf);
+
 static ComlinStatus
 refresh_line_with_completion(ComlinState* ls,
                              ComlinCompletions const* lc,
@@ -93,12 +273,64 @@ refresh_line_with_completion(ComlinState* ls,
 static ComlinStatus
 refresh_line_with_flags(ComlinState* l, unsigned flags);
 
+static ComlinStatus
+refresh_menu(ComlinState* l, ComlinCompletions const* lc);
+
+static char*
+line_close_gap(ComlinState* l);
+
+static bool
+line_equals(ComlinState const* l, char const* text, size_t len);
+
+static void
+line_replace(ComlinState* l, char const* text, size_t len);
+
+static ComlinStatus
+clear_menu(ComlinState* l);
+
+static char const*
+history_get(ComlinState const* state, size_t index);
+
+static size_t
+history_size(ComlinState const* state, size_t index);
+
+static double
+history_frecency(ComlinState const* state, size_t index, int64_t now);
+
+static ComlinStatus
+history_index_prefixes(ComlinState* state);
+
+static ComlinStatus
+history_index_words(ComlinState* state);
+
+static void
+history_free_entry(ComlinState const* state, char* entry);
+
+static void
+history_file_check(HistoryFile const* file);
+
+static void
+history_file_unmap(HistoryFile* file);
+
+static void
+history_remove(ComlinState* state, size_t index);
+
+static void
+history_unindex_sizes(ComlinState* state);
+
 typedef enum {
+    CTRL_A = 1,   // ^A (SOH)
+    CTRL_B = 2,   // ^B (STX)
     CTRL_C = 3,   // ^C (ETX)
     CTRL_D = 4,   // ^D (EOT)
+    CTRL_E = 5,   // ^E (ENQ)
+    CTRL_F = 6,   // ^F (ACK)
+    CTRL_G = 7,   // ^G (BEL)
+    CTRL_H = 8,   // ^H (BS)
     TAB = 9,      // ^I (HT) - Tab
     LFEED = 10,   // ^J (LF) - Usually "Enter" or "Return"
     CRETURN = 13, // ^M (CR) - Carriage Return
+    CTRL_R = 18,  // ^R (DC2)
     ESC = 27,     // ^[ (ESC)
     DEL = 127     // ^? (DEL) - Usually "Backspace"
 } ControlCharacter;
@@ -302,726 +534,3081 @@ comlin_beep(ComlinState const* const state)
 
 /* Completion */
 
-// Free a list of completion option populated by comlin_add_completion()
-static void
-free_completions(ComlinCompletions* const lc)
-{
-    for (size_t i = 0U; i < lc->len; ++i) {
-        free(lc->cvec[i]);
-    }
-    if (lc->cvec != NULL) {
-        free(lc->cvec);
-    }
-}
+/* A block of memory that completion strings are allocated from.
+ *
+ * Each block is at least twice the size of the previous one, so adding many
+ * completions only takes a few allocations, and they are freed all at once.
+ */
+struct ArenaBlockImpl {
+    struct ArenaBlockImpl* next; ///< Previous smaller block, or null
+    size_t size;                 ///< Size of data in bytes
+    size_t used;                 ///< Number of bytes of data used
+    char data[];                 ///< Strings
+};
 
-// Show the current line with the proposed completion
-static ComlinStatus
-refresh_line_with_completion(ComlinState* const ls,
-                             ComlinCompletions const* const lc,
-                             unsigned const flags)
-{
-    // Show the edited line with completion if possible, or just refresh
-    if (ls->completion_idx < lc->len) {
-        size_t const saved_pos = ls->pos;
-        StringBuf const saved_buf = ls->buf;
-        ls->buf.data = lc->cvec[ls->completion_idx];
-        ls->pos = ls->buf.length = strlen(ls->buf.data);
-        refresh_line_with_flags(ls, flags);
-        ls->buf = saved_buf;
-        ls->pos = saved_pos;
-        return COMLIN_SUCCESS;
-    }
-    return refresh_line_with_flags(ls, flags);
-}
+typedef struct ArenaBlockImpl ComlinArena;
 
-/* Helper for when the user presses Tab, or another key during completion.
+/* Private data for a set of completions.
  *
- * If the return is non-zero, it should be handled as a byte read from the
- * input, and process it as usual.  Otherwise, the character was consumed by
- * this function.
+ * The public completions are only a count and an array of strings, so that
+ * their layout is stable.  Everything else is kept in this header, which is
+ * allocated along with the array of strings, immediately before it.  The data
+ * of each completion has the same index as its string, but the application
+ * may reorder or remove strings, so the string that each was added with is
+ * recorded as well, so they can be matched up again afterwards.
  */
-static char
-complete_line(ComlinState* const ls, char const keypressed)
-{
-    ComlinCompletions lc = {0, NULL};
-    char c = keypressed;
+typedef struct {
+    size_t capacity;      ///< Allocated size of cvec and the arrays here
+    size_t count;         ///< Number of completions when last matched
+    char const** strings; ///< String that each completion was added with
+    size_t* lengths;      ///< Length of each string in cvec
+    ComlinRange* ranges;  ///< Ranges replaced, or null for whole line
+    ComlinArena* arena;   ///< Memory that strings are allocated from
+} CompletionsData;
+
+// An added completion string and its index, for matching data to strings
+typedef struct {
+    uintptr_t string; ///< Address of the string
+    size_t index;     ///< Index of the data for the string
+} CompletionOrigin;
 
-    if (ls->buf.length) {
-        ls->completion_callback(ls->buf.data, &lc);
-    }
+// The range of a completion that replaces the whole line
+static ComlinRange const whole_line = {0U, SIZE_MAX};
 
-    if (lc.len == 0) {
-        comlin_beep(ls);
-        ls->in_completion = false;
-    } else {
-        switch (c) {
-        case TAB:
-            if (!ls->in_completion) {
-                ls->in_completion = true;
-                ls->completion_idx = 0;
-            } else {
-                ls->completion_idx = (ls->completion_idx + 1) % (lc.len + 1);
-                if (ls->completion_idx == lc.len) {
-                    comlin_beep(ls);
-                }
-            }
-            c = 0;
-            break;
-        case ESC:
-            // Re-show original buffer
-            if (ls->completion_idx < lc.len) {
-                comlin_edit_refresh(ls);
-            }
-            ls->in_completion = false;
-            c = 0;
-            break;
-        default:
-            // Update buffer and return
-            if (ls->completion_idx < lc.len) {
-                ls->pos = strlen(lc.cvec[ls->completion_idx]);
-                ls->buf.length = 0U;
-                buf_append(&ls->buf, lc.cvec[ls->completion_idx], ls->pos);
-            }
-            ls->in_completion = false;
-            break;
-        }
+// Size of the first block in a completions arena
+static size_t const min_arena_size = 4096U;
 
-        // Show completion or original buffer
-        if (ls->in_completion) {
-            refresh_line_with_completion(ls, &lc, REFRESH_ALL);
-        } else {
-            comlin_edit_refresh(ls);
-        }
-    }
+// Initial number of completions to allocate pointers for
+static size_t const min_completions_capacity = 16U;
 
-    free_completions(&lc);
-    return c; // Return last read character
+// Return the private data of some completions, which must have been added
+static CompletionsData*
+completions_data(ComlinCompletions const* const lc)
+{
+    assert(lc->cvec);
+    return (CompletionsData*)(void*)lc->cvec - 1;
 }
 
-void
-comlin_set_completion_callback(ComlinState* const state,
-                               ComlinCompletionCallback* const fn)
+// Return the length of a completion
+static size_t
+completion_length(ComlinCompletions const* const lc, size_t const i)
 {
-    state->completion_callback = fn;
+    return completions_data(lc)->lengths[i];
 }
 
-static char*
-comlin_copy_string(char const* const str)
+// Return true if any completion replaces only a range of the line
+static bool
+completions_have_ranges(ComlinCompletions const* const lc)
 {
-    size_t const len = strlen(str);
-    size_t const total_size = len + 1U;
-    char* const copy = (char*)malloc(total_size);
+    return lc->cvec && completions_data(lc)->ranges;
+}
 
-    if (copy) {
-        memcpy(copy, str, total_size);
-    }
+// Return the range of the line replaced by a completion
+static ComlinRange
+completion_range(ComlinCompletions const* const lc, size_t const i)
+{
+    CompletionsData const* const data = completions_data(lc);
+    return data->ranges ? data->ranges[i] : whole_line;
+}
 
-    return copy;
+// Order completion origins by the address of their string
+static int
+compare_origins(void const* const a, void const* const b)
+{
+    uintptr_t const lhs = ((CompletionOrigin const*)a)->string;
+    uintptr_t const rhs = ((CompletionOrigin const*)b)->string;
+
+    return (lhs < rhs) ? -1 : (lhs > rhs) ? 1 : 0;
 }
 
-ComlinStatus
-comlin_add_completion(ComlinCompletions* const lc, char const* const str)
+/* Match the data of completions to their strings after the application has
+ * had access to them.
+ *
+ * If strings have been reordered or removed, then the data of each is found
+ * by the string it was added with.  Strings that weren't added are treated as
+ * replacing the whole line.  Since the count can only be increased by adding
+ * completions, it's limited to the number that were added.
+ */
+static void
+sync_completions(ComlinCompletions* const lc)
 {
-    size_t const cvec_size = sizeof(char*) * (lc->len + 1U);
-    char** const cvec = (char**)realloc(lc->cvec, cvec_size);
-    if (!cvec) {
-        return COMLIN_NO_MEMORY;
+    if (!lc->cvec) {
+        return;
     }
 
-    lc->cvec = cvec;
+    CompletionsData* const data = completions_data(lc);
+    lc->len = (lc->len < data->count) ? lc->len : data->count;
 
-    char* const copy = comlin_copy_string(str);
-    if (!copy) {
-        return COMLIN_NO_MEMORY;
+    size_t i = 0U;
+    while (i < lc->len && lc->cvec[i] == data->strings[i]) {
+        ++i;
     }
 
-    lc->cvec[lc->len++] = copy;
-    return COMLIN_SUCCESS;
-}
-
-/* String Buffer */
+    size_t const n = data->count;
+    data->count = lc->len;
+    if (i == lc->len) {
+        return;
+    }
 
-static void
-buf_append(StringBuf* const buf, char const* const s, size_t const len)
-{
-    assert(s);
+    // Sort the original strings so the data for each can be found quickly
+    CompletionOrigin* const origins =
+      (CompletionOrigin*)malloc(sizeof(CompletionOrigin) * n);
+    size_t* const lengths = (size_t*)malloc(sizeof(size_t) * n);
+    ComlinRange* const ranges =
+      data->ranges ? (ComlinRange*)malloc(sizeof(ComlinRange) * n) : NULL;
+    bool const ok = origins && lengths && (ranges || !data->ranges);
+    if (ok) {
+        for (size_t k = 0U; k < n; ++k) {
+            origins[k].string = (uintptr_t)data->strings[k];
+            origins[k].index = k;
+        }
 
-    size_t const new_length = buf->length + len;
-    size_t const needed_size = new_length + 1U;
-    if (needed_size > buf->size) {
-        char* const new_data = (char*)realloc(buf->data, needed_size);
-        if (!new_data) {
-            return;
+        memcpy(lengths, data->lengths, sizeof(size_t) * n);
+        if (ranges) {
+            memcpy(ranges, data->ranges, sizeof(ComlinRange) * n);
         }
 
-        buf->data = new_data;
-        buf->size = needed_size;
+        qsort(origins, n, sizeof(CompletionOrigin), compare_origins);
     }
 
-    assert(buf->data);
-    memcpy(buf->data + buf->length, s, len);
-    buf->data[new_length] = '\0';
-    buf->length = new_length;
+    for (size_t k = i; k < lc->len; ++k) {
+        CompletionOrigin const key = {(uintptr_t)lc->cvec[k], 0U};
+        CompletionOrigin const* const origin =
+          ok ? (CompletionOrigin const*)bsearch(
+                 &key, origins, n, sizeof(CompletionOrigin), compare_origins)
+             : NULL;
+
+        data->strings[k] = lc->cvec[k];
+        data->lengths[k] =
+          origin ? lengths[origin->index] : strlen(lc->cvec[k]);
+        if (data->ranges) {
+            data->ranges[k] = origin ? ranges[origin->index] : whole_line;
+        }
+    }
+
+    free(ranges);
+    free(lengths);
+    free(origins);
 }
 
-static size_t
-format_size(char* const buf, size_t x)
+// Allocate memory for a string from an arena, or return null
+static char*
+arena_alloc(ComlinArena** const arena, size_t const size)
 {
-    size_t i = 0U;
-
-    // Write digits backwards
-    do {
-        buf[i++] = (char)('0' + (x % 10U));
-        x /= 10U;
-    } while (x);
-
-    // Terminate and reverse string
-    buf[i] = '\0';
-    if (i) {
-        for (size_t l = 0U, r = i - 1U; l < r; ++l, --r) {
-            char const t = buf[l];
-            buf[l] = buf[r];
-            buf[r] = t;
+    ComlinArena* block = *arena;
+    if (!block || block->size - block->used < size) {
+        size_t const prev_size = block ? block->size : min_arena_size / 2U;
+        size_t const new_size = (size > prev_size * 2U) ? size : prev_size * 2U;
+        if (!(block = (ComlinArena*)malloc(sizeof(ComlinArena) + new_size))) {
+            return NULL;
         }
+
+        block->next = *arena;
+        block->size = new_size;
+        block->used = 0U;
+        *arena = block;
     }
 
-    return i;
+    char* const ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
 }
 
-// Append an escape like `ESC [ n s` with a number and a suffix letter
-static void
-buf_append_vtesc(StringBuf* const buf, size_t const num, char const suffix)
+void
+comlin_free_completions(ComlinCompletions* const lc)
 {
-    size_t end = 2U;
-    char seq[64] = {'\x1B', '[', 0};
+    if (lc->cvec) {
+        CompletionsData* const data = completions_data(lc);
+        for (ComlinArena* b = data->arena; b;) {
+            ComlinArena* const next = b->next;
+            free(b);
+            b = next;
+        }
 
-    end += format_size(seq + 2U, num);
-    seq[end++] = suffix;
+        free(data->ranges);
+        free(data->lengths);
+        free(data->strings);
+        free(data);
+    }
 
-    buf_append(buf, seq, end);
+    memset(lc, 0, sizeof(ComlinCompletions));
 }
 
+// Discard any cached completions so they are fetched again when needed
 static void
-buf_free(StringBuf* const buf)
+clear_completions(ComlinState* const ls)
 {
-    free(buf->data);
+    comlin_free_completions(&ls->completions);
+    ls->completions_cached = false;
+    ls->stream_more = false;
+    ls->menu_width = 0U;
 }
 
-static void
-append_line_text(StringBuf* const buf,
-                 char const* const text,
-                 size_t const length,
-                 bool const masked)
+// Make room to add a completion
+static ComlinStatus
+grow_completions(ComlinCompletions* const lc)
 {
-    if (masked) {
-        for (size_t i = 0U; i < length; ++i) {
-            buf_append(buf, "*", 1);
-        }
-    } else {
-        buf_append(buf, text, length);
+    CompletionsData* data = lc->cvec ? completions_data(lc) : NULL;
+    size_t const old_capacity = data ? data->capacity : 0U;
+    if (lc->len < old_capacity) {
+        return COMLIN_SUCCESS;
     }
-}
 
-/* Refresh */
+    // Grow the arrays geometrically so adding completions is amortised O(1)
+    size_t const capacity =
+      old_capacity ? old_capacity * 2U : min_completions_capacity;
 
-// Clear and refresh the current line in single-line mode
-static ComlinStatus
-refresh_single_line(ComlinState const* const l, ComlinRefreshFlags const flags)
-{
-    // Chop the start if necessary so the cursor is on screen
-    char* buf = l->buf.data;
-    size_t len = l->buf.length;
-    size_t pos = l->pos;
-    if (l->plen + l->pos >= l->cols) {
-        size_t const offset = l->plen + l->pos + 1U - l->cols;
-        buf += offset;
-        len -= offset;
-        pos -= offset;
+    bool const first = !data;
+    if (!(data = (CompletionsData*)realloc(
+            data, sizeof(CompletionsData) + (sizeof(char*) * capacity)))) {
+        return COMLIN_NO_MEMORY;
     }
 
-    // Truncate display length to fit on the row
-    if (l->plen + len > l->cols) {
-        len = l->cols - l->plen;
+    if (first) {
+        memset(data, 0, sizeof(CompletionsData));
     }
 
-    // Start building an update for the whole row (to be sent in one write)
-    StringBuf update = {NULL, 0U, 0U};
-    buf_append(&update, "\r", 1);
+    lc->cvec = (char**)(void*)(data + 1);
 
-    if (flags & REFRESH_WRITE) {
-        // Write the prompt and the current buffer content
-        buf_append(&update, l->prompt, l->plen);
-        append_line_text(&update, buf, len, l->maskmode);
+    char const** const strings =
+      (char const**)realloc(data->strings, sizeof(char*) * capacity);
+    if (!strings) {
+        return COMLIN_NO_MEMORY;
     }
 
-    // Erase to right
-    buf_append(&update, VTESC "0K", 4);
+    data->strings = strings;
 
-    if (flags & REFRESH_WRITE) {
-        // Move cursor to original position
-        buf_append(&update, "\r", 1);
-        buf_append_vtesc(&update, pos + l->plen, 'C');
+    size_t* const lengths =
+      (size_t*)realloc(data->lengths, sizeof(size_t) * capacity);
+    if (!lengths) {
+        return COMLIN_NO_MEMORY;
     }
 
-    ComlinStatus const st = write_string(l->ofd, update.data, update.length);
-    buf_free(&update);
-    return st;
+    data->lengths = lengths;
+
+    if (data->ranges) {
+        ComlinRange* const ranges = (ComlinRange*)realloc(
+          data->ranges, sizeof(ComlinRange) * capacity);
+        if (!ranges) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        data->ranges = ranges;
+    }
+
+    data->capacity = capacity;
+    return COMLIN_SUCCESS;
 }
 
-// Refresh the current line in multi-line mode
+// Allocate ranges for completions, where existing ones replace the line
 static ComlinStatus
-refresh_multi_line(ComlinState* const l, ComlinRefreshFlags const flags)
+reserve_completion_ranges(ComlinCompletions* const lc)
 {
-    size_t const rpos = (l->plen + l->oldpos + l->cols) / l->cols;
-    size_t const old_rows = l->oldrows;
-    int const fd = l->ofd;
+    ComlinStatus const st = lc->cvec ? COMLIN_SUCCESS : grow_completions(lc);
+    CompletionsData* const data = completions_data(lc);
+    if (st || data->ranges) {
+        return st;
+    }
 
-    // Calculate the total number of rows in the line
-    size_t rows = (l->plen + l->buf.length + l->cols - 1U) / l->cols;
-    l->oldrows = rows;
+    if (!(data->ranges =
+            (ComlinRange*)malloc(sizeof(ComlinRange) * data->capacity))) {
+        return COMLIN_NO_MEMORY;
+    }
 
-    // We'll build the update here, then send it all in a single write
-    StringBuf update = {NULL, 0U, 0U};
+    for (size_t i = 0U; i < data->count; ++i) {
+        data->ranges[i] = whole_line;
+    }
 
-    // First clear all the old used rows
-    if (flags & REFRESH_CLEAN) {
-        // Go to the last row
-        if (old_rows > rpos) {
-            buf_append_vtesc(&update, old_rows - rpos, 'B');
-        }
+    return COMLIN_SUCCESS;
+}
 
-        // For each row, clear it, then move up
-        for (size_t j = 1U; j < old_rows; ++j) {
-            buf_append(&update, "\r" VTESC "0K" VTESC "1A", 9U);
-        }
+// Add a completion string without copying it, with room already reserved
+static void
+push_completion(ComlinCompletions* const lc,
+                ComlinRange const range,
+                char* const str,
+                size_t const len)
+{
+    CompletionsData* const data = completions_data(lc);
+    lc->cvec[lc->len] = str;
+    data->strings[lc->len] = str;
+    data->lengths[lc->len] = len;
+    if (data->ranges) {
+        data->ranges[lc->len] = range;
     }
 
-    if (flags & REFRESH_WRITE) {
-        // Write the current prompt and line over the current row
-        buf_append(&update, "\r", 1);
-        buf_append(&update, l->prompt, l->plen);
-        append_line_text(&update, l->buf.data, l->buf.length, l->maskmode);
-        buf_append(&update, VTESC "0K", 4U);
-
-        // If we're at the end of the row, move to the start of the next
-        if (l->pos && l->pos == l->buf.length &&
-            (l->pos + l->plen) % l->cols == 0) {
-            buf_append(&update, "\n\r", 2);
-            if (++rows > l->oldrows) {
-                l->oldrows = rows;
-            }
-        }
+    data->count = ++lc->len;
+}
 
-        // Move the cursor up to the correct row if necessary
-        size_t const rpos2 = (l->plen + l->pos + l->cols) / l->cols;
-        if (rows > rpos2) {
-            buf_append_vtesc(&update, rows - rpos2, 'A');
-        }
+// Add a completion that replaces a range of the line
+static ComlinStatus
+add_completion(ComlinCompletions* const lc,
+               ComlinRange const range,
+               char const* const str,
+               size_t const len)
+{
+    ComlinStatus const st = grow_completions(lc);
+    if (st) {
+        return st;
+    }
 
-        // Move the cursor to the correct column
-        buf_append(&update, "\r", 1);
-        size_t const col = (l->plen + l->pos) % l->cols;
-        if (col) {
-            buf_append_vtesc(&update, col, 'C');
-        }
+    char* const copy = arena_alloc(&completions_data(lc)->arena, len + 1U);
+    if (!copy) {
+        return COMLIN_NO_MEMORY;
     }
 
-    l->oldpos = l->pos;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    push_completion(lc, range, copy, len);
+    return COMLIN_SUCCESS;
+}
 
-    ComlinStatus const st = write_string(fd, update.data, update.length);
-    buf_free(&update);
-    return st;
+/* Write the line with a completion applied to a buffer.
+ *
+ * Returns the cursor position after the inserted text.  If memory allocation
+ * fails, then `out` will be shorter than expected.
+ */
+static size_t
+apply_completion(StringBuf* const out,
+                 StringBuf const* const line,
+                 ComlinCompletions const* const lc,
+                 size_t const i)
+{
+    ComlinRange const range = completion_range(lc, i);
+    size_t const len = completion_length(lc, i);
+    size_t const start = (range.start < line->length) ? range.start
+                                                      : line->length;
+    size_t end = (range.end < line->length) ? range.end : line->length;
+    end = (end < start) ? start : end;
+
+    out->length = 0U;
+    buf_append(out, line->data, start);
+    buf_append(out, lc->cvec[i], len);
+    buf_append(out, line->data + end, line->length - end);
+    return start + len;
 }
 
-// Optionally clear and/or refresh the current line
+// Show the current line with the proposed completion
 static ComlinStatus
-refresh_line_with_flags(ComlinState* const l, ComlinRefreshFlags const flags)
+refresh_line_with_completion(ComlinState* const ls,
+                             ComlinCompletions const* const lc,
+                             unsigned const flags)
 {
-    return l->mlmode ? refresh_multi_line(l, flags)
-                     : refresh_single_line(l, flags);
+    // Show the edited line with completion if possible, or just refresh
+    ComlinStatus st = COMLIN_SUCCESS;
+    if (ls->completion_idx < lc->len) {
+        size_t const saved_pos = ls->pos;
+        StringBuf const saved_buf = ls->buf;
+        if (completions_have_ranges(lc)) {
+            StringBuf* const line = &ls->completion_line;
+            ls->pos = apply_completion(line, &ls->buf, lc, ls->completion_idx);
+            ls->buf = line->data ? *line : saved_buf;
+            ls->pos = (ls->pos <= ls->buf.length) ? ls->pos : ls->buf.length;
+        } else {
+            ls->buf.data = lc->cvec[ls->completion_idx];
+            ls->pos = ls->buf.length =
+              completion_length(lc, ls->completion_idx);
+        }
+
+        if (!(st = refresh_line_with_flags(ls, flags)) &&
+            (flags & REFRESH_WRITE)) {
+            st = refresh_menu(ls, lc);
+        }
+
+        ls->buf = saved_buf;
+        ls->pos = saved_pos;
+        return st;
+    }
+
+    st = refresh_line_with_flags(ls, flags);
+    return (st || !(flags & REFRESH_WRITE)) ? st : refresh_menu(ls, lc);
 }
 
-ComlinStatus
-comlin_hide(ComlinState* const l)
+// Maximum number of words from history to offer as completions
+static size_t const max_word_completions = 16U;
+
+// Completion state for completing a word from history
+typedef struct {
+    ComlinRange range;     ///< Range of the word in the line
+    ComlinCompletions* lc; ///< Completions to add to
+} WordCompletion;
+
+// Add a completion for a word from history
+static void
+add_word_completion(void* const data, char const* const text, size_t const len)
 {
-    return refresh_line_with_flags(l, REFRESH_CLEAN);
+    WordCompletion* const wc = (WordCompletion*)data;
+    if (len > wc->range.end - wc->range.start) {
+        comlin_add_completion_range(
+          wc->lc, wc->range.start, wc->range.end, text, len);
+    }
 }
 
-ComlinStatus
-comlin_show(ComlinState* const l)
+// Add completions for the last word in the line from words in the history
+static void
+complete_word(ComlinState* const ls, ComlinCompletions* const lc)
 {
-    if (l->in_completion && l->buf.length) {
-        ComlinCompletions completions = {0U, NULL};
-        l->completion_callback(l->buf.data, &completions);
-        return refresh_line_with_completion(l, &completions, REFRESH_WRITE);
+    char const* const text = ls->buf.data;
+    size_t const start = token_last(text, ls->buf.length);
+    size_t const word_len = ls->buf.length - start;
+    if (!word_len || token_is_space(text[ls->buf.length - 1U]) ||
+        history_index_words(ls)) {
+        return;
     }
 
-    return refresh_line_with_flags(l, REFRESH_WRITE);
+    WordCompletion wc = {{start, ls->buf.length}, lc};
+    prefix_index_visit(ls->words,
+                       text + start,
+                       word_len,
+                       max_word_completions,
+                       add_word_completion,
+                       &wc);
 }
 
-/* Editing Operations */
-
-static inline ComlinStatus
-edit_status(ComlinStatus const st)
+// Order strings for sorting a dictionary
+static int
+compare_words(void const* const a, void const* const b)
 {
-    return st ? st : COMLIN_EDITING;
+    return strcmp(*(char const* const*)a, *(char const* const*)b);
 }
 
-static ComlinStatus
-comlin_edit_refresh(ComlinState* const l)
+// Free the completion dictionary
+static void
+free_dictionary(ComlinState* const ls)
 {
-    return edit_status(refresh_line_with_flags(l, REFRESH_ALL));
+    free(ls->dictionary_lengths);
+    free(ls->dictionary_words);
+    free(ls->dictionary);
+    ls->dictionary_lengths = NULL;
+    ls->dictionary_words = NULL;
+    ls->dictionary = NULL;
+    ls->n_dictionary_words = 0U;
 }
 
-// Insert a character at the current cursor position
-static ComlinStatus
-comlin_edit_insert(ComlinState* const l, char const c)
+/* Add completions for the word before the cursor from the dictionary.
+ *
+ * The words are sorted, so those that start with the word are found with a
+ * binary search, then added without copying, since the dictionary outlives
+ * the completions.
+ */
+static void
+complete_dictionary(ComlinState* const ls, ComlinCompletions* const lc)
 {
-    if (l->buf.length == l->pos) {
-        // Insert at end of line
-        buf_append(&l->buf, &c, 1U);
-        ++l->pos;
-        if ((!l->mlmode || l->oldrows <= 1U) &&
-            l->plen + l->buf.length < l->cols) {
-            // Avoid a full update of the line in the trivial case
-            char const d = (char)(l->maskmode ? '*' : c);
-            return write(l->ofd, &d, 1) == 1 ? COMLIN_EDITING
-                                             : COMLIN_BAD_WRITE;
+    char const* const text = ls->buf.data;
+    size_t const start = token_last(text, ls->pos);
+    size_t const word_len = ls->pos - start;
+    if (!word_len || token_is_space(text[ls->pos - 1U]) ||
+        reserve_completion_ranges(lc)) {
+        return;
+    }
+
+    // Find the first word that isn't less than the prefix
+    char const* const prefix = text + start;
+    size_t lo = 0U;
+    size_t hi = ls->n_dictionary_words;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        if (strncmp(ls->dictionary_words[mid], prefix, word_len) < 0) {
+            lo = mid + 1U;
+        } else {
+            hi = mid;
         }
-    } else {
-        // Insert in middle of line
-        buf_append(&l->buf, " ", 1U); // Allocate space for one extra character
-        memmove(l->buf.data + l->pos + 1,
-                l->buf.data + l->pos,
-                l->buf.length - l->pos);
-        l->buf.data[l->pos] = c;
-        ++l->pos;
     }
 
-    return comlin_edit_refresh(l);
-}
+    // Add every word that starts with the prefix
+    ComlinRange const range = {start, ls->pos};
+    for (size_t i = lo; i < ls->n_dictionary_words; ++i) {
+        char* const word = ls->dictionary_words[i];
+        size_t const len = ls->dictionary_lengths[i];
+        if (len < word_len || memcmp(word, prefix, word_len) ||
+            grow_completions(lc)) {
+            break;
+        }
 
-// Move cursor one column to the left if possible
-static ComlinStatus
-comlin_edit_move_left(ComlinState* const l)
-{
-    if (l->pos > 0) {
-        --l->pos;
-        return comlin_edit_refresh(l);
+        if (len > word_len) {
+            push_completion(lc, range, word, len);
+        }
     }
-    return COMLIN_EDITING;
 }
 
-// Move cursor one column to the right if possible
-static ComlinStatus
-comlin_edit_move_right(ComlinState* const l)
+// Add completions for the file path before the cursor
+static void
+complete_path(ComlinState* const ls, ComlinCompletions* const lc)
 {
-    if (l->pos != l->buf.length) {
-        ++l->pos;
-        return comlin_edit_refresh(l);
+    char const* const text = ls->buf.data;
+    size_t const pos = ls->pos;
+    size_t start = pos;
+    while (start && !token_is_space(text[start - 1U])) {
+        --start;
     }
-    return COMLIN_EDITING;
-}
 
-// Move cursor to the start of the line
-static ComlinStatus
-comlin_edit_move_home(ComlinState* const l)
-{
-    if (l->pos != 0) {
-        l->pos = 0;
-        return comlin_edit_refresh(l);
+    // Split the word into a directory and the start of an entry in it
+    size_t base = pos;
+    while (base > start && text[base - 1U] != '/') {
+        --base;
     }
-    return COMLIN_EDITING;
-}
 
-// Move cursor to the end of the line
-static ComlinStatus
-comlin_edit_move_end(ComlinState* const l)
-{
-    if (l->pos != l->buf.length) {
-        l->pos = l->buf.length;
-        return comlin_edit_refresh(l);
+    StringBuf dir = {NULL, 0U, 0U};
+    if (base > start) {
+        buf_append(&dir, text + start, base - start);
+    } else {
+        buf_append(&dir, ".", 1U);
     }
-    return COMLIN_EDITING;
+
+    if (!ls->paths) {
+        ls->paths = path_cache_new();
+    }
+
+    PathEntry const* entries = NULL;
+    size_t n_entries = 0U;
+    if (!dir.data || !ls->paths ||
+        path_cache_find(ls->paths,
+                        dir.data,
+                        text + base,
+                        pos - base,
+                        &entries,
+                        &n_entries) ||
+        reserve_completion_ranges(lc)) {
+        buf_free(&dir);
+        return;
+    }
+
+    // Add the entries without copying, since they live until the next call
+    ComlinRange const range = {base, pos};
+    bool const hidden = pos > base && text[base] == '.';
+    for (size_t i = 0U; i < n_entries && !grow_completions(lc); ++i) {
+        PathEntry const* const entry = &entries[i];
+        if ((hidden || entry->name[0] != '.') && entry->len > pos - base) {
+            push_completion(lc, range, entry->name, entry->len);
+        }
+    }
+
+    buf_free(&dir);
 }
 
-// Transpose the character under the cursor with the previous character
-static ComlinStatus
-comlin_edit_transpose(ComlinState* const state)
+// Add completions that are built into the state if there are no others
+static void
+complete_builtin(ComlinState* const ls, ComlinCompletions* const lc)
 {
-    if (state->pos > 0U && state->pos < state->buf.length) {
-        char const aux = state->buf.data[state->pos - 1];
-        state->buf.data[state->pos - 1] = state->buf.data[state->pos];
-        state->buf.data[state->pos] = aux;
-        if (state->pos != state->buf.length - 1U) {
-            ++state->pos;
-        }
-        return edit_status(comlin_edit_refresh(state));
+    if (!lc->len && ls->grammar) {
+        grammar_complete(ls->grammar, ls->buf.data, ls->pos, lc);
+    }
+
+    if (!lc->len && ls->n_dictionary_words) {
+        complete_dictionary(ls, lc);
+    }
+
+    if (!lc->len && ls->pathmode && ls->buf.length) {
+        complete_path(ls, lc);
+    }
+
+    if (!lc->len && ls->wordmode) {
+        complete_word(ls, lc);
     }
-    return COMLIN_EDITING;
 }
 
-typedef enum {
-    COMLIN_HISTORY_NEXT,
-    COMLIN_HISTORY_PREV,
-} ComlinHistoryDirection;
+// Record that the completions are for the current line and cursor position
+static void
+set_completion_key(ComlinState* const ls)
+{
+    // Only cache completions if the key could be stored
+    StringBuf* const key = &ls->completion_key;
+    key->length = 0U;
+    buf_append(key, ls->buf.data, ls->buf.length);
+    ls->completion_key_pos = ls->pos;
+    ls->completions_cached = key->length == ls->buf.length;
+    ls->menu_width = 0U;
+}
 
-// Substitute the currently edited line with the next or previous history entry
-static ComlinStatus
-comlin_edit_history_step(ComlinState* const l, ComlinHistoryDirection const dir)
+/* Remove completions that don't match a line extended at the end.
+ *
+ * This keeps completions, in order, that replace up to the end of the old
+ * line and start with the text they would replace in the new one.
+ */
+static void
+narrow_completions(ComlinCompletions* const lc,
+                   char const* const line,
+                   size_t const len,
+                   size_t const old_len)
 {
-    if (l->history_len > 1U) {
-        // Update the current history entry before overwriting it with the next
-        size_t const current_index = l->history_len - 1U - l->history_index;
-        free(l->history[current_index]);
-        l->history[current_index] = comlin_copy_string(l->buf.data);
-        if (!l->history[current_index]) {
-            return COMLIN_NO_MEMORY;
-        }
+    if (!lc->len) {
+        return;
+    }
 
-        // Update the history index
-        if (dir == COMLIN_HISTORY_NEXT) {
-            if (l->history_index == 0) {
-                return COMLIN_EDITING;
-            }
-            --l->history_index;
-        } else {
-            if (l->history_index == l->history_len - 1U) {
-                return COMLIN_EDITING;
+    CompletionsData* const data = completions_data(lc);
+    size_t n = 0U;
+    for (size_t i = 0U; i < lc->len; ++i) {
+        ComlinRange range = completion_range(lc, i);
+        size_t const typed = len - range.start;
+        if (range.start <= old_len && range.end >= old_len &&
+            data->lengths[i] >= typed &&
+            !memcmp(lc->cvec[i], line + range.start, typed)) {
+            lc->cvec[n] = lc->cvec[i];
+            data->strings[n] = data->strings[i];
+            data->lengths[n] = data->lengths[i];
+            if (data->ranges) {
+                range.end = (range.end == SIZE_MAX) ? SIZE_MAX : len;
+                data->ranges[n] = range;
             }
-            ++l->history_index;
+            ++n;
         }
-
-        // Show the new entry
-        size_t const new_index = l->history_len - 1U - l->history_index;
-        l->pos = strlen(l->history[new_index]);
-        l->buf.length = 0U;
-        buf_append(&l->buf, l->history[new_index], l->pos);
-        return comlin_edit_refresh(l);
     }
-    return COMLIN_EDITING;
-}
 
-static ComlinStatus
-comlin_edit_history_prev(ComlinState* const l)
-{
-    return comlin_edit_history_step(l, COMLIN_HISTORY_PREV);
+    lc->len = data->count = n;
 }
 
-static ComlinStatus
-comlin_edit_history_next(ComlinState* const l)
+// Return true if an outstanding request is for the current line and cursor
+static bool
+request_is_current(ComlinState const* const ls)
 {
-    return comlin_edit_history_step(l, COMLIN_HISTORY_NEXT);
+    StringBuf const* const key = &ls->request_key;
+    return ls->requesting && ls->request_key_pos == ls->pos &&
+           line_equals(ls, key->data, key->length);
 }
 
+// Cancel any outstanding asynchronous completion request
 static void
-comlin_edit_history_pop(ComlinState* const state)
+cancel_completion_request(ComlinState* const ls)
 {
-    --state->history_len;
-    free(state->history[state->history_len]);
-    state->history_index = 0U;
+    pthread_mutex_lock(&ls->mutex);
+    ComlinCompletions submitted = ls->submitted;
+    memset(&ls->submitted, 0, sizeof(ComlinCompletions));
+    ls->has_submitted = false;
+    ls->pending_generation = 0U;
+    pthread_mutex_unlock(&ls->mutex);
+
+    comlin_free_completions(&submitted);
+    ls->requesting = false;
 }
 
-// Delete the character to the right of the cursor
-static ComlinStatus
-comlin_edit_delete(ComlinState* const l)
+// Cache submitted completions for the current line, if they have arrived
+static bool
+take_submitted_completions(ComlinState* const ls)
 {
-    if (l->pos < l->buf.length) {
-        memmove(l->buf.data + l->pos,
-                l->buf.data + l->pos + 1U,
-                l->buf.length - l->pos - 1U);
-        --l->buf.length;
-        l->buf.data[l->buf.length] = '\0';
-        return comlin_edit_refresh(l);
+    pthread_mutex_lock(&ls->mutex);
+    bool const ready = ls->has_submitted;
+    ComlinCompletions submitted = ls->submitted;
+    if (ready) {
+        memset(&ls->submitted, 0, sizeof(ComlinCompletions));
+        ls->has_submitted = false;
+        ls->pending_generation = 0U;
     }
-    return COMLIN_EDITING;
-}
+    pthread_mutex_unlock(&ls->mutex);
 
-static ComlinStatus
-comlin_edit_interrupt(ComlinState* const l)
-{
-    (void)l;
-    return COMLIN_INTERRUPTED;
+    if (!ready) {
+        return false;
+    }
+
+    // Requests are cancelled when the line changes, so these are current
+    line_close_gap(ls);
+    ls->requesting = false;
+    clear_completions(ls);
+    ls->completions = submitted;
+    complete_builtin(ls, &ls->completions);
+
+    set_completion_key(ls);
+    return true;
 }
 
-static ComlinStatus
-comlin_edit_eof(ComlinState* const l)
+// Request completions for the current line asynchronously
+static void
+request_completions(ComlinState* const ls)
 {
-    if (!l->buf.length) {
-        comlin_edit_history_pop(l);
-        return COMLIN_END;
+    if (request_is_current(ls)) {
+        return; // Already waiting for these completions
     }
 
-    return comlin_edit_delete(l);
+    cancel_completion_request(ls);
+
+    StringBuf* const key = &ls->request_key;
+    key->length = 0U;
+    buf_append(key, ls->buf.data, ls->buf.length);
+    ls->request_key_pos = ls->pos;
+    ls->requesting = key->length == ls->buf.length;
+    if (!ls->requesting) {
+        return;
+    }
+
+    uint64_t const generation = ++ls->last_generation;
+    pthread_mutex_lock(&ls->mutex);
+    ls->pending_generation = generation;
+    pthread_mutex_unlock(&ls->mutex);
+
+    // Call the application, which may submit completions immediately
+    ls->completion_request(ls, generation, ls->buf.data);
+    take_submitted_completions(ls);
 }
 
-// Backspace implementation
-static ComlinStatus
-comlin_edit_backspace(ComlinState* const l)
+// Start showing completions that were submitted since the last key
+static bool
+receive_completions(ComlinState* const ls)
 {
-    if (l->pos) {
-        memmove(l->buf.data + l->pos - 1U,
-                l->buf.data + l->pos,
-                l->buf.length - l->pos);
-        --l->pos;
-        --l->buf.length;
-        l->buf.data[l->buf.length] = '\0';
-        return comlin_edit_refresh(l);
+    if (!ls->requesting || !take_submitted_completions(ls)) {
+        return false;
     }
-    return COMLIN_EDITING;
+
+    ls->in_completion = ls->completions.len;
+    ls->completion_idx = 0U;
+    if (!ls->in_completion) {
+        comlin_beep(ls);
+    }
+
+    return true;
 }
 
-// Delete the word before the cursor
-static ComlinStatus
-comlin_edit_delete_prev_word(ComlinState* const l)
+// Fetch the next batch of completions for the line from the stream
+static void
+stream_completions(ComlinState* const ls)
 {
-    size_t const old_pos = l->pos;
+    ComlinCompletions* const lc = &ls->completions;
+    size_t const offset = lc->len;
+    size_t const room = ls->stream_limit - offset;
+    size_t const count = (ls->stream_batch < room) ? ls->stream_batch : room;
 
-    while (l->pos > 0 && l->buf.data[l->pos - 1U] == ' ') {
-        --l->pos;
+    ls->stream_more =
+      count && ls->stream_callback(ls->buf.data, offset, count, lc);
+
+    sync_completions(lc);
+
+    // Enforce the limit even if the callback added too many
+    if (lc->len > offset + count) {
+        lc->len = offset + count;
     }
-    while (l->pos > 0 && l->buf.data[l->pos - 1U] != ' ') {
-        --l->pos;
+
+    ls->stream_more = ls->stream_more && lc->len < ls->stream_limit;
+    ls->menu_width = 0U;
+}
+
+/* Return the completions for the current line.
+ *
+ * Completions can be expensive to generate, so they are cached, and only
+ * fetched again when the line or cursor position has changed.  If they have
+ * been requested asynchronously and haven't arrived yet, this returns null.
+ */
+static ComlinCompletions const*
+get_completions(ComlinState* const ls)
+{
+    StringBuf* const key = &ls->completion_key;
+    if (ls->completions_cached && key->length == ls->buf.length &&
+        ls->completion_key_pos == ls->pos &&
+        !memcmp(key->data, ls->buf.data, ls->buf.length)) {
+        return &ls->completions;
     }
-    size_t const diff = old_pos - l->pos;
-    memmove(l->buf.data + l->pos,
-            l->buf.data + old_pos,
-            l->buf.length + 1U - old_pos);
-    l->buf.length -= diff;
-    return comlin_edit_refresh(l);
+
+    // Filter the previous completions if the line has only been extended
+    if (ls->narrowmode && ls->completions_cached && !ls->stream_more &&
+        key->length < ls->buf.length && ls->pos == ls->buf.length &&
+        ls->completion_key_pos == key->length &&
+        !memcmp(key->data, ls->buf.data, key->length)) {
+        narrow_completions(
+          &ls->completions, ls->buf.data, ls->buf.length, key->length);
+        if (ls->completions.len) {
+            set_completion_key(ls);
+            return &ls->completions;
+        }
+    }
+
+    clear_completions(ls);
+    if (ls->buf.length && ls->completion_request) {
+        request_completions(ls);
+        return ls->completions_cached ? &ls->completions : NULL;
+    }
+
+    if (ls->buf.length && ls->range_callback) {
+        ls->range_callback(
+          ls->buf.data, ls->buf.length, ls->pos, &ls->completions);
+    } else if (ls->buf.length && ls->stream_callback) {
+        stream_completions(ls);
+    } else if (ls->buf.length && ls->completion_callback) {
+        ls->completion_callback(ls->buf.data, &ls->completions);
+    }
+
+    sync_completions(&ls->completions);
+    complete_builtin(ls, &ls->completions);
+    set_completion_key(ls);
+    return &ls->completions;
 }
 
-static ComlinStatus
-comlin_edit_clear_screen(ComlinState* const state)
+// Return the length of the common prefix of two strings of at least n bytes
+static size_t
+common_prefix_length(char const* const a, char const* const b, size_t const n)
 {
-    ComlinStatus const st = comlin_clear_screen(state);
+    // Compare a word at a time to skip quickly over long shared prefixes
+    size_t i = 0U;
+    for (; i + sizeof(size_t) <= n; i += sizeof(size_t)) {
+        size_t wa = 0U;
+        size_t wb = 0U;
+        memcpy(&wa, a + i, sizeof(size_t));
+        memcpy(&wb, b + i, sizeof(size_t));
+        if (wa != wb) {
+            break;
+        }
+    }
 
-    return st ? st : edit_status(comlin_edit_refresh(state));
+    // Find the first differing byte within the last word
+    while (i < n && a[i] == b[i]) {
+        ++i;
+    }
+
+    return i;
 }
 
-static ComlinStatus
-comlin_edit_clear_line_backwards(ComlinState* const l)
+/* Insert the longest common prefix of all completions into the line.
+ *
+ * This only does anything if every completion replaces the same range, and
+ * the prefix extends the text in that range.  Returns true if the line was
+ * changed.
+ */
+static bool
+insert_common_prefix(ComlinState* const ls, ComlinCompletions const* const lc)
 {
-    if (l->pos > 0) {
-        size_t const new_length = l->buf.length - l->pos;
-        memmove(l->buf.data, l->buf.data + l->pos, new_length + 1);
-        l->buf.length = new_length;
-        l->pos = 0;
-        return comlin_edit_refresh(l);
+    ComlinRange const range = completion_range(lc, 0U);
+    size_t end = ls->buf.length;
+    size_t const start = (range.start < end) ? range.start : end;
+    end = (range.end < end) ? range.end : end;
+    end = (end < start) ? start : end;
+
+    // Shrink the prefix until it no longer extends the replaced text
+    size_t const typed = end - start;
+    size_t len = completion_length(lc, 0U);
+    for (size_t i = 1U; i < lc->len && len > typed; ++i) {
+        ComlinRange const other = completion_range(lc, i);
+        if (other.start != range.start || other.end != range.end) {
+            return false;
+        }
+
+        size_t const length = completion_length(lc, i);
+        size_t const n = (length < len) ? length : len;
+        len = common_prefix_length(lc->cvec[0], lc->cvec[i], n);
     }
-    return COMLIN_EDITING;
+
+    if (len <= typed || memcmp(lc->cvec[0], ls->buf.data + start, typed)) {
+        return false;
+    }
+
+    StringBuf* const line = &ls->completion_line;
+    line->length = 0U;
+    buf_append(line, ls->buf.data, start);
+    buf_append(line, lc->cvec[0], len);
+    buf_append(line, ls->buf.data + end, ls->buf.length - end);
+    if (!line->data) {
+        return false;
+    }
+
+    line_replace(ls, line->data, line->length);
+    ls->pos = (start + len <= ls->buf.length) ? start + len : ls->buf.length;
+    return true;
 }
 
-static ComlinStatus
-comlin_edit_clear_line_forwards(ComlinState* const l)
+/* Helper for when the user presses Tab, or another key during completion.
+ *
+ * If the return is non-zero, it should be handled as a byte read from the
+ * input, and process it as usual.  Otherwise, the character was consumed by
+ * this function.
+ */
+static char
+complete_line(ComlinState* const ls, char const keypressed)
 {
-    if (l->pos < l->buf.length) {
-        l->buf.data[l->pos] = '\0';
-        l->buf.length = l->pos;
-        return comlin_edit_refresh(l);
+    ComlinCompletions const* const completions = get_completions(ls);
+    if (!completions) {
+        // Completions were requested, and will be shown when they arrive
+        ls->in_completion = false;
+        return (keypressed == TAB) ? 0 : keypressed;
     }
-    return COMLIN_EDITING;
+
+    ComlinCompletions lc = *completions;
+    char c = keypressed;
+
+    if (lc.len == 0) {
+        comlin_beep(ls);
+        ls->in_completion = false;
+    } else {
+        switch (c) {
+        case TAB:
+            if (ls->in_completion) {
+                // Fetch more completions when cycling past the last one
+                if (ls->completion_idx + 1U == lc.len && ls->stream_more) {
+                    stream_completions(ls);
+                    lc = ls->completions;
+                }
+
+                ls->completion_idx = (ls->completion_idx + 1) % (lc.len + 1);
+                if (ls->completion_idx == lc.len) {
+                    comlin_beep(ls);
+                }
+            } else if (!ls->prefixmode || ls->stream_more ||
+                       !insert_common_prefix(ls, &lc)) {
+                ls->in_completion = true;
+                ls->completion_idx = 0;
+            }
+            c = 0;
+            break;
+        case ESC:
+            // Re-show original buffer
+            ls->in_completion = false;
+            if (ls->completion_idx < lc.len) {
+                comlin_edit_refresh(ls);
+            }
+            c = 0;
+            break;
+        default:
+            // Update buffer and return
+            if (ls->completion_idx < lc.len) {
+                StringBuf* const line = &ls->completion_line;
+                size_t const pos =
+                  apply_completion(line, &ls->buf, &lc, ls->completion_idx);
+                if (line->data) {
+                    line_replace(ls, line->data, line->length);
+                    ls->pos = (pos <= ls->buf.length) ? pos : ls->buf.length;
+                }
+            }
+            ls->in_completion = false;
+            break;
+        }
+
+        // Show completion or original buffer
+        if (ls->in_completion) {
+            refresh_line_with_completion(ls, &lc, REFRESH_ALL);
+        } else {
+            comlin_edit_refresh(ls);
+        }
+    }
+
+    return c; // Return last read character
 }
 
-static ComlinStatus
-comlin_edit_submit(ComlinState* const l)
+void
+comlin_set_completion_callback(ComlinState* const state,
+                               ComlinCompletionCallback* const fn)
 {
-    comlin_edit_history_pop(l);
-    if (l->mlmode) {
-        comlin_edit_move_end(l);
+    clear_completions(state);
+    state->completion_callback = fn;
+}
+
+void
+comlin_set_range_completion_callback(ComlinState* const state,
+                                     ComlinRangeCompletionCallback* const fn)
+{
+    clear_completions(state);
+    state->range_callback = fn;
+}
+
+ComlinStatus
+comlin_set_stream_completion_callback(ComlinState* const state,
+                                      ComlinStreamCompletionCallback* const fn,
+                                      size_t const batch_size,
+                                      size_t const limit)
+{
+    if (!batch_size) {
+        return COMLIN_BAD_ARG;
     }
-    l->buf.data[l->buf.length] = '\0';
+
+    clear_completions(state);
+    state->stream_callback = fn;
+    state->stream_batch = batch_size;
+    state->stream_limit = limit ? limit : SIZE_MAX;
     return COMLIN_SUCCESS;
 }
 
-/* State */
+void
+comlin_set_grammar(ComlinState* const state, ComlinGrammar const* const grammar)
+{
+    clear_completions(state);
+    state->grammar = grammar;
+}
 
-ComlinState*
-comlin_new_state(int const in_fd,
-                 int const out_fd,
-                 char const* const term,
-                 size_t const max_history_len)
+ComlinStatus
+comlin_set_dictionary(ComlinState* const state,
+                      char const* const* const words,
+                      size_t const n_words)
 {
-    ComlinState* const l = (ComlinState*)calloc(1, sizeof(ComlinState));
-    if (l) {
-        l->ifd = in_fd;
-        l->ofd = out_fd;
-        l->dumb = is_unsupported_term(term);
-        l->history_max_len = max_history_len;
+    clear_completions(state);
+    free_dictionary(state);
+    if (!n_words) {
+        return COMLIN_SUCCESS;
     }
-    return l;
+
+    // Copy all of the words into a single buffer
+    size_t total_size = 0U;
+    for (size_t i = 0U; i < n_words; ++i) {
+        total_size += strlen(words[i]) + 1U;
+    }
+
+    state->dictionary = (char*)malloc(total_size);
+    state->dictionary_words = (char**)malloc(sizeof(char*) * n_words);
+    state->dictionary_lengths = (size_t*)malloc(sizeof(size_t) * n_words);
+    if (!state->dictionary || !state->dictionary_words ||
+        !state->dictionary_lengths) {
+        free_dictionary(state);
+        return COMLIN_NO_MEMORY;
+    }
+
+    char* ptr = state->dictionary;
+    for (size_t i = 0U; i < n_words; ++i) {
+        size_t const size = strlen(words[i]) + 1U;
+        memcpy(ptr, words[i], size);
+        state->dictionary_words[i] = ptr;
+        ptr += size;
+    }
+
+    // Sort the words and remove duplicates
+    qsort(state->dictionary_words, n_words, sizeof(char*), compare_words);
+
+    size_t n = 0U;
+    for (size_t i = 0U; i < n_words; ++i) {
+        char* const word = state->dictionary_words[i];
+        if (!n || strcmp(word, state->dictionary_words[n - 1U])) {
+            state->dictionary_words[n] = word;
+            state->dictionary_lengths[n++] = strlen(word);
+        }
+    }
+
+    state->n_dictionary_words = n;
+    return COMLIN_SUCCESS;
 }
 
 void
-comlin_free_state(ComlinState* const state)
+comlin_set_completion_request_callback(
+  ComlinState* const state,
+  ComlinCompletionRequestCallback* const fn)
 {
-    // Free history
-    for (size_t j = 0U; j < state->history_len; ++j) {
-        free(state->history[j]);
+    cancel_completion_request(state);
+    clear_completions(state);
+    state->completion_request = fn;
+}
+
+ComlinStatus
+comlin_submit_completions(ComlinState* const state,
+                          uint64_t const generation,
+                          ComlinCompletions* const lc)
+{
+    sync_completions(lc);
+
+    ComlinCompletions stale = *lc;
+    memset(lc, 0, sizeof(ComlinCompletions));
+
+    pthread_mutex_lock(&state->mutex);
+    bool const current =
+      generation && generation == state->pending_generation &&
+      !state->has_submitted;
+    if (current) {
+        state->submitted = stale;
+        state->has_submitted = true;
+        memset(&stale, 0, sizeof(ComlinCompletions));
     }
-    free(state->history);
+    pthread_mutex_unlock(&state->mutex);
 
-    // Disable raw mode if it was enabled by comlin_new_state
-    disable_raw_mode(state);
+    comlin_free_completions(&stale);
+    return current ? COMLIN_SUCCESS : COMLIN_INTERRUPTED;
+}
 
-    free(state->buf.data);
-    free(state);
+ComlinStatus
+comlin_completion_status(ComlinState* const state, uint64_t const generation)
+{
+    pthread_mutex_lock(&state->mutex);
+    bool const current =
+      generation && generation == state->pending_generation &&
+      !state->has_submitted;
+    pthread_mutex_unlock(&state->mutex);
+
+    return current ? COMLIN_SUCCESS : COMLIN_INTERRUPTED;
 }
 
 ComlinStatus
-comlin_set_mode(ComlinState* const state, ComlinModeFlags const flags)
+comlin_add_completion(ComlinCompletions* const lc, char const* const str)
 {
-    state->mlmode = flags & (ComlinModeFlags)COMLIN_MODE_MULTI_LINE;
-    state->maskmode = flags & (ComlinModeFlags)COMLIN_MODE_MASKED;
-    return COMLIN_SUCCESS;
+    return comlin_add_completion_len(lc, str, strlen(str));
 }
 
 ComlinStatus
-comlin_edit_start(ComlinState* const l, char const* const prompt)
+comlin_add_completion_len(ComlinCompletions* const lc,
+                          char const* const str,
+                          size_t const len)
 {
-    // Enter raw mode
-    ComlinStatus const st = enable_raw_mode(l);
-    if (st) {
-        return st;
-    }
+    ComlinRange const line = {0U, SIZE_MAX};
+    return add_completion(lc, line, str, len);
+}
 
-    // Reset line state
-    l->pos = 0U;
-    l->oldpos = 0U;
-    l->buf.length = 0U;
-    l->oldrows = 0U;
-    if (!l->cols) {
-        l->cols = (size_t)get_columns(l);
-        if (l->buf.size < l->cols) {
-            free(l->buf.data);
-            l->buf.data = (char*)calloc(1, l->cols);
-            l->buf.size = l->cols;
-        }
+ComlinStatus
+comlin_add_completion_range(ComlinCompletions* const lc,
+                            size_t const start,
+                            size_t const end,
+                            char const* const str,
+                            size_t const len)
+{
+    if (end < start) {
+        return COMLIN_BAD_ARG;
     }
 
-    // Set edit state
-    l->prompt = prompt;
-    l->plen = strlen(prompt);
-    l->buf.data[0] = '\0';
-    comlin_history_add(l, ""); // Latest history entry is the current line
+    ComlinRange const range = {start, end};
+    ComlinStatus const st = reserve_completion_ranges(lc);
+    return st ? st : add_completion(lc, range, str, len);
+}
 
-    // Write prompt
-    return write_string(l->ofd, l->prompt, l->plen);
+// Order completions by descending score, then by original order
+static int
+compare_scored(void const* const a, void const* const b)
+{
+    SearchMatch const* const lhs = (SearchMatch const*)a;
+    SearchMatch const* const rhs = (SearchMatch const*)b;
+
+    return (lhs->score > rhs->score)   ? -1
+           : (lhs->score < rhs->score) ? 1
+           : (lhs->index < rhs->index) ? -1
+           : (lhs->index > rhs->index) ? 1
+                                       : 0;
 }
 
-static ComlinStatus
-comlin_edit_read_dumb(ComlinState* const l, char const c)
+ComlinStatus
+comlin_filter_completions(ComlinCompletions* const lc,
+                          char const* const pattern)
 {
-    switch (c) {
-    case CTRL_C:
-        return COMLIN_INTERRUPTED;
-    case CTRL_D:
-        return COMLIN_END;
-    case LFEED:
-    case CRETURN:
+    sync_completions(lc);
+    if (!lc->len) {
         return COMLIN_SUCCESS;
-    default:
-        break;
+    }
+
+    CompletionsData* const data = completions_data(lc);
+    SearchMatch* const scored =
+      (SearchMatch*)malloc(sizeof(SearchMatch) * lc->len);
+    char** const kept = (char**)malloc(sizeof(char*) * lc->len);
+    size_t* const kept_lengths = (size_t*)malloc(sizeof(size_t) * lc->len);
+    ComlinRange* const kept_ranges =
+      data->ranges ? (ComlinRange*)malloc(sizeof(ComlinRange) * lc->len) : NULL;
+    if (!scored || !kept || !kept_lengths || (data->ranges && !kept_ranges)) {
+        free(kept_ranges);
+        free(kept_lengths);
+        free(kept);
+        free(scored);
+        return COMLIN_NO_MEMORY;
+    }
+
+    // Score every completion, and drop those that don't match
+    FuzzyMatcher const matcher = fuzzy_matcher();
+    size_t const pattern_len = strlen(pattern);
+    size_t n_scored = 0U;
+    for (size_t i = 0U; i < lc->len; ++i) {
+        int32_t score = 0;
+        if (fuzzy_match(matcher,
+                        pattern,
+                        pattern_len,
+                        lc->cvec[i],
+                        data->lengths[i],
+                        &score)) {
+            scored[n_scored].score = score;
+            scored[n_scored].index = i;
+            ++n_scored;
+        }
+    }
+
+    // Sort the remaining completions by score
+    qsort(scored, n_scored, sizeof(SearchMatch), compare_scored);
+    for (size_t i = 0U; i < n_scored; ++i) {
+        kept[i] = lc->cvec[scored[i].index];
+        kept_lengths[i] = data->lengths[scored[i].index];
+        if (kept_ranges) {
+            kept_ranges[i] = data->ranges[scored[i].index];
+        }
+    }
+
+    memcpy(lc->cvec, kept, sizeof(char*) * n_scored);
+    memcpy(data->strings, kept, sizeof(char*) * n_scored);
+    memcpy(data->lengths, kept_lengths, sizeof(size_t) * n_scored);
+    if (kept_ranges) {
+        memcpy(data->ranges, kept_ranges, sizeof(ComlinRange) * n_scored);
+    }
+
+    lc->len = data->count = n_scored;
+    free(kept_ranges);
+    free(kept_lengths);
+    free(kept);
+    free(scored);
+    return COMLIN_SUCCESS;
+}
+
+/* String Buffer */
+
+static void
+buf_append(StringBuf* const buf, char const* const s, size_t const len)
+{
+    assert(s);
+
+    size_t const new_length = buf->length + len;
+    size_t const needed_size = new_length + 1U;
+    if (needed_size > buf->size) {
+        char* const new_data = (char*)realloc(buf->data, needed_size);
+        if (!new_data) {
+            return;
+        }
+
+        buf->data = new_data;
+        buf->size = needed_size;
+    }
+
+    assert(buf->data);
+    memcpy(buf->data + buf->length, s, len);
+    buf->data[new_length] = '\0';
+    buf->length = new_length;
+}
+
+static size_t
+format_size(char* const buf, size_t x)
+{
+    size_t i = 0U;
+
+    // Write digits backwards
+    do {
+        buf[i++] = (char)('0' + (x % 10U));
+        x /= 10U;
+    } while (x);
+
+    // Terminate and reverse string
+    buf[i] = '\0';
+    if (i) {
+        for (size_t l = 0U, r = i - 1U; l < r; ++l, --r) {
+            char const t = buf[l];
+            buf[l] = buf[r];
+            buf[r] = t;
+        }
+    }
+
+    return i;
+}
+
+// Append an escape like `ESC [ n s` with a number and a suffix letter
+static void
+buf_append_vtesc(StringBuf* const buf, size_t const num, char const suffix)
+{
+    size_t end = 2U;
+    char seq[64] = {'\x1B', '[', 0};
+
+    end += format_size(seq + 2U, num);
+    seq[end++] = suffix;
+
+    buf_append(buf, seq, end);
+}
+
+static void
+buf_free(StringBuf* const buf)
+{
+    free(buf->data);
+}
+
+static void
+append_line_text(StringBuf* const buf,
+                 char const* const text,
+                 size_t const length,
+                 bool const masked)
+{
+    if (masked) {
+        for (size_t i = 0U; i < length; ++i) {
+            buf_append(buf, "*", 1);
+        }
+    } else {
+        buf_append(buf, text, length);
+    }
+}
+
+// Append as much of the suggestion as fits in `room` columns, dimmed
+static size_t
+append_suggestion(StringBuf* const buf,
+                  ComlinState const* const l,
+                  size_t const room)
+{
+    size_t const len =
+      l->suggestion.length < room ? l->suggestion.length : room;
+
+    if (len && !l->in_completion) {
+        buf_append(buf, VTESC "2m", 4U);
+        buf_append(buf, l->suggestion.data, len);
+        buf_append(buf, VTESC "0m", 4U);
+        return len;
+    }
+
+    return 0U;
+}
+
+/* Line Gap
+ *
+ * To make editing in the middle of a long line cheap, the line buffer can
+ * have a gap at the cursor, so inserting or deleting there doesn't move the
+ * rest of the line.  Moving the gap only moves the text between the old and
+ * new cursor positions, and it grows in proportion to the line when filled.
+ * Only insertion, deletion, movement, history navigation, and refreshing
+ * support a gap, so it's closed before anything else that uses the line,
+ * which moves the text after it once.  While the gap is open, the line is
+ * terminated after all of the text, at `gap_len` bytes past the end of the
+ * line, and also at the start of the gap, so the text before the cursor is a
+ * string.  The gap is closed when editing finishes, and whenever
+ * comlin_edit_feed() returns with no more input ready, so it stays open
+ * through a burst of input like a paste, but the whole line is available
+ * between keys.
+ */
+
+// Minimum length of a gap opened in the line
+static size_t const min_gap_len = 64U;
+
+/* Length of a line above which it's treated as a large line.
+ *
+ * Large lines, which are usually pasted, are always shown in a window on one
+ * row like in single-line mode, without a suggestion.  They aren't refreshed
+ * while more input is ready, so a paste is read in one go, then shown once.
+ */
+static size_t const large_line_length = 4096U;
+
+// Return true if the line is shown in a window on one row
+static bool
+line_is_windowed(ComlinState const* const l)
+{
+    return !l->mlmode || l->buf.length >= large_line_length;
+}
+
+// Close the gap in the line, so it's contiguous and null-terminated
+static char*
+line_close_gap(ComlinState* const l)
+{
+    if (l->gap_len) {
+        char* const data = l->buf.data;
+        memmove(data + l->gap_pos,
+                data + l->gap_pos + l->gap_len,
+                l->buf.length - l->gap_pos + 1U);
+        l->gap_len = 0U;
+    }
+
+    return l->buf.data;
+}
+
+// Terminate the text before the gap in the line, if there is one
+static void
+line_mark_gap(ComlinState* const l)
+{
+    if (l->gap_len) {
+        l->buf.data[l->gap_pos] = '\0';
+    }
+}
+
+// Move the gap in the line to the cursor
+static void
+line_move_gap(ComlinState* const l)
+{
+    char* const data = l->buf.data;
+    size_t const gap = l->gap_len;
+    if (!gap) {
+        l->gap_pos = l->pos;
+    } else if (l->pos < l->gap_pos) {
+        memmove(data + l->pos + gap, data + l->pos, l->gap_pos - l->pos);
+    } else if (l->pos > l->gap_pos) {
+        memmove(
+          data + l->gap_pos, data + l->gap_pos + gap, l->pos - l->gap_pos);
+    }
+
+    l->gap_pos = l->pos;
+    line_mark_gap(l);
+}
+
+// Move the gap in the line to the cursor, growing it if it's empty
+static ComlinStatus
+line_open_gap(ComlinState* const l)
+{
+    line_move_gap(l);
+    if (l->gap_len) {
+        return COMLIN_SUCCESS;
+    }
+
+    // Grow in proportion to the line, so filling the gap is amortised O(1)
+    StringBuf* const buf = &l->buf;
+    size_t const gap = (buf->length > min_gap_len) ? buf->length : min_gap_len;
+    size_t const size = buf->length + gap + 1U;
+    if (size > buf->size) {
+        char* const data = (char*)realloc(buf->data, size);
+        if (!data) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        buf->data = data;
+        buf->size = size;
+    }
+
+    memmove(buf->data + l->pos + gap,
+            buf->data + l->pos,
+            buf->length - l->pos + 1U);
+    l->gap_len = gap;
+    line_mark_gap(l);
+    return COMLIN_SUCCESS;
+}
+
+// Return true if the line is equal to some text, skipping over any gap in it
+static bool
+line_equals(ComlinState const* const l,
+            char const* const text,
+            size_t const len)
+{
+    char const* const data = l->buf.data;
+    size_t const head_len = l->gap_len ? l->gap_pos : l->buf.length;
+    return len == l->buf.length && !memcmp(text, data, head_len) &&
+           !memcmp(text + head_len,
+                   data + head_len + l->gap_len,
+                   len - head_len);
+}
+
+// Copy the line and a null terminator, skipping over any gap in it
+static void
+line_copy(ComlinState const* const l, char* const dest)
+{
+    char const* const data = l->buf.data;
+    size_t const head_len = l->gap_len ? l->gap_pos : l->buf.length;
+    memcpy(dest, data, head_len);
+    memcpy(dest + head_len,
+           data + head_len + l->gap_len,
+           l->buf.length - head_len + 1U);
+}
+
+// Append part of the line to a buffer, skipping over any gap in it
+static void
+append_line_range(StringBuf* const buf,
+                  ComlinState const* const l,
+                  size_t const start,
+                  size_t const len)
+{
+    char const* const data = l->buf.data;
+    size_t const end = start + len;
+    size_t const gap_pos = l->gap_len ? l->gap_pos : end;
+    if (end <= gap_pos) {
+        append_line_text(buf, data + start, len, l->maskmode);
+    } else if (start >= gap_pos) {
+        append_line_text(buf, data + start + l->gap_len, len, l->maskmode);
+    } else {
+        append_line_text(buf, data + start, gap_pos - start, l->maskmode);
+        append_line_text(
+          buf, data + gap_pos + l->gap_len, end - gap_pos, l->maskmode);
+    }
+}
+
+/* Undo
+ *
+ * Edits are recorded in a log of operations, each of which inserts or deletes
+ * some text at a position in the line.  The text of all operations is kept
+ * in one buffer, so the memory used by each step is proportional to the size
+ * of the edit, not the line.  A step may have several operations, like a
+ * deletion and an insertion to replace some text, which are undone and
+ * redone together.  The first `undo_len` operations are done, and any after
+ * them can be redone until another edit is made.
+ *
+ * The operations are kept in a ring, so discarding the oldest step when the
+ * log is full doesn't move the others.  Their text is only moved down once
+ * the discarded text at the start of the buffer is at least as long as the
+ * rest, so that is amortised as well.
+ */
+
+/* Maximum number of operations in the undo log.
+ *
+ * This limits operations, not steps.  Most steps are a single operation, but
+ * replacing text is two, so at least half this many steps can be undone.
+ */
+static size_t const max_undo_ops = 256U;
+
+/* Size of the array of undo operations.
+ *
+ * The array is allocated once at this size.  A step has at most two
+ * operations, and only the first can make room by discarding old steps, so
+ * the second may need one more slot.
+ */
+static size_t const undo_ops_size = 257U;
+
+// Discard all operations in the undo log
+static void
+undo_clear(ComlinState* const l)
+{
+    l->undo_first = 0U;
+    l->n_undo_ops = 0U;
+    l->undo_len = 0U;
+    l->undo_text.length = 0U;
+}
+
+// Return an operation in the undo log, where the oldest is 0
+static UndoOp*
+undo_op(ComlinState const* const l, size_t const i)
+{
+    return &l->undo_ops[(l->undo_first + i) % undo_ops_size];
+}
+
+// Discard the oldest step in the undo log
+static void
+undo_drop_oldest(ComlinState* const l)
+{
+    size_t n = 1U;
+    while (n < l->n_undo_ops && undo_op(l, n)->joined) {
+        ++n;
+    }
+
+    l->undo_first = (l->undo_first + n) % undo_ops_size;
+    l->n_undo_ops -= n;
+    l->undo_len -= n;
+    if (!l->n_undo_ops) {
+        l->undo_text.length = 0U;
+        return;
+    }
+
+    // Move the remaining text down if at least half of the buffer is unused
+    size_t const shift = undo_op(l, 0U)->offset;
+    if (shift >= l->undo_text.length - shift) {
+        memmove(l->undo_text.data,
+                l->undo_text.data + shift,
+                l->undo_text.length - shift);
+
+        l->undo_text.length -= shift;
+        for (size_t i = 0U; i < l->n_undo_ops; ++i) {
+            undo_op(l, i)->offset -= shift;
+        }
+    }
+}
+
+/* Record an insertion or deletion of text in the line.
+ *
+ * This discards anything that could be redone.  A character typed right after
+ * another is added to the previous insertion, so typing is undone in one step.
+ */
+static void
+undo_record(ComlinState* const l,
+            bool const insert,
+            size_t const pos,
+            char const* const text,
+            size_t const len,
+            bool const joined)
+{
+    if (!len) {
+        return;
+    }
+
+    UndoOp* const last = l->undo_len ? undo_op(l, l->undo_len - 1U) : NULL;
+    l->n_undo_ops = l->undo_len;
+    l->undo_text.length = last ? last->offset + last->len : 0U;
+
+    // Extend the last insertion if this continues typing
+    size_t offset = l->undo_text.length;
+    if (insert && !joined && l->was_typing && last && last->insert &&
+        last->pos + last->len == pos) {
+        buf_append(&l->undo_text, text, len);
+        if (l->undo_text.length == offset + len) {
+            last->len += len;
+        }
+        return;
+    }
+
+    // Make room for a new step, discarding the oldest steps if necessary
+    if (!joined) {
+        while (l->n_undo_ops >= max_undo_ops) {
+            undo_drop_oldest(l);
+        }
+
+        offset = l->undo_text.length;
+    }
+
+    if (!l->undo_ops &&
+        !(l->undo_ops = (UndoOp*)calloc(undo_ops_size, sizeof(UndoOp)))) {
+        undo_clear(l);
+        return;
+    }
+
+    assert(l->n_undo_ops < undo_ops_size);
+    buf_append(&l->undo_text, text, len);
+    if (l->undo_text.length != offset + len) {
+        undo_clear(l);
+        return;
+    }
+
+    UndoOp const op = {pos, offset, len, insert, joined};
+    *undo_op(l, l->n_undo_ops++) = op;
+    l->undo_len = l->n_undo_ops;
+}
+
+// Record the replacement of some text with another, if it changed
+static void
+undo_record_replace(ComlinState* const l,
+                    char const* const old_text,
+                    size_t const old_len,
+                    char const* const new_text,
+                    size_t const new_len)
+{
+    // Find the changed part between the common prefix and suffix
+    size_t start = 0U;
+    while (start < old_len && start < new_len &&
+           old_text[start] == new_text[start]) {
+        ++start;
+    }
+
+    size_t end = 0U;
+    while (end < old_len - start && end < new_len - start &&
+           old_text[old_len - 1U - end] == new_text[new_len - 1U - end]) {
+        ++end;
+    }
+
+    size_t const n_deleted = old_len - start - end;
+    undo_record(l, false, start, old_text + start, n_deleted, false);
+    undo_record(
+      l, true, start, new_text + start, new_len - start - end, n_deleted > 0U);
+}
+
+// Replace the whole line, recording the change so it can be undone
+static void
+line_replace(ComlinState* const l, char const* const text, size_t const len)
+{
+    undo_record_replace(l, l->buf.data, l->buf.length, text, len);
+    l->buf.length = 0U;
+    buf_append(&l->buf, text, len);
+    l->was_typing = false;
+}
+
+// Insert text into the line at a position, returning false on failure
+static bool
+line_insert_text(ComlinState* const l,
+                 size_t const pos,
+                 char const* const text,
+                 size_t const len)
+{
+    size_t const tail = l->buf.length - pos;
+    buf_append(&l->buf, text, len);
+    if (l->buf.length != pos + tail + len) {
+        return false;
+    }
+
+    memmove(l->buf.data + pos + len, l->buf.data + pos, tail);
+    memcpy(l->buf.data + pos, text, len);
+    return true;
+}
+
+// Delete text from the line at a position
+static void
+line_delete_text(ComlinState* const l, size_t const pos, size_t const len)
+{
+    memmove(l->buf.data + pos,
+            l->buf.data + pos + len,
+            l->buf.length - pos - len + 1U);
+    l->buf.length -= len;
+}
+
+// Apply an operation to the line, or its inverse, and move the cursor after it
+static void
+undo_apply(ComlinState* const l, UndoOp const* const op, bool const invert)
+{
+    if (op->insert != invert) {
+        if (line_insert_text(
+              l, op->pos, l->undo_text.data + op->offset, op->len)) {
+            l->pos = op->pos + op->len;
+        }
+    } else {
+        line_delete_text(l, op->pos, op->len);
+        l->pos = op->pos;
+    }
+}
+
+/* Kill Ring
+ *
+ * Killed text is written to a fixed-size ring buffer which is allocated once,
+ * so killing and yanking never allocate after that.  Entries are spans of
+ * the stream of all text ever written to the ring, where the newest entry is
+ * always at the end, so an entry is still available until the text written
+ * after it has wrapped around the ring and overwritten it.
+ */
+
+// Size of the text buffer of the kill ring
+static size_t const kill_ring_size = 16384U;
+
+// Return the entry in the kill ring of a given age, where the newest is 0
+static KillEntry const*
+kill_entry(ComlinState const* const l, size_t const age)
+{
+    return &l->kills[(l->kill_head + N_KILLS - age) % N_KILLS];
+}
+
+// Return the number of entries in the kill ring that haven't been overwritten
+static size_t
+kill_ring_count(ComlinState const* const l)
+{
+    size_t n = 0U;
+    while (n < l->n_kills &&
+           kill_entry(l, n)->start + kill_ring_size >= l->kill_end) {
+        ++n;
+    }
+
+    return n;
+}
+
+// Copy text to a position in the stream of the kill ring
+static void
+kill_ring_write(ComlinState* const l,
+                size_t const offset,
+                char const* const text,
+                size_t const len)
+{
+    size_t const i = offset % kill_ring_size;
+    size_t const n = (len < kill_ring_size - i) ? len : kill_ring_size - i;
+
+    memcpy(l->kill_text + i, text, n);
+    memcpy(l->kill_text, text + n, len - n);
+}
+
+/* Move text forwards in the stream of the kill ring.
+ *
+ * The text is moved backwards from its end, in as few contiguous pieces as
+ * possible, splitting only where the source or destination wraps around.
+ */
+static void
+kill_ring_move(ComlinState* const l,
+               size_t const to,
+               size_t const from,
+               size_t const len)
+{
+    assert(to >= from && len + (to - from) <= kill_ring_size);
+
+    for (size_t end = len; end > 0U;) {
+        size_t const src = (from + end - 1U) % kill_ring_size;
+        size_t const dst = (to + end - 1U) % kill_ring_size;
+        size_t const min = (src < dst) ? src : dst;
+        size_t const n = (end < min + 1U) ? end : min + 1U;
+
+        end -= n;
+        memmove(l->kill_text + dst + 1U - n, l->kill_text + src + 1U - n, n);
+    }
+}
+
+/* Save text deleted from the line in the kill ring.
+ *
+ * If the last key also killed text, then the text is added to the same
+ * entry, after it if `append` is true and otherwise before it, so a sequence
+ * of kills can be yanked back at once.  An entry keeps at most the first
+ * `kill_ring_size` bytes of the text.
+ */
+static void
+kill_ring_add(ComlinState* const l,
+              char const* const text,
+              size_t const len,
+              bool const append)
+{
+    if (!len) {
+        return;
+    }
+
+    if (!l->kill_text && !(l->kill_text = (char*)malloc(kill_ring_size))) {
+        return;
+    }
+
+    // Start a new entry at the end of the stream unless this continues one
+    if (!l->was_killing || !l->n_kills) {
+        l->kill_head = l->n_kills ? (l->kill_head + 1U) % N_KILLS : 0U;
+        l->kills[l->kill_head].start = l->kill_end;
+        l->kills[l->kill_head].len = 0U;
+        if (l->n_kills < N_KILLS) {
+            ++l->n_kills;
+        }
+    }
+
+    KillEntry* const entry = &l->kills[l->kill_head];
+    if (append) {
+        size_t const room = kill_ring_size - entry->len;
+        size_t const n = (len < room) ? len : room;
+        kill_ring_write(l, entry->start + entry->len, text, n);
+        entry->len += n;
+    } else {
+        // Move the existing text forwards to make room before it
+        size_t const n = (len < kill_ring_size) ? len : kill_ring_size;
+        size_t const room = kill_ring_size - n;
+        size_t const kept = (entry->len < room) ? entry->len : room;
+        kill_ring_move(l, entry->start + n, entry->start, kept);
+        kill_ring_write(l, entry->start, text, n);
+        entry->len = n + kept;
+    }
+
+    l->kill_end = entry->start + entry->len;
+    l->killing = true;
+}
+
+// Insert the entry in the kill ring of a given age at the cursor
+static void
+kill_ring_yank(ComlinState* const l, size_t const age, bool const joined)
+{
+    KillEntry const* const entry = kill_entry(l, age);
+    size_t const i = entry->start % kill_ring_size;
+    size_t const n =
+      (entry->len < kill_ring_size - i) ? entry->len : kill_ring_size - i;
+
+    size_t const pos = l->pos;
+    if (line_insert_text(l, pos, l->kill_text + i, n) &&
+        line_insert_text(l, pos + n, l->kill_text, entry->len - n)) {
+        undo_record(l, true, pos, l->buf.data + pos, entry->len, joined);
+        l->pos += entry->len;
+        l->kill_age = age;
+        l->kill_yanking = true;
+        l->yank_len = entry->len;
+    }
+}
+
+/* Refresh */
+
+// Clear and refresh the current line in single-line mode
+static ComlinStatus
+refresh_single_line(ComlinState const* const l, ComlinRefreshFlags const flags)
+{
+    // Chop the start if necessary so the cursor is on screen
+    size_t start = 0U;
+    size_t len = l->buf.length;
+    size_t pos = l->pos;
+    if (l->plen + l->pos >= l->cols) {
+        start = l->plen + l->pos + 1U - l->cols;
+        len -= start;
+        pos -= start;
+    }
+
+    // Truncate display length to fit on the row
+    if (l->plen + len > l->cols) {
+        len = l->cols - l->plen;
+    }
+
+    // Start building an update for the whole row (to be sent in one write)
+    StringBuf update = {NULL, 0U, 0U};
+    buf_append(&update, "\r", 1);
+
+    if (flags & REFRESH_WRITE) {
+        // Write the prompt and the current buffer content
+        buf_append(&update, l->prompt, l->plen);
+        append_line_range(&update, l, start, len);
+
+        // Write the suggestion after the end of the line if it's visible
+        if (start + len == l->buf.length) {
+            append_suggestion(&update, l, l->cols - l->plen - len);
+        }
+    }
+
+    // Erase to right
+    buf_append(&update, VTESC "0K", 4);
+
+    if (flags & REFRESH_WRITE) {
+        // Move cursor to original position
+        buf_append(&update, "\r", 1);
+        buf_append_vtesc(&update, pos + l->plen, 'C');
+    }
+
+    ComlinStatus const st = write_string(l->ofd, update.data, update.length);
+    buf_free(&update);
+    return st;
+}
+
+// Refresh the current line in multi-line mode
+static ComlinStatus
+refresh_multi_line(ComlinState* const l, ComlinRefreshFlags const flags)
+{
+    size_t const rpos = (l->plen + l->oldpos + l->cols) / l->cols;
+    size_t const old_rows = l->oldrows;
+    int const fd = l->ofd;
+
+    // Calculate the total number of rows in the line
+    size_t rows = (l->plen + l->buf.length + l->cols - 1U) / l->cols;
+    l->oldrows = rows;
+
+    // We'll build the update here, then send it all in a single write
+    StringBuf update = {NULL, 0U, 0U};
+
+    // First clear all the old used rows
+    if (flags & REFRESH_CLEAN) {
+        // Go to the last row
+        if (old_rows > rpos) {
+            buf_append_vtesc(&update, old_rows - rpos, 'B');
+        }
+
+        // For each row, clear it, then move up
+        for (size_t j = 1U; j < old_rows; ++j) {
+            buf_append(&update, "\r" VTESC "0K" VTESC "1A", 9U);
+        }
+    }
+
+    if (flags & REFRESH_WRITE) {
+        // Write the current prompt and line over the current row
+        buf_append(&update, "\r", 1);
+        buf_append(&update, l->prompt, l->plen);
+        append_line_range(&update, l, 0U, l->buf.length);
+
+        // Write the suggestion if the line ends before the end of a row
+        size_t const used = (l->plen + l->buf.length) % l->cols;
+        if (used) {
+            append_suggestion(&update, l, l->cols - used);
+        }
+
+        buf_append(&update, VTESC "0K", 4U);
+
+        // If we're at the end of the row, move to the start of the next
+        if (l->pos && l->pos == l->buf.length &&
+            (l->pos + l->plen) % l->cols == 0) {
+            buf_append(&update, "\n\r", 2);
+            if (++rows > l->oldrows) {
+                l->oldrows = rows;
+            }
+        }
+
+        // Move the cursor up to the correct row if necessary
+        size_t const rpos2 = (l->plen + l->pos + l->cols) / l->cols;
+        if (rows > rpos2) {
+            buf_append_vtesc(&update, rows - rpos2, 'A');
+        }
+
+        // Move the cursor to the correct column
+        buf_append(&update, "\r", 1);
+        size_t const col = (l->plen + l->pos) % l->cols;
+        if (col) {
+            buf_append_vtesc(&update, col, 'C');
+        }
+    }
+
+    l->oldpos = l->pos;
+
+    ComlinStatus const st = write_string(fd, update.data, update.length);
+    buf_free(&update);
+    return st;
+}
+
+// Maximum number of rows in a page of the completion menu
+static size_t const max_menu_rows = 8U;
+
+// Return the number of rows used by the line below the cursor
+static size_t
+rows_below_cursor(ComlinState const* const l)
+{
+    if (line_is_windowed(l)) {
+        return 0U;
+    }
+
+    size_t const row = (l->plen + l->oldpos + l->cols) / l->cols;
+    return (l->oldrows > row) ? l->oldrows - row : 0U;
+}
+
+// Append a move from the start of a menu row back to the cursor
+static void
+append_menu_return(StringBuf* const buf,
+                   ComlinState const* const l,
+                   size_t const row)
+{
+    buf_append_vtesc(buf, rows_below_cursor(l) + 1U + row, 'A');
+    buf_append(buf, "\r", 1U);
+
+    size_t col = l->plen + l->pos;
+    if (!line_is_windowed(l)) {
+        col %= l->cols;
+    } else if (col >= l->cols) {
+        col = l->cols - 1U;
+    }
+
+    if (col) {
+        buf_append_vtesc(buf, col, 'C');
+    }
+}
+
+// Append a completion as a menu cell, highlighted if it's proposed
+static void
+append_menu_cell(StringBuf* const buf,
+                 ComlinState const* const l,
+                 ComlinCompletions const* const lc,
+                 size_t const i,
+                 bool const pad)
+{
+    size_t const width = l->menu_width;
+    size_t const n = completion_length(lc, i);
+    size_t const len = (n < width) ? n : width - 1U;
+    bool const selected = i == l->completion_idx;
+
+    if (selected) {
+        buf_append(buf, VTESC "7m", 4U);
+    }
+
+    buf_append(buf, lc->cvec[i], len);
+
+    if (selected) {
+        buf_append(buf, VTESC "0m", 4U);
+    }
+
+    for (size_t c = len; pad && c < width; ++c) {
+        buf_append(buf, " ", 1U);
+    }
+}
+
+// Repaint a single menu cell on the page that is currently shown
+static void
+append_menu_cell_update(StringBuf* const buf,
+                        ComlinState const* const l,
+                        ComlinCompletions const* const lc,
+                        size_t const i)
+{
+    size_t const page_size = max_menu_rows * l->menu_cols;
+    if (i < lc->len && i / page_size == l->menu_page) {
+        size_t const row = (i % page_size) / l->menu_cols;
+        size_t const col = i % l->menu_cols;
+
+        buf_append_vtesc(buf, rows_below_cursor(l) + 1U + row, 'B');
+        buf_append(buf, "\r", 1U);
+        if (col) {
+            buf_append_vtesc(buf, col * l->menu_width, 'C');
+        }
+
+        append_menu_cell(buf, l, lc, i, false);
+        append_menu_return(buf, l, row);
+    }
+}
+
+/* Show the completion menu below the line.
+ *
+ * The column width is calculated once for each set of completions.  After
+ * that, the whole visible page is only drawn when the page or the height of
+ * the line changes, and otherwise only the cells of the previously and newly
+ * proposed completions are repainted.
+ */
+static ComlinStatus
+refresh_menu(ComlinState* const l, ComlinCompletions const* const lc)
+{
+    if (!l->menumode || l->dumb || l->cols < 2U || !lc->len) {
+        return COMLIN_SUCCESS;
+    }
+
+    // Lay out the columns for a new set of completions
+    if (!l->menu_width) {
+        size_t width = 0U;
+        for (size_t i = 0U; i < lc->len; ++i) {
+            size_t const len = completion_length(lc, i);
+            width = (len > width) ? len : width;
+        }
+
+        l->menu_width = (width + 2U < l->cols) ? width + 2U : l->cols;
+        l->menu_cols = l->cols / l->menu_width;
+        l->menu_rows = 0U;
+    }
+
+    size_t const page_size = max_menu_rows * l->menu_cols;
+    size_t const page = (l->completion_idx < lc->len)
+                          ? l->completion_idx / page_size
+                          : l->menu_page;
+
+    StringBuf update = {NULL, 0U, 0U};
+    if (l->menu_rows && page == l->menu_page &&
+        l->menu_line_rows == l->oldrows) {
+        // Move the highlight from the old cell to the new one
+        append_menu_cell_update(&update, l, lc, l->menu_selected);
+        append_menu_cell_update(&update, l, lc, l->completion_idx);
+    } else {
+        // Draw every cell on the page, scrolling the screen if necessary
+        size_t const first = page * page_size;
+        size_t const last =
+          (lc->len - first < page_size) ? lc->len : first + page_size;
+
+        size_t const rows_below = rows_below_cursor(l);
+        if (rows_below) {
+            buf_append_vtesc(&update, rows_below, 'B');
+        }
+
+        size_t rows = 0U;
+        for (size_t i = first; i < last; ++rows) {
+            buf_append(&update, "\r\n", 2U);
+            for (size_t c = 0U; c < l->menu_cols && i < last; ++c, ++i) {
+                append_menu_cell(
+                  &update, l, lc, i, c + 1U < l->menu_cols && i + 1U < last);
+            }
+
+            buf_append(&update, VTESC "0K", 4U);
+        }
+
+        // Erase any rows left over from a larger page
+        buf_append(&update, VTESC "0J", 4U);
+        append_menu_return(&update, l, rows - 1U);
+
+        l->menu_rows = rows;
+        l->menu_page = page;
+        l->menu_line_rows = l->oldrows;
+    }
+
+    l->menu_selected = l->completion_idx;
+
+    ComlinStatus const st = write_string(l->ofd, update.data, update.length);
+    buf_free(&update);
+    return st;
+}
+
+// Erase the completion menu if it's shown
+static ComlinStatus
+clear_menu(ComlinState* const l)
+{
+    if (!l->menu_rows) {
+        return COMLIN_SUCCESS;
+    }
+
+    StringBuf update = {NULL, 0U, 0U};
+    buf_append_vtesc(&update, rows_below_cursor(l) + 1U, 'B');
+    buf_append(&update, "\r" VTESC "0J", 5U);
+    append_menu_return(&update, l, 0U);
+    l->menu_rows = 0U;
+
+    ComlinStatus const st = write_string(l->ofd, update.data, update.length);
+    buf_free(&update);
+    return st;
+}
+
+// Optionally clear and/or refresh the current line
+static ComlinStatus
+refresh_line_with_flags(ComlinState* const l, ComlinRefreshFlags const flags)
+{
+    if (!line_is_windowed(l)) {
+        return refresh_multi_line(l, flags);
+    }
+
+    ComlinStatus st = COMLIN_SUCCESS;
+    if (l->mlmode) {
+        // Clear any rows used by the line before it became large
+        if (l->oldrows > 1U && (flags & REFRESH_CLEAN)) {
+            st = refresh_multi_line(l, REFRESH_CLEAN);
+        }
+
+        l->oldpos = 0U;
+        l->oldrows = 1U;
+    }
+
+    return st ? st : refresh_single_line(l, flags);
+}
+
+ComlinStatus
+comlin_hide(ComlinState* const l)
+{
+    ComlinStatus const st = clear_menu(l);
+    line_close_gap(l);
+    return st ? st : refresh_line_with_flags(l, REFRESH_CLEAN);
+}
+
+ComlinStatus
+comlin_show(ComlinState* const l)
+{
+    receive_completions(l);
+    if (l->in_completion && l->buf.length) {
+        line_close_gap(l);
+        return refresh_line_with_completion(
+          l, get_completions(l), REFRESH_WRITE);
+    }
+
+    return refresh_line_with_flags(l, REFRESH_WRITE);
+}
+
+/* Editing Operations */
+
+static inline ComlinStatus
+edit_status(ComlinStatus const st)
+{
+    return st ? st : COMLIN_EDITING;
+}
+
+/* Update the suggestion to the rest of the newest entry that extends the line.
+ *
+ * This is done on every refresh, so the line is used in two parts around the
+ * gap, rather than closing the gap and opening it again for the next edit.
+ */
+static void
+suggest_update(ComlinState* const l)
+{
+    StringBuf* const s = &l->suggestion;
+
+    s->length = 0U;
+    if (l->suggestmode && !l->maskmode && !l->in_search && l->buf.length &&
+        l->buf.length < large_line_length && !history_index_prefixes(l)) {
+        char const* const data = l->buf.data;
+        size_t const head_len = l->gap_len ? l->gap_pos : l->buf.length;
+        char const* const tail = data + head_len + l->gap_len;
+        size_t const tail_len = l->buf.length - head_len;
+        size_t const len = prefix_index_suggest(
+          l->prefixes, data, head_len, tail, tail_len, s->data, s->size);
+
+        if (len >= s->size) {
+            char* const buf = (char*)realloc(s->data, len + 1U);
+            if (!buf) {
+                return;
+            }
+
+            s->data = buf;
+            s->size = len + 1U;
+            prefix_index_suggest(
+              l->prefixes, data, head_len, tail, tail_len, s->data, s->size);
+        }
+
+        s->length = len;
+    }
+}
+
+// Return true if more input can be read without blocking
+static bool
+input_is_ready(int const fd)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1U, 0) > 0;
+}
+
+static ComlinStatus
+comlin_edit_refresh(ComlinState* const l)
+{
+    // Skip refreshing a large line until everything pasted has been read
+    l->refresh_pending =
+      l->buf.length >= large_line_length && input_is_ready(l->ifd);
+    if (l->refresh_pending) {
+        return COMLIN_EDITING;
+    }
+
+    suggest_update(l);
+    ComlinStatus const st = clear_menu(l);
+    return edit_status(st ? st : refresh_line_with_flags(l, REFRESH_ALL));
+}
+
+/* Write a character inserted at the end of a line that fits on one row.
+ *
+ * This only writes the character and the change to the suggestion after it,
+ * which is nothing if the character is the start of the current suggestion.
+ */
+static ComlinStatus
+write_insertion(ComlinState* const l, char const c)
+{
+    StringBuf* const s = &l->suggestion;
+    char const d = (char)(l->maskmode ? '*' : c);
+    if (!l->suggestmode || (s->length && s->data[0] == c)) {
+        if (s->length) {
+            memmove(s->data, s->data + 1U, s->length--);
+        }
+
+        return write(l->ofd, &d, 1) == 1 ? COMLIN_EDITING : COMLIN_BAD_WRITE;
+    }
+
+    // Write the new suggestion, leaving the last column free for the cursor
+    size_t const old_length = s->length;
+    StringBuf update = {NULL, 0U, 0U};
+    buf_append(&update, &d, 1U);
+    suggest_update(l);
+
+    size_t const room = l->cols - l->plen - l->buf.length - 1U;
+    size_t const shown = append_suggestion(&update, l, room);
+    if (shown || old_length) {
+        buf_append(&update, VTESC "0K", 4U);
+    }
+
+    if (shown) {
+        buf_append_vtesc(&update, shown, 'D');
+    }
+
+    ComlinStatus const st = write_string(l->ofd, update.data, update.length);
+    buf_free(&update);
+    return edit_status(st);
+}
+
+// Accept the suggestion if the cursor is at the end of the line
+static ComlinStatus
+suggest_accept(ComlinState* const l)
+{
+    if (l->pos == l->buf.length && l->suggestion.length) {
+        line_close_gap(l);
+        undo_record(l,
+                    true,
+                    l->buf.length,
+                    l->suggestion.data,
+                    l->suggestion.length,
+                    false);
+        buf_append(&l->buf, l->suggestion.data, l->suggestion.length);
+        l->pos = l->buf.length;
+        return comlin_edit_refresh(l);
+    }
+
+    return COMLIN_EDITING;
+}
+
+// Remove the suggestion from the screen if one is shown
+static ComlinStatus
+suggest_clear(ComlinState* const l)
+{
+    if (l->suggestion.length) {
+        l->suggestion.length = 0U;
+        return refresh_line_with_flags(l, REFRESH_ALL);
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+// Insert a character at the current cursor position
+static ComlinStatus
+comlin_edit_insert(ComlinState* const l, char const c)
+{
+    if (line_open_gap(l)) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    // Insert into the start of the gap
+    undo_record(l, true, l->pos, &c, 1U, false);
+    l->typing = true;
+    l->buf.data[l->pos++] = c;
+    ++l->buf.length;
+    ++l->gap_pos;
+    --l->gap_len;
+    line_mark_gap(l);
+
+    if (l->buf.length == l->pos && (!l->mlmode || l->oldrows <= 1U) &&
+        l->plen + l->buf.length < l->cols) {
+        // Avoid a full update of the line in the trivial case
+        return write_insertion(l, c);
+    }
+
+    return comlin_edit_refresh(l);
+}
+
+// Move cursor one column to the left if possible
+static ComlinStatus
+comlin_edit_move_left(ComlinState* const l)
+{
+    if (l->pos > 0) {
+        --l->pos;
+        return comlin_edit_refresh(l);
+    }
+    return COMLIN_EDITING;
+}
+
+// Move cursor one column to the right, or accept the suggestion at the end
+static ComlinStatus
+comlin_edit_move_right(ComlinState* const l)
+{
+    if (l->pos != l->buf.length) {
+        ++l->pos;
+        return comlin_edit_refresh(l);
+    }
+    return suggest_accept(l);
+}
+
+// Move cursor to the start of the line
+static ComlinStatus
+comlin_edit_move_home(ComlinState* const l)
+{
+    if (l->pos != 0) {
+        l->pos = 0;
+        return comlin_edit_refresh(l);
+    }
+    return COMLIN_EDITING;
+}
+
+// Move cursor to the end of the line, or accept the suggestion at the end
+static ComlinStatus
+comlin_edit_move_end(ComlinState* const l)
+{
+    if (l->pos != l->buf.length) {
+        l->pos = l->buf.length;
+        return comlin_edit_refresh(l);
+    }
+    return suggest_accept(l);
+}
+
+// Transpose the character under the cursor with the previous character
+static ComlinStatus
+comlin_edit_transpose(ComlinState* const state)
+{
+    if (state->pos > 0U && state->pos < state->buf.length) {
+        char* const chars = state->buf.data + state->pos - 1U;
+        undo_record(state, false, state->pos - 1U, chars, 2U, false);
+
+        char const aux = chars[0];
+        chars[0] = chars[1];
+        chars[1] = aux;
+        undo_record(state, true, state->pos - 1U, chars, 2U, true);
+        if (state->pos != state->buf.length - 1U) {
+            ++state->pos;
+        }
+        return edit_status(comlin_edit_refresh(state));
+    }
+    return COMLIN_EDITING;
+}
+
+// Return the edited copy of a history entry, or null
+static HistoryEdit*
+history_find_edit(ComlinState const* const l, size_t const index)
+{
+    for (size_t i = 0U; i < l->n_edits; ++i) {
+        if (l->edits[i].index == index) {
+            return &l->edits[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Record the edit line as the edited text of a history entry
+static ComlinStatus
+history_set_edit(ComlinState* const l, size_t const index)
+{
+    char const* const original = history_get(l, index);
+    HistoryEdit* edit = history_find_edit(l, index);
+    char const* const current = edit ? edit->text : original;
+    if (line_equals(l, current, strlen(current))) {
+        return COMLIN_SUCCESS; // Unchanged
+    }
+
+    if (line_equals(l, original, history_size(l, index) - 1U)) {
+        // Changed back to the original, so drop the edit
+        free(edit->text);
+        *edit = l->edits[--l->n_edits];
+        return COMLIN_SUCCESS;
+    }
+
+    if (!edit) {
+        size_t const size = sizeof(HistoryEdit) * (l->n_edits + 1U);
+        HistoryEdit* const edits = (HistoryEdit*)realloc(l->edits, size);
+        if (!edits) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        l->edits = edits;
+        edit = &l->edits[l->n_edits++];
+        edit->index = index;
+        edit->text = NULL;
+    }
+
+    char* const text = (char*)realloc(edit->text, l->buf.length + 1U);
+    if (!text) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    line_copy(l, text);
+    edit->text = text;
+    return COMLIN_SUCCESS;
+}
+
+// Discard all edited copies of history entries
+static void
+history_clear_edits(ComlinState* const l)
+{
+    for (size_t i = 0U; i < l->n_edits; ++i) {
+        free(l->edits[i].text);
+    }
+
+    l->n_edits = 0U;
+}
+
+/* Substitute the currently edited line with the next or previous history
+ * entry.
+ *
+ * Entries themselves are never modified here.  If the user changed the line,
+ * then an edited copy is kept until the line is finished, so navigating
+ * through history without editing doesn't allocate anything.
+ */
+static ComlinStatus
+comlin_edit_history_step(ComlinState* const l, ComlinHistoryDirection const dir)
+{
+    if (l->history_len > 1U) {
+        // Save any changes to the current entry before replacing it
+        size_t const current_index = l->history_len - 1U - l->history_index;
+        if (history_set_edit(l, current_index)) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        // Update the history index
+        if (dir == COMLIN_HISTORY_NEXT) {
+            if (l->history_index == 0) {
+                return COMLIN_EDITING;
+            }
+            --l->history_index;
+        } else {
+            if (l->history_index == l->history_len - 1U) {
+                return COMLIN_EDITING;
+            }
+            ++l->history_index;
+        }
+
+        // Show the new entry, or the edited copy of it
+        size_t const new_index = l->history_len - 1U - l->history_index;
+        HistoryEdit const* const edit = history_find_edit(l, new_index);
+        char const* const entry = edit ? edit->text : history_get(l, new_index);
+        l->pos = strlen(entry);
+        l->buf.length = 0U;
+        l->gap_len = 0U;
+        buf_append(&l->buf, entry, l->pos);
+        undo_clear(l); // Edits to other entries can't be undone in this one
+        return comlin_edit_refresh(l);
+    }
+    return COMLIN_EDITING;
+}
+
+static ComlinStatus
+comlin_edit_history_prev(ComlinState* const l)
+{
+    return comlin_edit_history_step(l, COMLIN_HISTORY_PREV);
+}
+
+static ComlinStatus
+comlin_edit_history_next(ComlinState* const l)
+{
+    return comlin_edit_history_step(l, COMLIN_HISTORY_NEXT);
+}
+
+static void
+comlin_edit_history_pop(ComlinState* const state)
+{
+    if (state->history_len) {
+        history_remove(state, state->history_len - 1U);
+    }
+
+    history_clear_edits(state);
+    state->history_index = 0U;
+}
+
+// Delete the character to the right of the cursor
+static ComlinStatus
+comlin_edit_delete(ComlinState* const l)
+{
+    if (l->pos < l->buf.length) {
+        // Extend the gap over the character after it
+        line_move_gap(l);
+        undo_record(
+          l, false, l->pos, l->buf.data + l->pos + l->gap_len, 1U, false);
+        --l->buf.length;
+        ++l->gap_len;
+        line_mark_gap(l);
+        return comlin_edit_refresh(l);
+    }
+    return COMLIN_EDITING;
+}
+
+static ComlinStatus
+comlin_edit_interrupt(ComlinState* const l)
+{
+    ComlinStatus const st = suggest_clear(l);
+    return st ? st : COMLIN_INTERRUPTED;
+}
+
+static ComlinStatus
+comlin_edit_eof(ComlinState* const l)
+{
+    if (!l->buf.length) {
+        comlin_edit_history_pop(l);
+        return COMLIN_END;
+    }
+
+    return comlin_edit_delete(l);
+}
+
+// Backspace implementation
+static ComlinStatus
+comlin_edit_backspace(ComlinState* const l)
+{
+    if (l->pos) {
+        // Extend the gap over the character before it
+        line_move_gap(l);
+        undo_record(
+          l, false, l->pos - 1U, l->buf.data + l->pos - 1U, 1U, false);
+        --l->pos;
+        --l->buf.length;
+        --l->gap_pos;
+        ++l->gap_len;
+        line_mark_gap(l);
+        return comlin_edit_refresh(l);
+    }
+    return COMLIN_EDITING;
+}
+
+// Delete the word before the cursor
+static ComlinStatus
+comlin_edit_delete_prev_word(ComlinState* const l)
+{
+    size_t const old_pos = l->pos;
+
+    while (l->pos > 0 && l->buf.data[l->pos - 1U] == ' ') {
+        --l->pos;
+    }
+    while (l->pos > 0 && l->buf.data[l->pos - 1U] != ' ') {
+        --l->pos;
+    }
+    size_t const diff = old_pos - l->pos;
+    undo_record(l, false, l->pos, l->buf.data + l->pos, diff, false);
+    kill_ring_add(l, l->buf.data + l->pos, diff, false);
+    memmove(l->buf.data + l->pos,
+            l->buf.data + old_pos,
+            l->buf.length + 1U - old_pos);
+    l->buf.length -= diff;
+    return comlin_edit_refresh(l);
+}
+
+// Undo the last step of editing
+static ComlinStatus
+comlin_edit_undo(ComlinState* const l)
+{
+    if (!l->undo_len) {
+        comlin_beep(l);
+        return COMLIN_EDITING;
+    }
+
+    do {
+        undo_apply(l, undo_op(l, --l->undo_len), true);
+    } while (l->undo_len && undo_op(l, l->undo_len)->joined);
+
+    return comlin_edit_refresh(l);
+}
+
+// Redo the last undone step of editing
+static ComlinStatus
+comlin_edit_redo(ComlinState* const l)
+{
+    if (l->undo_len == l->n_undo_ops) {
+        comlin_beep(l);
+        return COMLIN_EDITING;
+    }
+
+    do {
+        undo_apply(l, undo_op(l, l->undo_len++), false);
+    } while (l->undo_len < l->n_undo_ops && undo_op(l, l->undo_len)->joined);
+
+    return comlin_edit_refresh(l);
+}
+
+// Insert the most recently killed text
+static ComlinStatus
+comlin_edit_yank(ComlinState* const l)
+{
+    if (!l->n_kills) {
+        return COMLIN_EDITING;
+    }
+
+    kill_ring_yank(l, 0U, false);
+    return comlin_edit_refresh(l);
+}
+
+// Replace the text just yanked with the next older killed text
+static ComlinStatus
+comlin_edit_yank_pop(ComlinState* const l)
+{
+    size_t const count = kill_ring_count(l);
+    if (!l->was_kill_yanking || !count) {
+        comlin_beep(l);
+        return COMLIN_EDITING;
+    }
+
+    size_t const start = l->pos - l->yank_len;
+    undo_record(l, false, start, l->buf.data + start, l->yank_len, false);
+    line_delete_text(l, start, l->yank_len);
+    l->pos = start;
+
+    kill_ring_yank(l, (l->kill_age + 1U) % count, true);
+    return comlin_edit_refresh(l);
+}
+
+static ComlinStatus
+comlin_edit_clear_screen(ComlinState* const state)
+{
+    ComlinStatus const st = comlin_clear_screen(state);
+
+    return st ? st : edit_status(comlin_edit_refresh(state));
+}
+
+static ComlinStatus
+comlin_edit_clear_line_backwards(ComlinState* const l)
+{
+    if (l->pos > 0) {
+        size_t const new_length = l->buf.length - l->pos;
+        undo_record(l, false, 0U, l->buf.data, l->pos, false);
+        kill_ring_add(l, l->buf.data, l->pos, false);
+        memmove(l->buf.data, l->buf.data + l->pos, new_length + 1);
+        l->buf.length = new_length;
+        l->pos = 0;
+        return comlin_edit_refresh(l);
+    }
+    return COMLIN_EDITING;
+}
+
+static ComlinStatus
+comlin_edit_clear_line_forwards(ComlinState* const l)
+{
+    if (l->pos < l->buf.length) {
+        undo_record(l,
+                    false,
+                    l->pos,
+                    l->buf.data + l->pos,
+                    l->buf.length - l->pos,
+                    false);
+        kill_ring_add(
+          l, l->buf.data + l->pos, l->buf.length - l->pos, true);
+        l->buf.data[l->pos] = '\0';
+        l->buf.length = l->pos;
+        return comlin_edit_refresh(l);
+    }
+    return COMLIN_EDITING;
+}
+
+static ComlinStatus
+comlin_edit_submit(ComlinState* const l)
+{
+    if (l->metamode) {
+        // Record metadata to use if the line is added to the history
+        struct timespec now = {0, 0};
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        int64_t const ms = ((int64_t)(now.tv_sec - l->start.tv_sec) * 1000) +
+                           ((now.tv_nsec - l->start.tv_nsec) / 1000000);
+
+        l->entered.time = (int64_t)time(NULL);
+        l->entered.duration = ms > 0 ? (uint32_t)ms : 0U;
+    }
+
+    ComlinStatus const st = suggest_clear(l);
+    if (st) {
+        return st;
+    }
+
+    comlin_edit_history_pop(l);
+    if (l->mlmode) {
+        comlin_edit_move_end(l);
+    }
+    l->buf.data[l->buf.length] = '\0';
+    return COMLIN_SUCCESS;
+}
+
+/* History Search */
+
+// Score added to a search match for every doubling of the entry's frecency
+static int32_t const frecency_bonus = 16;
+
+// Order search matches by descending score, then from newest to oldest
+static int
+compare_matches(void const* const a, void const* const b)
+{
+    SearchMatch const* const lhs = (SearchMatch const*)a;
+    SearchMatch const* const rhs = (SearchMatch const*)b;
+
+    return (lhs->score > rhs->score)   ? -1
+           : (lhs->score < rhs->score) ? 1
+           : (lhs->index > rhs->index) ? -1
+           : (lhs->index < rhs->index) ? 1
+                                       : 0;
+}
+
+/* Match a history entry against the query, appending it to matches if found.
+ *
+ * If frecency is recorded, then the match score is boosted by the magnitude of
+ * the entry's frecency, so an entry used a thousand times is ranked as if it
+ * matched ten more characters than one that was only used once.
+ */
+static size_t
+search_entry(ComlinState* const l,
+             FuzzyMatcher const matcher,
+             int64_t const now,
+             size_t const index,
+             size_t const n_matches)
+{
+    int32_t score = 0;
+    if (fuzzy_match(matcher,
+                    l->search_query.data,
+                    l->search_query.length,
+                    history_get(l, index),
+                    history_size(l, index) - 1U,
+                    &score)) {
+        if (l->history_scores) {
+            double const frecency = history_frecency(l, index, now);
+            for (uint64_t f = (uint64_t)frecency; f; f >>= 1U) {
+                score += frecency_bonus;
+            }
+        }
+
+        l->matches[n_matches].score = score;
+        l->matches[n_matches].index = index;
+        return n_matches + 1U;
+    }
+
+    return n_matches;
+}
+
+/* Update the history entries that match the search query.
+ *
+ * If the query was only extended, then only previous matches can still match,
+ * so they are filtered rather than searching the whole history again.
+ */
+static ComlinStatus
+search_update(ComlinState* const l, bool const narrow)
+{
+    FuzzyMatcher const matcher = fuzzy_matcher();
+    int64_t const now = (int64_t)time(NULL);
+    size_t n = 0U;
+
+    if (!l->search_query.length) {
+        l->n_matches = 0U;
+        l->match_idx = 0U;
+        return COMLIN_SUCCESS;
+    }
+
+    if (narrow) {
+        for (size_t i = 0U; i < l->n_matches; ++i) {
+            n = search_entry(l, matcher, now, l->matches[i].index, n);
+        }
+    } else {
+        SearchMatch* const matches = (SearchMatch*)realloc(
+          l->matches, sizeof(SearchMatch) * (l->history_len + 1U));
+        if (!matches) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        // Search all entries except the newest, which is the current line
+        l->matches = matches;
+        for (size_t i = 0U; i + 1U < l->history_len; ++i) {
+            n = search_entry(l, matcher, now, i, n);
+        }
+    }
+
+    if (n) {
+        qsort(l->matches, n, sizeof(SearchMatch), compare_matches);
+    }
+
+    l->n_matches = n;
+    l->match_idx = 0U;
+    return COMLIN_SUCCESS;
+}
+
+// Show the search prompt and the current match, or the original line
+static ComlinStatus
+search_refresh(ComlinState* const l)
+{
+    l->search_prompt.length = 0U;
+    buf_append(&l->search_prompt, "(search)`", 9U);
+    buf_append(
+      &l->search_prompt, l->search_query.data, l->search_query.length);
+    buf_append(&l->search_prompt, "': ", 3U);
+    l->prompt = l->search_prompt.data;
+    l->plen = l->search_prompt.length;
+
+    char const* text = l->search_line.data;
+    size_t len = l->search_line.length;
+    if (l->match_idx < l->n_matches) {
+        size_t const index = l->matches[l->match_idx].index;
+        text = history_get(l, index);
+        len = history_size(l, index) - 1U;
+    }
+
+    l->buf.length = 0U;
+    buf_append(&l->buf, text, len);
+    l->pos = len;
+    return comlin_edit_refresh(l);
+}
+
+// Stop searching, keeping the current match in the line if `accept` is true
+static ComlinStatus
+search_stop(ComlinState* const l, bool const accept)
+{
+    if (accept) {
+        undo_record_replace(l,
+                            l->search_line.data,
+                            l->search_line.length,
+                            l->buf.data,
+                            l->buf.length);
+    } else {
+        l->buf.length = 0U;
+        buf_append(&l->buf, l->search_line.data, l->search_line.length);
+        l->pos = l->buf.length;
+    }
+
+    l->in_search = false;
+    l->prompt = l->saved_prompt;
+    l->plen = strlen(l->prompt);
+    return comlin_edit_refresh(l);
+}
+
+// Start an incremental fuzzy search through the history
+static ComlinStatus
+comlin_edit_search(ComlinState* const l)
+{
+    if (l->maskmode) {
+        return COMLIN_EDITING;
+    }
+
+    history_file_check(&l->history_file);
+    l->in_search = true;
+    l->saved_prompt = l->prompt;
+    l->search_query.length = 0U;
+    buf_append(&l->search_query, "", 0U);
+    l->search_line.length = 0U;
+    buf_append(&l->search_line, l->buf.data, l->buf.length);
+    l->n_matches = 0U;
+    l->match_idx = 0U;
+    return search_refresh(l);
+}
+
+/* Handle a key pressed while searching.
+ *
+ * Like #complete_line, this returns zero if the key was consumed, otherwise
+ * the search is finished and the key should be handled as usual.
+ */
+static char
+search_key(ComlinState* const l, char const c)
+{
+    if (c == CTRL_R) {
+        // Show the next best match
+        if (l->match_idx + 1U < l->n_matches) {
+            ++l->match_idx;
+            search_refresh(l);
+        } else {
+            comlin_beep(l);
+        }
+    } else if (c == CTRL_G) {
+        search_stop(l, false);
+    } else if (c == DEL || c == CTRL_H) {
+        if (l->search_query.length) {
+            l->search_query.data[--l->search_query.length] = '\0';
+            search_update(l, false);
+        }
+        search_refresh(l);
+    } else if ((unsigned char)c >= 0x20U) {
+        buf_append(&l->search_query, &c, 1U);
+        search_update(l, l->search_query.length > 1U);
+        if (!l->n_matches) {
+            comlin_beep(l);
+        }
+        search_refresh(l);
+    } else {
+        search_stop(l, true);
+        return c;
+    }
+
+    return 0;
+}
+
+/* State */
+
+ComlinState*
+comlin_new_state(int const in_fd,
+                 int const out_fd,
+                 char const* const term,
+                 size_t const max_history_len)
+{
+    ComlinState* const l = (ComlinState*)calloc(1, sizeof(ComlinState));
+    if (l && pthread_mutex_init(&l->mutex, NULL)) {
+        free(l);
+        return NULL;
+    }
+
+    if (l) {
+        l->ifd = in_fd;
+        l->ofd = out_fd;
+        l->dumb = is_unsupported_term(term);
+        l->history_max_len = max_history_len;
+    }
+    return l;
+}
+
+void
+comlin_free_state(ComlinState* const state)
+{
+    // Free history
+    for (size_t j = 0U; j < state->history_len; ++j) {
+        history_free_entry(state, state->history[j]);
+    }
+    free(state->history);
+    free(state->history_sizes);
+    free(state->history_seqs);
+    history_unindex_sizes(state);
+    buf_free(&state->history_path);
+    free(state->history_scores);
+    free(state->history_times);
+    free(state->history_durations);
+    free(state->history_statuses);
+    history_file_unmap(&state->history_file);
+    history_clear_edits(state);
+    free(state->edits);
+    free(state->matches);
+    prefix_index_free(state->words);
+    prefix_index_free(state->prefixes);
+    cancel_completion_request(state);
+    pthread_mutex_destroy(&state->mutex);
+    buf_free(&state->request_key);
+    clear_completions(state);
+    free_dictionary(state);
+    path_cache_free(state->paths);
+    buf_free(&state->completion_line);
+    buf_free(&state->completion_key);
+    buf_free(&state->suggestion);
+    buf_free(&state->search_line);
+    buf_free(&state->search_prompt);
+    buf_free(&state->search_query);
+    buf_free(&state->undo_text);
+    free(state->undo_ops);
+    free(state->kill_text);
+
+    // Disable raw mode if it was enabled by comlin_new_state
+    disable_raw_mode(state);
+
+    free(state->buf.data);
+    free(state);
+}
+
+ComlinStatus
+comlin_set_mode(ComlinState* const state, ComlinModeFlags const flags)
+{
+    state->mlmode = flags & (ComlinModeFlags)COMLIN_MODE_MULTI_LINE;
+    state->maskmode = flags & (ComlinModeFlags)COMLIN_MODE_MASKED;
+    state->frecmode = flags & (ComlinModeFlags)COMLIN_MODE_HISTORY_FRECENCY;
+    state->suggestmode = flags & (ComlinModeFlags)COMLIN_MODE_AUTOSUGGEST;
+    state->wordmode = flags & (ComlinModeFlags)COMLIN_MODE_HISTORY_WORDS;
+    state->narrowmode = flags & (ComlinModeFlags)COMLIN_MODE_NARROWING;
+    state->prefixmode = flags & (ComlinModeFlags)COMLIN_MODE_COMMON_PREFIX;
+    state->menumode = flags & (ComlinModeFlags)COMLIN_MODE_COMPLETION_MENU;
+    state->pathmode = flags & (ComlinModeFlags)COMLIN_MODE_PATHS;
+    state->metamode = state->frecmode ||
+                      (flags & (ComlinModeFlags)COMLIN_MODE_HISTORY_METADATA);
+    return COMLIN_SUCCESS;
+}
+
+ComlinStatus
+comlin_edit_start(ComlinState* const l, char const* const prompt)
+{
+    // Enter raw mode
+    ComlinStatus const st = enable_raw_mode(l);
+    if (st) {
+        return st;
+    }
+
+    // Reset line state
+    l->pos = 0U;
+    l->oldpos = 0U;
+    l->buf.length = 0U;
+    l->gap_len = 0U;
+    l->oldrows = 0U;
+    l->refresh_pending = false;
+    if (!l->cols) {
+        l->cols = (size_t)get_columns(l);
+        if (l->buf.size < l->cols) {
+            free(l->buf.data);
+            l->buf.data = (char*)calloc(1, l->cols);
+            l->buf.size = l->cols;
+        }
+    }
+
+    // Set edit state
+    l->prompt = prompt;
+    l->plen = strlen(prompt);
+    l->buf.data[0] = '\0';
+    l->history_index = 0U;
+    l->suggestion.length = 0U;
+    l->yanking = false;
+    l->typing = false;
+    l->in_search = false;
+    undo_clear(l);
+    cancel_completion_request(l);
+    clear_completions(l);
+    history_clear_edits(l);
+    clock_gettime(CLOCK_MONOTONIC, &l->start);
+    memset(&l->entered, 0, sizeof(l->entered));
+    comlin_history_add(l, ""); // Latest history entry is the current line
+
+    // Write prompt
+    return write_string(l->ofd, l->prompt, l->plen);
+}
+
+static ComlinStatus
+comlin_edit_read_dumb(ComlinState* const l, char const c)
+{
+    switch (c) {
+    case CTRL_C:
+        return COMLIN_INTERRUPTED;
+    case CTRL_D:
+        return COMLIN_END;
+    case LFEED:
+    case CRETURN:
+        return COMLIN_SUCCESS;
+    default:
+        break;
     }
 
     write(l->ofd, &c, 1U);
@@ -1029,236 +3616,2154 @@ comlin_edit_read_dumb(ComlinState* const l, char const c)
     return COMLIN_EDITING;
 }
 
-static ComlinStatus
-comlin_edit_read_escape(ComlinState* l);
+static ComlinStatus
+comlin_edit_read_escape(ComlinState* l);
+
+static ComlinStatus
+comlin_edit_control(ComlinState* const state, char const c)
+{
+    typedef ComlinStatus (*ControlHandler)(ComlinState*);
+
+    static ControlHandler const control_handlers[0x20U] = {
+      NULL,                             // ^@
+      comlin_edit_move_home,            // ^A
+      comlin_edit_move_left,            // ^B
+      comlin_edit_interrupt,            // ^C
+      comlin_edit_eof,                  // ^D
+      comlin_edit_move_end,             // ^E
+      comlin_edit_move_right,           // ^F
+      NULL,                             // ^G
+      comlin_edit_backspace,            // ^H
+      NULL,                             // ^I
+      comlin_edit_submit,               // ^J
+      comlin_edit_clear_line_forwards,  // ^K
+      comlin_edit_clear_screen,         // ^L
+      comlin_edit_submit,               // ^M
+      comlin_edit_history_next,         // ^N
+      NULL,                             // ^O
+      comlin_edit_history_prev,         // ^P
+      NULL,                             // ^Q
+      comlin_edit_search,               // ^R
+      NULL,                             // ^S
+      comlin_edit_transpose,            // ^T
+      comlin_edit_clear_line_backwards, // ^U
+      NULL,                             // ^V
+      comlin_edit_delete_prev_word,     // ^W
+      NULL,                             // ^X
+      comlin_edit_yank,                 // ^Y
+      NULL,                             // ^Z
+      comlin_edit_read_escape,          // ^[
+      NULL,                             // ^Backslash
+      NULL,                             // ^]
+      NULL,                             // ^^
+      comlin_edit_undo,                 // ^_
+    };
+
+    ControlHandler const handler = control_handlers[(unsigned)c];
+    return handler ? handler(state) : COMLIN_EDITING;
+}
+
+// Return true if there is any source of completions
+static bool
+has_completions(ComlinState const* const l)
+{
+    return l->completion_callback || l->range_callback ||
+           l->stream_callback || l->completion_request || l->grammar ||
+           l->n_dictionary_words || l->pathmode || l->wordmode;
+}
+
+// Return true if a key can be handled with a gap in the line
+static bool
+is_gap_key(char const c)
+{
+    return (unsigned char)c >= 0x20U || c == CTRL_A || c == CTRL_B ||
+           c == CTRL_D || c == CTRL_E || c == CTRL_F || c == CTRL_H ||
+           c == ESC;
+}
+
+// Handle a key read from the input
+static ComlinStatus
+edit_key(ComlinState* const l, char c)
+{
+    if (l->dumb) {
+        return comlin_edit_read_dumb(l, c); // Fallback for dumb terminals
+    }
+
+    // Only insertion, deletion, and movement work with a gap in the line
+    if (l->in_search || l->in_completion || !is_gap_key(c)) {
+        line_close_gap(l);
+    }
+
+    if (l->in_search) {
+        c = search_key(l, c);
+        if (c == 0) {
+            return COMLIN_EDITING;
+        }
+    }
+
+    l->was_yanking = l->yanking;
+    l->yanking = false;
+    l->was_typing = l->typing;
+    l->typing = false;
+    l->was_killing = l->killing;
+    l->killing = false;
+    l->was_kill_yanking = l->kill_yanking;
+    l->kill_yanking = false;
+
+    if ((l->in_completion || c == TAB) && has_completions(l)) {
+        // Try to autocomplete
+        c = complete_line(l, c);
+        if (c < 0) {
+            return COMLIN_BAD_READ;
+        }
+        if (c == 0) {
+            return COMLIN_EDITING;
+        }
+    }
+
+    return (c < 0x20)   ? comlin_edit_control(l, c)
+           : (c == DEL) ? comlin_edit_backspace(l)
+                        : comlin_edit_insert(l, c);
+}
+
+ComlinStatus
+comlin_edit_feed(ComlinState* const l)
+{
+    // Show any completions that arrived since the last key
+    if (receive_completions(l)) {
+        ComlinStatus const st =
+          refresh_line_with_completion(l, &l->completions, REFRESH_ALL);
+        if (st) {
+            return st;
+        }
+    }
+
+    // Read the next character
+    char c = '\0';
+    ComlinStatus const st = read_char(l->ifd, &c);
+    if (st) {
+        return st;
+    }
+
+    // Handle it, then show the line if the last refresh was skipped
+    ComlinStatus rc = edit_key(l, c);
+    if (rc == COMLIN_EDITING && l->refresh_pending &&
+        !input_is_ready(l->ifd)) {
+        rc = comlin_edit_refresh(l);
+    }
+
+    // Cancel any completion request that is now stale
+    if (l->requesting && (rc != COMLIN_EDITING || !request_is_current(l))) {
+        cancel_completion_request(l);
+    }
+
+    // Make the line contiguous once editing has finished or input has paused
+    if (rc != COMLIN_EDITING || !input_is_ready(l->ifd)) {
+        line_close_gap(l);
+    }
+
+    return rc;
+}
+
+// Insert the last argument of the previous line, or an older one if repeated
+static ComlinStatus
+comlin_edit_yank_last_arg(ComlinState* const l)
+{
+    // Start from the line before this one, or before the last yanked line
+    size_t index = l->was_yanking ? l->yank_entry
+                   : l->history_len ? l->history_len - 1U
+                                    : 0U;
+
+    // Find the last token of the previous entry that has one
+    char const* token = NULL;
+    size_t token_len = 0U;
+    while (!token_len && index-- > 0U) {
+        char const* const text = history_get(l, index);
+        size_t const len = history_size(l, index) - 1U;
+        size_t const start = token_last(text, len);
+        size_t end = start;
+        token = text + start;
+        token_len = token_next(text, len, &end);
+    }
+
+    if (!token_len) {
+        l->yanking = l->was_yanking;
+        comlin_beep(l);
+        return COMLIN_EDITING;
+    }
+
+    // Remove the previously yanked argument if this is a repeat
+    if (l->was_yanking) {
+        undo_record(l,
+                    false,
+                    l->pos - l->yank_len,
+                    l->buf.data + l->pos - l->yank_len,
+                    l->yank_len,
+                    false);
+        memmove(l->buf.data + l->pos - l->yank_len,
+                l->buf.data + l->pos,
+                l->buf.length - l->pos + 1U);
+        l->pos -= l->yank_len;
+        l->buf.length -= l->yank_len;
+    }
+
+    // Insert the argument at the cursor
+    size_t const tail = l->buf.length - l->pos;
+    buf_append(&l->buf, token, token_len);
+    if (l->buf.length == l->pos + tail + token_len) {
+        memmove(l->buf.data + l->pos + token_len, l->buf.data + l->pos, tail);
+        memcpy(l->buf.data + l->pos, token, token_len);
+        undo_record(l, true, l->pos, token, token_len, l->was_yanking);
+        l->pos += token_len;
+        l->yanking = true;
+        l->yank_entry = index;
+        l->yank_len = token_len;
+    }
+
+    return comlin_edit_refresh(l);
+}
+
+// Handle a key pressed with Alt, which terminals send as ESC and the key
+static ComlinStatus
+comlin_edit_alt(ComlinState* const l, char const c)
+{
+    switch (c) {
+    case '.':
+        line_close_gap(l);
+        return comlin_edit_yank_last_arg(l);
+    case '/':
+        line_close_gap(l);
+        return comlin_edit_redo(l);
+    case 'y':
+        line_close_gap(l);
+        return comlin_edit_yank_pop(l);
+    default:
+        break;
+    }
+
+    return COMLIN_EDITING;
+}
+
+static ComlinStatus
+comlin_edit_read_escape(ComlinState* const l)
+{
+    // Read the next byte, which is a key pressed with Alt if not [ or O
+    char seq[4] = {'\0', '\0', '\0', '\0'};
+    if (read_char(l->ifd, &seq[0])) {
+        return COMLIN_BAD_READ;
+    }
+
+    if (seq[0] != '[' && seq[0] != 'O') {
+        return comlin_edit_alt(l, seq[0]);
+    }
+
+    // Read the next byte of the escape sequence
+    if (read_char(l->ifd, &seq[1])) {
+        return COMLIN_BAD_READ;
+    }
+
+    if (seq[0] == '[') { // ESC [ sequences
+        if (seq[1] >= '0' && seq[1] <= '9') {
+            // Extended escape, read additional byte
+            return read_char(l->ifd, &seq[2])         ? COMLIN_BAD_READ
+                   : (seq[1] == '3' && seq[2] == '~') ? comlin_edit_delete(l)
+                                                      : COMLIN_SUCCESS;
+        }
+
+        switch (seq[1]) {
+        case 'A': // Up
+            return comlin_edit_history_prev(l);
+        case 'B': // Down
+            return comlin_edit_history_next(l);
+        case 'C': // Right
+            return comlin_edit_move_right(l);
+        case 'D': // Left
+            return comlin_edit_move_left(l);
+        case 'H': // Home
+            return comlin_edit_move_home(l);
+        case 'F': // End
+            return comlin_edit_move_end(l);
+        default:
+            break;
+        }
+
+    } else if (seq[0] == 'O') { // ESC O sequence
+        switch (seq[1]) {
+        case 'H': // Home
+            return comlin_edit_move_home(l);
+        case 'F': // End
+            return comlin_edit_move_end(l);
+        default:
+            break;
+        }
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+ComlinStatus
+comlin_edit_stop(ComlinState* const l)
+{
+    if (l->refresh_pending) {
+        refresh_line_with_flags(l, REFRESH_ALL);
+        l->refresh_pending = false;
+    }
+
+    clear_menu(l);
+    line_close_gap(l);
+
+    ComlinStatus const st = disable_raw_mode(l);
+
+    return st ? st : write_string(l->ofd, "\n", 1);
+}
+
+char const*
+comlin_text(ComlinState const* const l)
+{
+    return l->buf.data;
+}
+
+ComlinStatus
+comlin_read_line(ComlinState* const state, char const* const prompt)
+{
+    ComlinStatus st0 = comlin_edit_start(state, prompt);
+    ComlinStatus st1 = COMLIN_SUCCESS;
+    if (!st0) {
+        do {
+            st0 = comlin_edit_feed(state);
+        } while (st0 == COMLIN_EDITING);
+
+        st1 = comlin_edit_stop(state);
+    }
+    return st0 ? st0 : st1;
+}
+
+/* History */
+
+// The magic string at the start of a binary history file
+static char const history_magic[8] = {'C', 'O', 'M', 'L', 'I', 'N', 'H', '\0'};
+
+static uint32_t const history_version = 1U;
+
+// Size of the binary history file header
+static size_t const history_header_size = 24U;
+
+// Flag for a binary history file with metadata columns
+static uint32_t const history_has_metadata = 1U << 0U;
+
+// Flag for a binary history file with a frecency column after the metadata
+static uint32_t const history_has_scores = 1U << 1U;
+
+// Time it takes for an unused entry's frecency to halve, in seconds
+static int64_t const frecency_half_life = 7 * 24 * 60 * 60;
+
+// Frecency score of a single use, in thousandths
+static uint32_t const frecency_unit = 1000U;
+
+static uint32_t
+decode_u32(char const* const bytes)
+{
+    unsigned char const* const b = (unsigned char const*)bytes;
+
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8U) | ((uint32_t)b[2] << 16U) |
+           ((uint32_t)b[3] << 24U);
+}
+
+static uint64_t
+decode_u64(char const* const bytes)
+{
+    return (uint64_t)decode_u32(bytes) |
+           ((uint64_t)decode_u32(bytes + 4U) << 32U);
+}
+
+static void
+encode_u32(char* const bytes, uint32_t const value)
+{
+    for (unsigned i = 0U; i < 4U; ++i) {
+        bytes[i] = (char)((value >> (8U * i)) & 0xFFU);
+    }
+}
+
+static void
+encode_u64(char* const bytes, uint64_t const value)
+{
+    encode_u32(bytes, (uint32_t)(value & 0xFFFFFFFFU));
+    encode_u32(bytes + 4U, (uint32_t)(value >> 32U));
+}
+
+// Return the number of entries in a mapped binary history file
+static size_t
+history_file_count(HistoryFile const* const file)
+{
+    return (size_t)decode_u64(file->data + 16U);
+}
+
+// Return true if a mapped binary history file has metadata
+static bool
+history_file_has_metadata(HistoryFile const* const file)
+{
+    return decode_u32(file->data + 12U) & history_has_metadata;
+}
+
+// Return true if a mapped binary history file has frecency scores
+static bool
+history_file_has_scores(HistoryFile const* const file)
+{
+    uint32_t const flags = decode_u32(file->data + 12U);
+
+    return (flags & history_has_metadata) && (flags & history_has_scores);
+}
+
+// Read the metadata for an entry in a mapped binary history file
+static void
+history_file_metadata(HistoryFile const* const file,
+                      size_t const index,
+                      ComlinHistoryMetadata* const metadata,
+                      uint32_t* const score)
+{
+    size_t const count = history_file_count(file);
+    char const* const times = file->data + history_header_size + (8U * count);
+    char const* const durations = times + (8U * count);
+    char const* const statuses = durations + (4U * count);
+    char const* const scores = statuses + (4U * count);
+
+    metadata->time = (int64_t)decode_u64(times + (8U * index));
+    metadata->duration = decode_u32(durations + (4U * index));
+    metadata->status = (int32_t)decode_u32(statuses + (4U * index));
+    *score = history_file_has_scores(file) ? decode_u32(scores + (4U * index))
+                                           : frecency_unit;
+}
+
+/* Text of entries in a history file that was truncated since it was mapped.
+ *
+ * Reading past the end of a mapped file raises SIGBUS.  This doesn't happen
+ * when comlin saves history from a state that has the file mapped, which
+ * replaces the file, but another program may rewrite it in place.  The size
+ * of the file is checked when it is loaded, and again before editing a line,
+ * changing the history, or walking over all of it, rather than before every
+ * read, so returning a single entry to the application stays cheap.  This
+ * only narrows the window, since the file can still be truncated in between.
+ */
+static char history_file_gone[] = "";
+
+// Check once whether a mapped file was truncated so reading it would fault
+static void
+history_file_check(HistoryFile const* const file)
+{
+    struct stat st;
+    if (file->data && !*file->truncated &&
+        (fstat(file->fd, &st) || st.st_size < (off_t)file->size)) {
+        *file->truncated = true;
+    }
+}
+
+// Return the offset of an entry in a mapped binary history file
+static uint64_t
+history_file_offset(HistoryFile const* const file, size_t const index)
+{
+    return decode_u64(file->data + history_header_size + (8U * index));
+}
+
+/* Decode the entry at an offset in a mapped binary history file.
+ *
+ * This only reads the length prefix, the text itself is used in place.  A
+ * corrupt entry is treated as an empty string.
+ */
+static char*
+history_file_record(HistoryFile const* const file, uint64_t const offset)
+{
+    char* const empty = file->data + file->size - 1U;
+    if (offset < history_header_size || offset > file->size - 5U) {
+        return empty;
+    }
+
+    size_t const start = (size_t)offset + 4U;
+    uint32_t const length = decode_u32(file->data + offset);
+    if (length > file->size - start - 1U || file->data[start + length]) {
+        return empty;
+    }
+
+    return file->data + start;
+}
+
+// Decode an entry from a mapped binary history file by its index
+static char*
+history_file_entry(HistoryFile const* const file, size_t const index)
+{
+    return history_file_record(file, history_file_offset(file, index));
+}
+
+// Map a binary history file if it has a valid header
+static ComlinStatus
+history_file_map(HistoryFile* const file, int const fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t)history_header_size) {
+        return COMLIN_BAD_READ;
+    }
+
+    size_t const size = (size_t)st.st_size;
+    void* const data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return COMLIN_BAD_READ;
+    }
+
+    // Check that the header and offset table are sane
+    char* const bytes = (char*)data;
+    uint64_t const count = decode_u64(bytes + 16U);
+    uint32_t const flags = decode_u32(bytes + 12U);
+    bool const has_metadata = flags & history_has_metadata;
+    bool const has_scores = has_metadata && (flags & history_has_scores);
+    uint64_t const max_count = (size - history_header_size) /
+                               (has_scores ? 33U : has_metadata ? 29U : 13U);
+    if (memcmp(bytes, history_magic, sizeof(history_magic)) ||
+        decode_u32(bytes + 8U) != history_version || count > max_count ||
+        (count && bytes[size - 1U])) {
+        munmap(data, size);
+        return COMLIN_BAD_READ;
+    }
+
+    file->data = bytes;
+    file->size = size;
+    file->first = 0U;
+    file->lazy_len = 0U;
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    file->truncated = (bool*)calloc(1U, sizeof(bool));
+    if (!file->truncated) {
+        munmap(data, size);
+        file->data = NULL;
+        return COMLIN_NO_MEMORY;
+    }
+
+    file->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (file->fd < 0) {
+        munmap(data, size);
+        free(file->truncated);
+        file->data = NULL;
+        file->truncated = NULL;
+        return COMLIN_BAD_READ;
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+static void
+history_file_unmap(HistoryFile* const file)
+{
+    if (file->data) {
+        munmap(file->data, file->size);
+        close(file->fd);
+        free(file->offsets);
+        free(file->truncated);
+        file->fd = -1;
+        file->data = NULL;
+        file->size = 0U;
+        file->lazy_len = 0U;
+        file->offsets = NULL;
+        file->truncated = NULL;
+    }
+}
+
+// Return the text of a history entry, decoding it if necessary
+static char const*
+history_get(ComlinState const* const state, size_t const index)
+{
+    char const* const entry = state->history[index];
+    if (entry) {
+        return entry;
+    }
+
+    HistoryFile const* const file = &state->history_file;
+    assert(index < file->lazy_len);
+    if (*file->truncated) {
+        return history_file_gone;
+    }
+
+    return file->offsets ? history_file_record(file, file->offsets[index])
+                         : history_file_entry(file, file->first + index);
+}
+
+// Free a history entry unless it is null or points into the history file
+static void
+history_free_entry(ComlinState const* const state, char* const entry)
+{
+    HistoryFile const* const file = &state->history_file;
+
+    if (entry != history_file_gone &&
+        (!file->data || entry < file->data ||
+         entry >= file->data + file->size)) {
+        free(entry);
+    }
+}
+
+// Return the size of a history entry including the null terminator
+static size_t
+history_size(ComlinState const* const state, size_t const index)
+{
+    size_t const size = state->history_sizes[index];
+    if (size) {
+        return size;
+    }
+
+    // Only entries from the file have no size, so read its length prefix
+    HistoryFile const* const file = &state->history_file;
+    char const* const entry = history_get(state, index);
+    if (entry == history_file_gone) {
+        return 1U;
+    }
+
+    assert(entry > file->data && entry < file->data + file->size);
+    return (entry == file->data + file->size - 1U)
+             ? 1U
+             : (size_t)decode_u32(entry - 4U) + 1U;
+}
+
+// Allocate the arrays of history entries if necessary
+static ComlinStatus
+history_reserve(ComlinState* const state)
+{
+    size_t const n = state->history_max_len;
+    if (!state->history) {
+        state->history = (char**)calloc(n, sizeof(char*));
+        state->history_sizes = (size_t*)calloc(n, sizeof(size_t));
+        state->history_seqs = (uint64_t*)calloc(n, sizeof(uint64_t));
+        if (!state->history || !state->history_sizes || !state->history_seqs) {
+            free(state->history_seqs);
+            free(state->history_sizes);
+            free(state->history);
+            state->history_seqs = NULL;
+            state->history_sizes = NULL;
+            state->history = NULL;
+            return COMLIN_NO_MEMORY;
+        }
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+// Allocate the arrays of history metadata if necessary
+static ComlinStatus
+history_reserve_metadata(ComlinState* const state)
+{
+    size_t const n = state->history_max_len;
+    if (!state->history_times) {
+        state->history_times = (int64_t*)calloc(n, sizeof(int64_t));
+        state->history_durations = (uint32_t*)calloc(n, sizeof(uint32_t));
+        state->history_statuses = (int32_t*)calloc(n, sizeof(int32_t));
+        if (!state->history_times || !state->history_durations ||
+            !state->history_statuses) {
+            free(state->history_statuses);
+            free(state->history_durations);
+            free(state->history_times);
+            state->history_statuses = NULL;
+            state->history_durations = NULL;
+            state->history_times = NULL;
+            return COMLIN_NO_MEMORY;
+        }
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+// Allocate the array of frecency scores if necessary
+static ComlinStatus
+history_reserve_scores(ComlinState* const state)
+{
+    if (!state->history_scores) {
+        size_t const n = state->history_max_len;
+        state->history_scores = (uint32_t*)calloc(n, sizeof(uint32_t));
+        if (!state->history_scores) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        // Count every existing entry as a single use
+        for (size_t i = 0U; i < state->history_len; ++i) {
+            state->history_scores[i] = frecency_unit;
+        }
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+// Return 2^-x, with a relative error of less than 0.02%
+static double
+exp2_neg(double const x)
+{
+    if (!(x > 0)) {
+        return 1;
+    }
+
+    if (x >= 64) {
+        return 0;
+    }
+
+    // Split into an exact power of two and a Taylor series for the fraction
+    unsigned const whole = (unsigned)x;
+    double const t = (x - (double)whole) * (double)0.6931471805599453L;
+    double fraction = 1;
+    for (unsigned k = 6U; --k > 0U;) {
+        fraction = 1 - ((t / (double)k) * fraction);
+    }
+
+    return fraction / (double)(UINT64_C(1) << whole);
+}
+
+// Return the frecency of an entry at a given time, decayed since it was used
+static double
+history_frecency(ComlinState const* const state,
+                 size_t const index,
+                 int64_t const now)
+{
+    if (!state->history_scores) {
+        return 0;
+    }
+
+    double const elapsed = (double)(now - state->history_times[index]);
+
+    return (state->history_scores[index] / (double)frecency_unit) *
+           exp2_neg(elapsed / (double)frecency_half_life);
+}
+
+/* Eviction heap
+ *
+ * With the largest-first eviction policy, entries are kept in a binary heap
+ * ordered by size, then age.  Heap items refer to entries by an ID that
+ * increases with index, so they don't need to be updated when an earlier
+ * entry is removed, and the index of an ID is found by binary search.  The
+ * slot of each entry's item is kept in a column like other entry data, so
+ * any entry can be removed from the heap in O(log n) sift steps.
+ */
+
+// Return true if an entry should be evicted before another
+static bool
+evict_before(EvictionItem const a, EvictionItem const b)
+{
+    return a.size > b.size || (a.size == b.size && a.id < b.id);
+}
+
+// Return the index of the entry with an eviction ID
+static size_t
+history_id_index(ComlinState const* const state, uint64_t const id)
+{
+    size_t lo = 0U;
+    size_t hi = state->history_len;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        if (state->eviction_ids[mid] < id) {
+            lo = mid + 1U;
+        } else {
+            hi = mid;
+        }
+    }
+
+    assert(lo < state->history_len && state->eviction_ids[lo] == id);
+    return lo;
+}
+
+// Put an item into a slot in the eviction heap
+static void
+evict_place(ComlinState* const state,
+            size_t const slot,
+            EvictionItem const item)
+{
+    state->evictions[slot] = item;
+    state->eviction_slots[history_id_index(state, item.id)] = slot;
+}
+
+// Move an item in the eviction heap up or down to its place
+static void
+evict_sift(ComlinState* const state, size_t i)
+{
+    EvictionItem* const heap = state->evictions;
+    size_t const n = state->n_evictions;
+    EvictionItem const item = heap[i];
+    while (i && evict_before(item, heap[(i - 1U) / 2U])) {
+        evict_place(state, i, heap[(i - 1U) / 2U]);
+        i = (i - 1U) / 2U;
+    }
+
+    for (size_t c = (2U * i) + 1U; c < n; c = (2U * i) + 1U) {
+        if (c + 1U < n && evict_before(heap[c + 1U], heap[c])) {
+            ++c;
+        }
+
+        if (!evict_before(heap[c], item)) {
+            break;
+        }
+
+        evict_place(state, i, heap[c]);
+        i = c;
+    }
+
+    evict_place(state, i, item);
+}
+
+// Free the heap of entries by size if there is one
+static void
+history_unindex_sizes(ComlinState* const state)
+{
+    free(state->evictions);
+    free(state->eviction_ids);
+    free(state->eviction_slots);
+    state->evictions = NULL;
+    state->eviction_ids = NULL;
+    state->eviction_slots = NULL;
+    state->n_evictions = 0U;
+}
+
+// Build the heap of entries by size if it doesn't exist yet
+static ComlinStatus
+history_index_sizes(ComlinState* const state)
+{
+    if (!state->evictions) {
+        size_t const max = state->history_max_len;
+        state->evictions = (EvictionItem*)calloc(max, sizeof(EvictionItem));
+        state->eviction_ids = (uint64_t*)calloc(max, sizeof(uint64_t));
+        state->eviction_slots = (size_t*)calloc(max, sizeof(size_t));
+        if (!state->evictions || !state->eviction_ids ||
+            !state->eviction_slots) {
+            history_unindex_sizes(state);
+            return COMLIN_NO_MEMORY;
+        }
+
+        size_t const n = state->history_len;
+        for (size_t i = 0U; i < n; ++i) {
+            EvictionItem const item = {history_size(state, i),
+                                       ++state->eviction_id};
+            state->evictions[i] = item;
+            state->eviction_ids[i] = item.id;
+            state->eviction_slots[i] = i;
+        }
+
+        state->n_evictions = n;
+        for (size_t i = n / 2U; i-- > 0U;) {
+            evict_sift(state, i);
+        }
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+// Add the last entry to the heap of entries by size, if there is one
+static void
+history_index_size(ComlinState* const state)
+{
+    if (state->evictions) {
+        size_t const i = state->history_len - 1U;
+        EvictionItem const item = {history_size(state, i),
+                                   ++state->eviction_id};
+        state->eviction_ids[i] = item.id;
+        state->evictions[state->n_evictions++] = item;
+        evict_sift(state, state->n_evictions - 1U);
+    }
+}
+
+// Remove an entry from the heap of entries by size, if there is one
+static void
+history_unindex_size(ComlinState* const state, size_t const index)
+{
+    if (state->evictions) {
+        // Replace its item with the last, then move that to its place
+        size_t const slot = state->eviction_slots[index];
+        EvictionItem const last = state->evictions[--state->n_evictions];
+        if (slot < state->n_evictions) {
+            state->evictions[slot] = last;
+            evict_sift(state, slot);
+        }
+
+        // Remove the entry's columns so later entries line up
+        size_t const tail = state->history_len - index - 1U;
+        memmove(state->eviction_ids + index,
+                state->eviction_ids + index + 1U,
+                sizeof(uint64_t) * tail);
+        memmove(state->eviction_slots + index,
+                state->eviction_slots + index + 1U,
+                sizeof(size_t) * tail);
+    }
+}
+
+// Remove an entry from the history
+static void
+history_remove(ComlinState* const state, size_t const index)
+{
+    HistoryFile* const file = &state->history_file;
+    size_t const tail = state->history_len - index - 1U;
+
+    state->history_bytes -= history_size(state, index);
+    if (state->prefixes || state->words) {
+        char const* const text = history_get(state, index);
+        size_t const len = history_size(state, index) - 1U;
+        if (state->prefixes) {
+            prefix_index_remove(state->prefixes, text, len);
+        }
+
+        if (state->words) {
+            for (size_t pos = 0U, n = 0U; (n = token_next(text, len, &pos));
+                 pos += n) {
+                prefix_index_remove(state->words, text + pos, n);
+            }
+        }
+    }
+
+    history_free_entry(state, state->history[index]);
+
+    if (index < file->lazy_len) {
+        if (index == 0U && !file->offsets) {
+            // Shift the window of entries that are backed by the file
+            --file->lazy_len;
+            ++file->first;
+        } else {
+            /* Copy the offsets of the window so later entries can be shifted.
+             * This is only needed once an entry other than the oldest is
+             * removed, and costs 8 bytes per lazy entry, which is bounded by
+             * the maximum history length and small next to the entries. */
+            bool const gone = *file->truncated;
+            if (!file->offsets &&
+                (file->offsets =
+                   (uint64_t*)calloc(file->lazy_len, sizeof(uint64_t)))) {
+                for (size_t j = 0U; !gone && j < file->lazy_len; ++j) {
+                    size_t const k = file->first + j;
+                    file->offsets[j] = history_file_offset(file, k);
+                }
+            }
+
+            if (file->offsets) {
+                memmove(file->offsets + index,
+                        file->offsets + index + 1U,
+                        sizeof(uint64_t) * (file->lazy_len - index - 1U));
+                --file->lazy_len;
+            } else {
+                // Resolve any later entries that will no longer line up
+                for (size_t j = index + 1U; j < file->lazy_len; ++j) {
+                    if (!state->history[j]) {
+                        state->history[j] =
+                          gone ? history_file_gone
+                               : history_file_entry(file, file->first + j);
+                    }
+                }
+
+                file->lazy_len = index;
+            }
+        }
+    }
+
+    history_unindex_size(state, index);
+
+    memmove(state->history + index,
+            state->history + index + 1U,
+            sizeof(char*) * tail);
+    memmove(state->history_sizes + index,
+            state->history_sizes + index + 1U,
+            sizeof(size_t) * tail);
+    memmove(state->history_seqs + index,
+            state->history_seqs + index + 1U,
+            sizeof(uint64_t) * tail);
+
+    if (state->history_times) {
+        memmove(state->history_times + index,
+                state->history_times + index + 1U,
+                sizeof(int64_t) * tail);
+        memmove(state->history_durations + index,
+                state->history_durations + index + 1U,
+                sizeof(uint32_t) * tail);
+        memmove(state->history_statuses + index,
+                state->history_statuses + index + 1U,
+                sizeof(int32_t) * tail);
+    }
+
+    if (state->history_scores) {
+        memmove(state->history_scores + index,
+                state->history_scores + index + 1U,
+                sizeof(uint32_t) * tail);
+    }
+
+    --state->history_len;
+}
+
+// Build the index of entries by prefix if it doesn't exist yet
+static ComlinStatus
+history_index_prefixes(ComlinState* const state)
+{
+    if (!state->prefixes) {
+        if (!(state->prefixes = prefix_index_new())) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        for (size_t i = 0U; i < state->history_len; ++i) {
+            size_t const len = history_size(state, i) - 1U;
+            state->history_seqs[i] = ++state->history_seq;
+            if (len && !prefix_index_insert(state->prefixes,
+                                            history_get(state, i),
+                                            len,
+                                            state->history_seqs[i])) {
+                prefix_index_free(state->prefixes);
+                state->prefixes = NULL;
+                return COMLIN_NO_MEMORY;
+            }
+        }
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+// Insert every token in some text into an index
+static bool
+index_tokens(PrefixIndex* const index,
+             char const* const text,
+             size_t const len,
+             uint64_t const seq)
+{
+    for (size_t pos = 0U, n = 0U; (n = token_next(text, len, &pos)); pos += n) {
+        if (!prefix_index_insert(index, text + pos, n, seq)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Build the index of entry tokens by prefix if it doesn't exist yet
+static ComlinStatus
+history_index_words(ComlinState* const state)
+{
+    if (!state->words) {
+        if (!(state->words = prefix_index_new())) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        for (size_t i = 0U; i < state->history_len; ++i) {
+            if (!index_tokens(state->words,
+                              history_get(state, i),
+                              history_size(state, i) - 1U,
+                              ++state->history_seq)) {
+                prefix_index_free(state->words);
+                state->words = NULL;
+                return COMLIN_NO_MEMORY;
+            }
+        }
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+// Return the index of the next entry to remove to get under the byte budget
+static size_t
+history_victim(ComlinState* const state)
+{
+    if (state->history_policy != COMLIN_EVICT_LARGEST ||
+        history_index_sizes(state)) {
+        return 0U;
+    }
+
+    // Take the top of the heap, or its largest child if that's the newest
+    EvictionItem const* const heap = state->evictions;
+    size_t const n = state->n_evictions;
+    size_t i = 0U;
+    if (heap[0].id == state->eviction_ids[state->history_len - 1U]) {
+        i = (n > 2U && evict_before(heap[2], heap[1])) ? 2U : 1U;
+    }
+
+    return history_id_index(state, heap[i].id);
+}
+
+// Remove entries until the history is within its byte budget
+static void
+history_enforce_budget(ComlinState* const state)
+{
+    // Never remove the newest entry, which may be the line being edited
+    while (state->history_max_bytes && state->history_len > 1U &&
+           state->history_bytes > state->history_max_bytes) {
+        history_remove(state, history_victim(state));
+    }
+}
+
+size_t
+comlin_history_count(ComlinState const* const state)
+{
+    return state->history_len;
+}
+
+char const*
+comlin_history_entry(ComlinState const* const state,
+                     size_t const index,
+                     size_t* const length)
+{
+    if (index >= state->history_len) {
+        return NULL;
+    }
+
+    if (length) {
+        *length = history_size(state, index) - 1U;
+    }
+
+    return history_get(state, index);
+}
+
+ComlinStatus
+comlin_history_visit(ComlinState const* const state,
+                     size_t const begin,
+                     size_t const end,
+                     ComlinHistoryDirection const direction,
+                     ComlinHistoryVisitor* const visitor,
+                     void* const data)
+{
+    size_t const last = end < state->history_len ? end : state->history_len;
+    ComlinStatus st = COMLIN_SUCCESS;
+
+    history_file_check(&state->history_file);
+
+    for (size_t i = begin; !st && i < last; ++i) {
+        size_t const j =
+          (direction == COMLIN_HISTORY_PREV) ? (last - 1U - (i - begin)) : i;
+
+        char const* const text = history_get(state, j);
+        st = visitor(data, j, text, history_size(state, j) - 1U);
+    }
+
+    return st;
+}
+
+ComlinStatus
+comlin_history_set_limits(ComlinState* const state,
+                          size_t const max_bytes,
+                          size_t const max_entry_size,
+                          ComlinEvictionPolicy const policy)
+{
+    state->history_max_bytes = max_bytes;
+    state->history_max_entry = max_entry_size;
+    state->history_policy = policy;
+    history_file_check(&state->history_file);
+    if (policy != COMLIN_EVICT_LARGEST) {
+        history_unindex_sizes(state);
+    }
+
+    history_enforce_budget(state);
+    return COMLIN_SUCCESS;
+}
+
+/* Uses a fixed array of char pointers that are shifted (memmoved)
+ * when the history max length is reached in order to remove the older
+ * entry and make room for the new one, so it is not exactly suitable for huge
+ * histories, but will work well for a few hundred of entries.
+ *
+ * Using a circular buffer is smarter, but a bit more complex to handle. */
+static ComlinStatus
+history_push(ComlinState* const state,
+             char const* const line,
+             ComlinHistoryMetadata const* const metadata,
+             uint32_t const* const score)
+{
+    if (state->history_max_len == 0) {
+        return COMLIN_SUCCESS;
+    }
+
+    // Initialization on first call
+    if (history_reserve(state)) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    // Don't add duplicated lines
+    if (state->history_len &&
+        !strcmp(history_get(state, state->history_len - 1U), line)) {
+        return COMLIN_SUCCESS;
+    }
+
+    // Don't add lines that are too large
+    size_t const size = strlen(line) + 1U;
+    if (state->history_max_entry && size > state->history_max_entry) {
+        return COMLIN_SUCCESS;
+    }
+
+    // Add an heap allocated copy of the line in the history
+    char* const linecopy = (char*)malloc(size);
+    if (!linecopy) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    // If we reached the max length, remove the older line
+    if (state->history_len == state->history_max_len) {
+        history_remove(state, 0U);
+    }
+
+    memcpy(linecopy, line, size);
+    state->history[state->history_len] = linecopy;
+    state->history_sizes[state->history_len] = size;
+    state->history_bytes += size;
+
+    // Update indices if necessary, or drop them to be rebuilt later
+    uint64_t const seq = ++state->history_seq;
+    state->history_seqs[state->history_len] = seq;
+    if (state->prefixes && size > 1U &&
+        !prefix_index_insert(state->prefixes, linecopy, size - 1U, seq)) {
+        prefix_index_free(state->prefixes);
+        state->prefixes = NULL;
+    }
+
+    if (state->words && !index_tokens(state->words, linecopy, size - 1U, seq)) {
+        prefix_index_free(state->words);
+        state->words = NULL;
+    }
+
+    // Set metadata if necessary, if it can't be allocated then it's dropped
+    if ((metadata || state->history_times) &&
+        !history_reserve_metadata(state)) {
+        size_t const i = state->history_len;
+        state->history_times[i] = metadata ? metadata->time : 0;
+        state->history_durations[i] = metadata ? metadata->duration : 0U;
+        state->history_statuses[i] = metadata ? metadata->status : 0;
+    }
+
+    // Set the frecency score if necessary, which requires a time
+    if (state->history_times && (score || state->history_scores) &&
+        !history_reserve_scores(state)) {
+        state->history_scores[state->history_len] =
+          score ? *score : frecency_unit;
+    }
+
+    ++state->history_len;
+    history_index_size(state);
+    history_enforce_budget(state);
+    return COMLIN_SUCCESS;
+}
+
+// Return the index of the entry with a sequence number, or the history length
+static size_t
+history_seq_index(ComlinState const* const state, uint64_t const seq)
+{
+    // Sequence numbers never decrease with index, so the first match is used
+    size_t lo = 0U;
+    size_t hi = state->history_len;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        if (state->history_seqs[mid] < seq) {
+            lo = mid + 1U;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return (lo < state->history_len && state->history_seqs[lo] == seq)
+             ? lo
+             : state->history_len;
+}
+
+/* Find the newest entry that is equal to a line with the prefix index.
+ *
+ * This sets `index` to the index of the entry, or the history length if there
+ * is none, without reading any other entries.
+ */
+static ComlinStatus
+history_find(ComlinState* const state,
+             char const* const line,
+             size_t* const index)
+{
+    size_t const len = strlen(line);
+    for (unsigned tries = 0U; tries < 2U; ++tries) {
+        if (history_index_prefixes(state)) {
+            return COMLIN_NO_MEMORY;
+        }
+
+        uint64_t const seq = prefix_index_find(state->prefixes, line, len);
+        *index = seq ? history_seq_index(state, seq) : state->history_len;
+        if (!seq || *index < state->history_len) {
+            return COMLIN_SUCCESS;
+        }
+
+        /* The entry's sequence number is stale because a newer duplicate was
+         * removed, so rebuild the index to number every entry. */
+        prefix_index_free(state->prefixes);
+        state->prefixes = NULL;
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+ComlinStatus
+comlin_history_add(ComlinState* const state, char const* const line)
+{
+    history_file_check(&state->history_file);
+    if (!state->metamode) {
+        return history_push(state, line, NULL, NULL);
+    }
+
+    // Use the metadata from the last edit if this is the line that was entered
+    ComlinHistoryMetadata metadata = state->entered;
+    if (!metadata.time || strcmp(line, comlin_text(state))) {
+        metadata.time = (int64_t)time(NULL);
+        metadata.duration = 0U;
+    }
+
+    state->entered.time = 0;
+    if (!state->frecmode || !*line) {
+        return history_push(state, line, &metadata, NULL);
+    }
+
+    if (state->history_max_len &&
+        (history_reserve_metadata(state) || history_reserve_scores(state))) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    // Merge with the most recent previous use of this line, if any
+    double frecency = 1;
+    size_t i = state->history_len;
+    if (history_find(state, line, &i)) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    if (i < state->history_len) {
+        frecency += history_frecency(state, i, metadata.time);
+        history_remove(state, i);
+    }
+
+    double const scaled = (frecency * frecency_unit) + (double)0.5L;
+    uint32_t const score =
+      scaled < (double)UINT32_MAX ? (uint32_t)scaled : UINT32_MAX;
+
+    return history_push(state, line, &metadata, &score);
+}
+
+double
+comlin_history_frecency(ComlinState const* const state,
+                        size_t const index,
+                        int64_t const now)
+{
+    return index < state->history_len ? history_frecency(state, index, now)
+                                      : 0;
+}
+
+ComlinStatus
+comlin_history_metadata(ComlinState const* const state,
+                        size_t const index,
+                        ComlinHistoryMetadata* const metadata)
+{
+    memset(metadata, 0, sizeof(ComlinHistoryMetadata));
+    if (index >= state->history_len) {
+        return COMLIN_BAD_ARG;
+    }
+
+    if (state->history_times) {
+        metadata->time = state->history_times[index];
+        metadata->duration = state->history_durations[index];
+        metadata->status = state->history_statuses[index];
+    }
+
+    return COMLIN_SUCCESS;
+}
+
+ComlinStatus
+comlin_history_set_status(ComlinState* const state,
+                          size_t const index,
+                          int32_t const status)
+{
+    if (index >= state->history_len) {
+        return COMLIN_BAD_ARG;
+    }
+
+    if (history_reserve_metadata(state)) {
+        return COMLIN_NO_MEMORY;
+    }
+
+    state->history_statuses[index] = status;
+    return COMLIN_SUCCESS;
+}
+
+ComlinStatus
+comlin_history_query(ComlinState const* const state,
+                     ComlinHistoryQuery const* const query,
+                     ComlinHistoryDirection const direction,
+                     ComlinHistoryVisitor* const visitor,
+                     void* const data)
+{
+    if (!state->history_times) {
+        return COMLIN_SUCCESS;
+    }
+
+    history_file_check(&state->history_file);
+    int64_t const since = query->since;
+    int64_t const until = query->until ? query->until : INT64_MAX;
+    size_t const n = state->history_len;
+    ComlinStatus st = COMLIN_SUCCESS;
+    for (size_t i = 0U; !st && i < n; ++i) {
+        size_t const j = (direction == COMLIN_HISTORY_PREV) ? (n - 1U - i) : i;
+        int64_t const time = state->history_times[j];
+        int32_t const status = state->history_statuses[j];
+        if (time >= since && time < until &&
+            (query->match == COMLIN_STATUS_ANY ||
+             ((query->match == COMLIN_STATUS_EQUAL) ==
+              (status == query->status)))) {
+            char const* const text = history_get(state, j);
+            st = visitor(data, j, text, history_size(state, j) - 1U);
+        }
+    }
+
+    return st;
+}
+
+// Append a signed decimal integer to a buffer
+static void
+buf_append_int(StringBuf* const buf, int64_t const x)
+{
+    char digits[24] = {'-', 0};
+    size_t const neg = x < 0 ? 1U : 0U;
+    uint64_t const mag = neg ? (0U - (uint64_t)x) : (uint64_t)x;
+
+    buf_append(buf, digits, neg + format_size(digits + neg, (size_t)mag));
+}
+
+/* Parse a metadata prefix and return its length.
+ *
+ * The prefix looks like `: TIME:DURATION:STATUS;` or, with a frecency score,
+ * `: TIME:DURATION:STATUS:SCORE;`.  The score is set to zero if absent.  If
+ * any field is out of range, then there is no prefix and the line is text.
+ */
+static size_t
+parse_metadata(char const* const line,
+               ComlinHistoryMetadata* const metadata,
+               uint32_t* const score)
+{
+    if (line[0] != ':' || line[1] != ' ') {
+        return 0U;
+    }
+
+    // Parse 3 or more colon-separated integers, ignoring any extra fields
+    int64_t fields[4] = {0, 0, 0, 0};
+    size_t i = 2U;
+    for (unsigned f = 0U;; ++f) {
+        bool const neg = line[i] == '-';
+        i += neg;
+        if (line[i] < '0' || line[i] > '9') {
+            return 0U;
+        }
+
+        // Parse the magnitude, rejecting any that doesn't fit in an int64_t
+        uint64_t value = 0U;
+        while (line[i] >= '0' && line[i] <= '9') {
+            uint64_t const digit = (uint64_t)(line[i++] - '0');
+            if (value > ((uint64_t)INT64_MAX - digit) / 10U) {
+                return 0U;
+            }
+
+            value = (value * 10U) + digit;
+        }
+
+        if (f < 4U) {
+            fields[f] = neg ? -(int64_t)value : (int64_t)value;
+        }
+
+        if (line[i] == ';' && f >= 2U) {
+            // Reject any field that doesn't fit in its type
+            if (fields[1] < 0 || fields[1] > (int64_t)UINT32_MAX ||
+                fields[2] < (int64_t)INT32_MIN ||
+                fields[2] > (int64_t)INT32_MAX || fields[3] < 0 ||
+                fields[3] > (int64_t)UINT32_MAX) {
+                return 0U;
+            }
+
+            metadata->time = fields[0];
+            metadata->duration = (uint32_t)fields[1];
+            metadata->status = (int32_t)fields[2];
+            *score = (uint32_t)fields[3];
+            return i + 1U;
+        }
+
+        if (line[i++] != ':') {
+            return 0U;
+        }
+    }
+}
+
+// The first line of a text history file with metadata
+static char const history_metadata_marker[] = "#comlin-metadata";
+
+static ComlinStatus
+history_write_text(ComlinState const* const state, int const fd)
+{
+    ComlinStatus st = COMLIN_SUCCESS;
+    StringBuf out = {NULL, 0U, 0U};
+    if (state->history_times) {
+        buf_append(
+          &out, history_metadata_marker, sizeof(history_metadata_marker) - 1U);
+        buf_append(&out, "\n", 1U);
+    }
+
+    for (size_t j = 0U; !st && j < state->history_len; ++j) {
+        char const* const entry = history_get(state, j);
+        size_t const len = history_size(state, j) - 1U;
+        if (len) {
+            if (state->history_times) {
+                buf_append(&out, ": ", 2U);
+                buf_append_int(&out, state->history_times[j]);
+                buf_append(&out, ":", 1U);
+                buf_append_int(&out, state->history_durations[j]);
+                buf_append(&out, ":", 1U);
+                buf_append_int(&out, state->history_statuses[j]);
+                if (state->history_scores) {
+                    buf_append(&out, ":", 1U);
+                    buf_append_int(&out, state->history_scores[j]);
+                }
+                buf_append(&out, ";", 1U);
+            }
+
+            buf_append(&out, entry, len);
+            buf_append(&out, "\n", 1U);
+        }
+
+        if (out.length >= 65536U || j + 1U == state->history_len) {
+            st = write_string(fd, out.data, out.length);
+            out.length = 0U;
+        }
+    }
+
+    buf_free(&out);
+    return st;
+}
+
+static ComlinStatus
+history_write_binary(ComlinState const* const state, int const fd)
+{
+    // Count the non-empty entries that will be written
+    size_t count = 0U;
+    for (size_t j = 0U; j < state->history_len; ++j) {
+        count += !!*history_get(state, j);
+    }
+
+    // Write the header and offset table
+    bool const has_metadata = state->history_times;
+    bool const has_scores = has_metadata && state->history_scores;
+    uint32_t const flags = (has_metadata ? history_has_metadata : 0U) |
+                           (has_scores ? history_has_scores : 0U);
+
+    char header[24] = {0};
+    memcpy(header, history_magic, sizeof(history_magic));
+    encode_u32(header + 8U, history_version);
+    encode_u32(header + 12U, flags);
+    encode_u64(header + 16U, count);
+
+    StringBuf out = {NULL, 0U, 0U};
+    buf_append(&out, header, sizeof(header));
+
+    uint64_t const columns_size = has_scores     ? 28U
+                                  : has_metadata ? 24U
+                                                 : 8U;
+    uint64_t offset = history_header_size + (columns_size * count);
+    for (size_t j = 0U; j < state->history_len; ++j) {
+        char const* const entry = history_get(state, j);
+        if (*entry) {
+            char bytes[8] = {0};
+            encode_u64(bytes, offset);
+            buf_append(&out, bytes, sizeof(bytes));
+            offset += 4U + history_size(state, j);
+        }
+    }
+
+    // Write metadata columns
+    if (has_metadata) {
+        for (size_t j = 0U; j < state->history_len; ++j) {
+            if (*history_get(state, j)) {
+                char bytes[8] = {0};
+                encode_u64(bytes, (uint64_t)state->history_times[j]);
+                buf_append(&out, bytes, 8U);
+            }
+        }
+
+        for (size_t j = 0U; j < state->history_len; ++j) {
+            if (*history_get(state, j)) {
+                char bytes[4] = {0};
+                encode_u32(bytes, state->history_durations[j]);
+                buf_append(&out, bytes, 4U);
+            }
+        }
+
+        for (size_t j = 0U; j < state->history_len; ++j) {
+            if (*history_get(state, j)) {
+                char bytes[4] = {0};
+                encode_u32(bytes, (uint32_t)state->history_statuses[j]);
+                buf_append(&out, bytes, 4U);
+            }
+        }
+    }
+
+    if (has_scores) {
+        for (size_t j = 0U; j < state->history_len; ++j) {
+            if (*history_get(state, j)) {
+                char bytes[4] = {0};
+                encode_u32(bytes, state->history_scores[j]);
+                buf_append(&out, bytes, 4U);
+            }
+        }
+    }
+
+    // Write entries in large chunks
+    ComlinStatus st = COMLIN_SUCCESS;
+    for (size_t j = 0U; !st && j < state->history_len; ++j) {
+        char const* const entry = history_get(state, j);
+        size_t const len = history_size(state, j) - 1U;
+        if (len) {
+            char bytes[4] = {0};
+            encode_u32(bytes, (uint32_t)len);
+            buf_append(&out, bytes, sizeof(bytes));
+            buf_append(&out, entry, len + 1U);
+        }
+
+        if (out.length >= 65536U || j + 1U == state->history_len) {
+            st = write_string(fd, out.data, out.length);
+            out.length = 0U;
+        }
+    }
+
+    if (!st && out.length) {
+        st = write_string(fd, out.data, out.length);
+    }
+
+    buf_free(&out);
+    return st;
+}
+
+/* History index sidecar file.
+ *
+ * The prefix indices are saved next to the history file with an ".idx"
+ * suffix, so they don't need to be rebuilt from scratch at startup.  The file
+ * starts with a header (an 8-byte magic string, a 32-bit version, 32 bits of
+ * flags, then the 64-bit size, modification time in seconds, and inode number
+ * of the history file it was written for, the 64-bit number of indexed
+ * entries, the 64-bit sequence number of the newest index entry, the 64-bit
+ * nanoseconds of the modification time, and the 64-bit number of history
+ * entries including empty ones), followed by a 32-bit length, 64-bit hash,
+ * and 64-bit sequence number of each non-empty indexed entry, then the
+ * serialised indices.  All integers are little-endian.
+ *
+ * The entries are recorded so that an index can be brought up to date with a
+ * history file that has had entries appended by another program, and so that
+ * the entry for a sequence number in the index can be found after loading.
+ * Since their text isn't saved, an index that has entries which are no
+ * longer in the history is discarded, and rebuilt from the history instead.
+ *
+ * The sidecar is only written for the file that the history was loaded from,
+ * so exporting the history elsewhere doesn't leave index files behind.
+ */
+
+// The magic string at the start of an index sidecar file
+static char const index_magic[8] = {'C', 'O', 'M', 'L', 'I', 'N', 'I', '\0'};
+
+static uint32_t const index_version = 4U;
+
+// Size of the index sidecar file header
+static size_t const index_header_size = 72U;
+
+// Flag for an index sidecar with an index of entries by prefix
+static uint32_t const index_has_prefixes = 1U << 0U;
 
-static ComlinStatus
-comlin_edit_control(ComlinState* const state, char const c)
-{
-    typedef ComlinStatus (*ControlHandler)(ComlinState*);
+// Flag for an index sidecar with an index of entry tokens by prefix
+static uint32_t const index_has_words = 1U << 1U;
 
-    static ControlHandler const control_handlers[0x20U] = {
-      NULL,                             // ^@
-      comlin_edit_move_home,            // ^A
-      comlin_edit_move_left,            // ^B
-      comlin_edit_interrupt,            // ^C
-      comlin_edit_eof,                  // ^D
-      comlin_edit_move_end,             // ^E
-      comlin_edit_move_right,           // ^F
-      NULL,                             // ^G
-      comlin_edit_backspace,            // ^H
-      NULL,                             // ^I
-      comlin_edit_submit,               // ^J
-      comlin_edit_clear_line_forwards,  // ^K
-      comlin_edit_clear_screen,         // ^L
-      comlin_edit_submit,               // ^M
-      comlin_edit_history_next,         // ^N
-      NULL,                             // ^O
-      comlin_edit_history_prev,         // ^P
-      NULL,                             // ^Q
-      NULL,                             // ^R
-      NULL,                             // ^S
-      comlin_edit_transpose,            // ^T
-      comlin_edit_clear_line_backwards, // ^U
-      NULL,                             // ^V
-      comlin_edit_delete_prev_word,     // ^W
-      NULL,                             // ^X
-      NULL,                             // ^Y
-      NULL,                             // ^Z
-      comlin_edit_read_escape,          // ^[
-      NULL,                             // ^Backslash
-      NULL,                             // ^]
-      NULL,                             // ^^
-      NULL,                             // ^_
-    };
+// Size of the record of each indexed entry in an index sidecar file
+static size_t const index_entry_size = 20U;
 
-    ControlHandler const handler = control_handlers[(unsigned)c];
-    return handler ? handler(state) : COMLIN_EDITING;
+// Return the path of the index sidecar for a history file
+static StringBuf
+index_path(char const* const filename)
+{
+    StringBuf path = {NULL, 0U, 0U};
+    buf_append(&path, filename, strlen(filename));
+    buf_append(&path, ".idx", 4U);
+    return path;
 }
 
-ComlinStatus
-comlin_edit_feed(ComlinState* const l)
+// Return the 64-bit FNV-1a hash of some text
+static uint64_t
+index_hash(char const* const text, size_t const len)
 {
-    // Read the next character
-    char c = '\0';
-    ComlinStatus const st = read_char(l->ifd, &c);
-    if (st) {
-        return st;
+    uint64_t hash = UINT64_C(0xCBF29CE484222325);
+    for (size_t i = 0U; i < len; ++i) {
+        hash = (hash ^ (uint8_t)text[i]) * UINT64_C(0x100000001B3);
     }
 
-    if (l->dumb) {
-        return comlin_edit_read_dumb(l, c); // Fallback for dumb terminals
-    }
+    return hash;
+}
 
-    if ((l->in_completion || c == TAB) && l->completion_callback) {
-        // Try to autocomplete
-        c = complete_line(l, c);
-        if (c < 0) {
-            return COMLIN_BAD_READ;
-        }
-        if (c == 0) {
-            return COMLIN_EDITING;
-        }
+// Write a prefix index to a file
+static ComlinStatus
+write_prefix_index(int const fd, PrefixIndex const* const index)
+{
+    size_t const size = prefix_index_serialise(index, NULL, 0U);
+    char* const data = size ? (char*)malloc(size) : NULL;
+    if (!data || prefix_index_serialise(index, data, size) != size) {
+        free(data);
+        return COMLIN_NO_MEMORY;
     }
 
-    return (c < 0x20)   ? comlin_edit_control(l, c)
-           : (c == DEL) ? comlin_edit_backspace(l)
-                        : comlin_edit_insert(l, c);
+    ComlinStatus const st = write_string(fd, data, size);
+    free(data);
+    return st;
 }
 
+// Write the index sidecar for a history file that was just written
 static ComlinStatus
-comlin_edit_read_escape(ComlinState* const l)
+history_write_index(ComlinState const* const state, char const* const filename)
 {
-    // Read the next two bytes representing the escape sequence
-    char seq[4] = {'\0', '\0', '\0', '\0'};
-    if (read_char(l->ifd, &seq[0]) || read_char(l->ifd, &seq[1])) {
-        return COMLIN_BAD_READ;
+    struct stat st;
+    if (stat(filename, &st)) {
+        return COMLIN_NO_FILE;
     }
 
-    if (seq[0] == '[') { // ESC [ sequences
-        if (seq[1] >= '0' && seq[1] <= '9') {
-            // Extended escape, read additional byte
-            return read_char(l->ifd, &seq[2])         ? COMLIN_BAD_READ
-                   : (seq[1] == '3' && seq[2] == '~') ? comlin_edit_delete(l)
-                                                      : COMLIN_SUCCESS;
+    // Write the header, then the entries and patch in their count
+    uint32_t const flags = (state->prefixes ? index_has_prefixes : 0U) |
+                           (state->words ? index_has_words : 0U);
+
+    struct timespec const mtime = path_mtime(&st);
+    char header[72] = {0};
+    memcpy(header, index_magic, sizeof(index_magic));
+    encode_u32(header + 8U, index_version);
+    encode_u32(header + 12U, flags);
+    encode_u64(header + 16U, (uint64_t)st.st_size);
+    encode_u64(header + 24U, (uint64_t)mtime.tv_sec);
+    encode_u64(header + 32U, (uint64_t)st.st_ino);
+    encode_u64(header + 48U, state->history_seq);
+    encode_u64(header + 56U, (uint64_t)mtime.tv_nsec);
+    encode_u64(header + 64U, state->history_len);
+
+    StringBuf out = {NULL, 0U, 0U};
+    buf_append(&out, header, sizeof(header));
+
+    size_t count = 0U;
+    size_t expected = sizeof(header);
+    for (size_t j = 0U; j < state->history_len; ++j) {
+        size_t const len = history_size(state, j) - 1U;
+        if (len) {
+            char bytes[20] = {0};
+            encode_u32(bytes, (uint32_t)len);
+            encode_u64(bytes + 4U, index_hash(history_get(state, j), len));
+            encode_u64(bytes + 12U,
+                       state->prefixes ? state->history_seqs[j] : 0U);
+            buf_append(&out, bytes, sizeof(bytes));
+            expected += sizeof(bytes);
+            ++count;
         }
+    }
 
-        switch (seq[1]) {
-        case 'A': // Up
-            return comlin_edit_history_prev(l);
-        case 'B': // Down
-            return comlin_edit_history_next(l);
-        case 'C': // Right
-            return comlin_edit_move_right(l);
-        case 'D': // Left
-            return comlin_edit_move_left(l);
-        case 'H': // Home
-            return comlin_edit_move_home(l);
-        case 'F': // End
-            return comlin_edit_move_end(l);
-        default:
-            break;
+    if (out.length != expected) {
+        buf_free(&out);
+        return COMLIN_NO_MEMORY;
+    }
+
+    encode_u64(out.data + 40U, count);
+
+    // Write to a temporary file, then replace the old index
+    StringBuf path = index_path(filename);
+    StringBuf tmp = {NULL, 0U, 0U};
+    buf_append(&tmp, path.data ? path.data : "", path.length);
+    buf_append(&tmp, ".XXXXXX", 7U);
+
+    int const fd = (path.data && tmp.data) ? mkstemp(tmp.data) : -1;
+    ComlinStatus rc = (fd < 0) ? COMLIN_NO_FILE
+                               : write_string(fd, out.data, out.length);
+    if (!rc && state->prefixes) {
+        rc = write_prefix_index(fd, state->prefixes);
+    }
+
+    if (!rc && state->words) {
+        rc = write_prefix_index(fd, state->words);
+    }
+
+    if (fd >= 0) {
+        if ((close(fd) < 0 && !rc) || (!rc && rename(tmp.data, path.data))) {
+            rc = COMLIN_BAD_WRITE;
         }
 
-    } else if (seq[0] == 'O') { // ESC O sequence
-        switch (seq[1]) {
-        case 'H': // Home
-            return comlin_edit_move_home(l);
-        case 'F': // End
-            return comlin_edit_move_end(l);
-        default:
-            break;
+        if (rc) {
+            unlink(tmp.data);
         }
     }
 
-    return COMLIN_SUCCESS;
+    buf_free(&tmp);
+    buf_free(&path);
+    buf_free(&out);
+    return rc;
 }
 
 ComlinStatus
-comlin_edit_stop(ComlinState* const l)
+comlin_history_save(ComlinState const* const state, char const* const filename)
 {
-    ComlinStatus const st = disable_raw_mode(l);
+    return comlin_history_save_as(state, filename, COMLIN_HISTORY_TEXT);
+}
 
-    return st ? st : write_string(l->ofd, "\n", 1);
+// Write history to a file in some format, then close it
+static ComlinStatus
+history_write_file(ComlinState const* const state,
+                   int const fd,
+                   ComlinHistoryFormat const format)
+{
+    ComlinStatus const rc = (format == COMLIN_HISTORY_BINARY)
+                              ? history_write_binary(state, fd)
+                              : history_write_text(state, fd);
+
+    return (close(fd) < 0 && !rc) ? COMLIN_BAD_WRITE : rc;
 }
 
-char const*
-comlin_text(ComlinState const* const l)
+/* Write history to a new file, then replace an existing file with it.
+ *
+ * The new file is made next to the real path of the old one, so that any
+ * symbolic link to it still works, and it keeps the permissions of the old
+ * one, and its owner and group if this process is allowed to set them.
+ */
+static ComlinStatus
+history_replace_file(ComlinState const* const state,
+                     char const* const filename,
+                     struct stat const* const old,
+                     ComlinHistoryFormat const format)
 {
-    return l->buf.data;
+    char* const target = realpath(filename, NULL);
+    StringBuf path = {NULL, 0U, 0U};
+    if (target) {
+        buf_append(&path, target, strlen(target));
+        buf_append(&path, ".XXXXXX", 7U);
+    }
+
+    int const fd = path.data ? mkstemp(path.data) : -1;
+    if (fd >= 0 && fchown(fd, old->st_uid, old->st_gid)) {
+        // Failed to keep the owner, so the file belongs to this user
+    }
+
+    if (fd < 0 || fchmod(fd, old->st_mode & 07777U)) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(path.data);
+        }
+
+        buf_free(&path);
+        free(target);
+        return COMLIN_NO_FILE;
+    }
+
+    ComlinStatus rc = history_write_file(state, fd, format);
+    if (rc || rename(path.data, target)) {
+        unlink(path.data);
+        rc = rc ? rc : COMLIN_BAD_WRITE;
+    }
+
+    buf_free(&path);
+    free(target);
+    return rc;
 }
 
 ComlinStatus
-comlin_read_line(ComlinState* const state, char const* const prompt)
+comlin_history_save_as(ComlinState const* const state,
+                       char const* const filename,
+                       ComlinHistoryFormat const format)
 {
-    ComlinStatus st0 = comlin_edit_start(state, prompt);
-    ComlinStatus st1 = COMLIN_SUCCESS;
-    if (!st0) {
-        do {
-            st0 = comlin_edit_feed(state);
-        } while (st0 == COMLIN_EDITING);
+    /* Truncating a file that this process has mapped would pull the rug out
+     * from under it, so in that case, write a new file and replace the old
+     * one instead.  Otherwise, the file is written in place as usual. */
+    HistoryFile const* const file = &state->history_file;
+    history_file_check(file);
+
+    ComlinStatus rc = COMLIN_SUCCESS;
+    struct stat st;
+    if (file->data && !stat(filename, &st) && st.st_dev == file->dev &&
+        st.st_ino == file->ino) {
+        rc = history_replace_file(state, filename, &st, format);
+    } else {
+        mode_t const mode = S_IRUSR | S_IWUSR;
+        int const flags = O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC;
+        int const fd = open(filename, flags, mode);
+        if (fd < 0) {
+            return COMLIN_NO_FILE;
+        }
 
-        st1 = comlin_edit_stop(state);
+        rc = history_write_file(state, fd, format);
     }
-    return st0 ? st0 : st1;
-}
 
-/* History */
+    // Save any indices so they can be loaded quickly, or rebuilt if this fails
+    char const* const history_path = state->history_path.data;
+    if (!rc && (state->prefixes || state->words) && history_path &&
+        !strcmp(history_path, filename)) {
+        history_write_index(state, filename);
+    }
 
-/* Uses a fixed array of char pointers that are shifted (memmoved)
- * when the history max length is reached in order to remove the older
- * entry and make room for the new one, so it is not exactly suitable for huge
- * histories, but will work well for a few hundred of entries.
- *
- * Using a circular buffer is smarter, but a bit more complex to handle. */
-ComlinStatus
-comlin_history_add(ComlinState* const state, char const* const line)
+    return rc;
+}
+
+// Load history from a mapped binary file, lazily if possible
+static ComlinStatus
+history_load_binary(ComlinState* const state, HistoryFile* const file)
 {
-    if (state->history_max_len == 0) {
+    size_t const count = history_file_count(file);
+    size_t const len = count < state->history_max_len ? count
+                                                       : state->history_max_len;
+
+    if (!len) {
+        history_file_unmap(file);
         return COMLIN_SUCCESS;
     }
 
-    // Initialization on first call
-    if (!state->history) {
-        state->history = (char**)malloc(sizeof(char*) * state->history_max_len);
-        if (!state->history) {
-            return COMLIN_NO_MEMORY;
+    if (state->history_len || state->history_file.data) {
+        // Entries are already present, so append copies to the end
+        bool const has_metadata = history_file_has_metadata(file);
+        bool const has_scores = history_file_has_scores(file);
+        ComlinStatus st = COMLIN_SUCCESS;
+        for (size_t j = count - len; !st && j < count; ++j) {
+            ComlinHistoryMetadata metadata = {0, 0U, 0};
+            uint32_t score = 0U;
+            if (has_metadata) {
+                history_file_metadata(file, j, &metadata, &score);
+            }
+
+            st = history_push(state,
+                              history_file_entry(file, j),
+                              has_metadata ? &metadata : NULL,
+                              has_scores ? &score : NULL);
         }
-        memset(state->history, 0, (sizeof(char*) * state->history_max_len));
-    }
 
-    // Don't add duplicated lines
-    if (state->history_len &&
-        !strcmp(state->history[state->history_len - 1U], line)) {
-        return COMLIN_SUCCESS;
+        history_file_unmap(file);
+        return st;
     }
 
-    // Add an heap allocated copy of the line in the history
-    char* const linecopy = comlin_copy_string(line);
-    if (!linecopy) {
+    if (history_reserve(state)) {
+        history_file_unmap(file);
         return COMLIN_NO_MEMORY;
     }
 
-    // If we reached the max length, remove the older line
-    if (state->history_len == state->history_max_len) {
-        free(state->history[0]);
-        memmove(state->history,
-                state->history + 1,
-                sizeof(char*) * (state->history_max_len - 1U));
-        --state->history_len;
+    // Metadata is small and fixed-size, so copy it all in advance
+    if (history_file_has_metadata(file)) {
+        if (history_reserve_metadata(state) ||
+            (history_file_has_scores(file) && history_reserve_scores(state))) {
+            history_file_unmap(file);
+            return COMLIN_NO_MEMORY;
+        }
+
+        for (size_t i = 0U; i < len; ++i) {
+            ComlinHistoryMetadata metadata = {0, 0U, 0};
+            uint32_t score = 0U;
+            history_file_metadata(file, count - len + i, &metadata, &score);
+            state->history_times[i] = metadata.time;
+            state->history_durations[i] = metadata.duration;
+            state->history_statuses[i] = metadata.status;
+            if (state->history_scores) {
+                state->history_scores[i] = score;
+            }
+        }
     }
 
-    state->history[state->history_len] = linecopy;
-    ++state->history_len;
+    // Drop the (empty) indices, they will be rebuilt when needed
+    prefix_index_free(state->words);
+    prefix_index_free(state->prefixes);
+    history_unindex_sizes(state);
+    state->words = NULL;
+    state->prefixes = NULL;
+
+    /* Use the file directly as the oldest entries, decoded on demand.  Entries
+     * are written contiguously, so their total size can be calculated from
+     * the offset of the first without reading them all. */
+    file->first = count - len;
+    file->lazy_len = len;
+    state->history_file = *file;
+    state->history_len = len;
+
+    size_t const table_offset = history_header_size + (8U * file->first);
+    uint64_t const start = decode_u64(file->data + table_offset);
+    size_t const records_size = start < file->size ? file->size - start : 0U;
+    state->history_bytes = records_size > 4U * len ? records_size - 4U * len
+                                                   : 0U;
+    history_enforce_budget(state);
     return COMLIN_SUCCESS;
 }
 
-ComlinStatus
-comlin_history_save(ComlinState const* const state, char const* const filename)
+/* Bring the indices from an index sidecar up to date with the history.
+ *
+ * If the indexed entries are still the first in the history, then entries
+ * that have since been added are inserted, so this only takes time
+ * proportional to the changes since the index was written.  If the history
+ * file hasn't changed and all of its entries were loaded, then the index is
+ * used as it is.  Otherwise, the index can't be used, since entries can't be
+ * removed from it without their text.
+ *
+ * If `seqs` isn't null, it's set to the sequence number of every entry in the
+ * index, where empty entries share the number of the entry before them.
+ */
+static bool
+index_catch_up(ComlinState* const state,
+               PrefixIndex* const prefixes,
+               PrefixIndex* const words,
+               uint64_t* const seqs,
+               char const* const data,
+               size_t const size,
+               bool const fresh)
 {
-    ComlinStatus st = COMLIN_SUCCESS;
-    mode_t const mode = S_IRUSR | S_IWUSR;
-    int const flags = O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC;
-    int const fd = open(filename, flags, mode);
-    if (fd < 0) {
-        return COMLIN_NO_FILE;
+    uint64_t const n_indexed = decode_u64(data + 40U);
+    if (n_indexed > (size - index_header_size) / index_entry_size) {
+        return false;
     }
 
-    for (size_t j = 0U; !st && j < state->history_len; ++j) {
-        size_t const len = strlen(state->history[j]);
+    uint64_t const seq = decode_u64(data + 48U);
+    if (seq > state->history_seq) {
+        state->history_seq = seq;
+    }
+
+    // Use the index as it is if every entry is indexed and hasn't changed
+    size_t const n = (size_t)n_indexed;
+    char const* const entries = data + index_header_size;
+    if (fresh && decode_u64(data + 64U) == state->history_len &&
+        n == state->history_len) {
+        for (size_t i = 0U; seqs && i < n; ++i) {
+            seqs[i] = decode_u64(entries + (index_entry_size * i) + 12U);
+        }
+
+        return true;
+    }
+
+    // Check that the indexed entries are the first non-empty history entries
+    uint64_t entry_seq = 0U;
+    size_t j = 0U;
+    for (size_t i = 0U; i < n; ++i, ++j) {
+        while (j < state->history_len && history_size(state, j) <= 1U) {
+            if (seqs) {
+                seqs[j] = entry_seq;
+            }
+            ++j;
+        }
+
+        char const* const entry = entries + (index_entry_size * i);
+        size_t const len =
+          (j < state->history_len) ? history_size(state, j) - 1U : 0U;
+        if (!len || decode_u32(entry) != len) {
+            return false;
+        }
+
+        // The lengths are enough if the file hasn't changed since
+        uint64_t const hash = decode_u64(entry + 4U);
+        if (!fresh && hash != index_hash(history_get(state, j), len)) {
+            return false;
+        }
+
+        entry_seq = decode_u64(entry + 12U);
+        if (seqs) {
+            seqs[j] = entry_seq;
+        }
+    }
+
+    // Insert the entries that have been added since
+    for (; j < state->history_len; ++j) {
+        char const* const text = history_get(state, j);
+        size_t const len = history_size(state, j) - 1U;
         if (len) {
-            st = write_string(fd, state->history[j], len);
-            if (!st) {
-                st = write_string(fd, "\n", 1U);
+            entry_seq = ++state->history_seq;
+            if ((prefixes &&
+                 !prefix_index_insert(prefixes, text, len, entry_seq)) ||
+                (words && !index_tokens(words, text, len, entry_seq))) {
+                return false;
             }
         }
+
+        if (seqs) {
+            seqs[j] = entry_seq;
+        }
     }
 
-    return close(fd) < 0 ? COMLIN_BAD_WRITE : st;
+    return true;
 }
 
-ComlinStatus
-comlin_history_load(ComlinState* const state, char const* const filename)
+// Load the index sidecar for a history file that was just loaded, if any
+static void
+history_load_index(ComlinState* const state, char const* const filename)
+{
+    StringBuf path = index_path(filename);
+    int const fd = path.data ? open(path.data, O_CLOEXEC | O_RDONLY) : -1;
+    buf_free(&path);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat history_st;
+    struct stat st;
+    void* data = MAP_FAILED;
+    size_t size = 0U;
+    if (!stat(filename, &history_st) && !fstat(fd, &st) &&
+        st.st_size >= (off_t)index_header_size) {
+        size = (size_t)st.st_size;
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    close(fd);
+    if (data == MAP_FAILED) {
+        return;
+    }
+
+    // Only load the indices that are used in the current mode
+    char const* const bytes = (char const*)data;
+    uint32_t const flags = decode_u32(bytes + 12U);
+    bool const has_prefixes = flags & index_has_prefixes;
+    bool const has_words = flags & index_has_words;
+    bool const load_prefixes = state->suggestmode && has_prefixes;
+    bool const load_words = state->wordmode && has_words;
+    if (memcmp(bytes, index_magic, sizeof(index_magic)) ||
+        decode_u32(bytes + 8U) != index_version ||
+        (!load_prefixes && !load_words)) {
+        munmap(data, size);
+        return;
+    }
+
+    // Skip past the entries to the serialised indices
+    uint64_t const n_indexed = decode_u64(bytes + 40U);
+    uint64_t const max_indexed = (size - index_header_size) / index_entry_size;
+    size_t offset = (n_indexed <= max_indexed)
+                      ? index_header_size +
+                          (index_entry_size * (size_t)n_indexed)
+                      : size;
+
+    size_t used = 0U;
+    PrefixIndex* prefixes = NULL;
+    PrefixIndex* words = NULL;
+    if (has_prefixes) {
+        prefixes =
+          prefix_index_deserialise(bytes + offset, size - offset, &used);
+        offset += used;
+    }
+
+    if (has_words) {
+        words = prefix_index_deserialise(bytes + offset, size - offset, &used);
+    }
+
+    struct timespec const mtime = path_mtime(&history_st);
+    bool const fresh =
+      decode_u64(bytes + 16U) == (uint64_t)history_st.st_size &&
+      decode_u64(bytes + 24U) == (uint64_t)mtime.tv_sec &&
+      decode_u64(bytes + 32U) == (uint64_t)history_st.st_ino &&
+      decode_u64(bytes + 56U) == (uint64_t)mtime.tv_nsec;
+
+    // Only replace the entry sequence numbers if the whole index is used
+    uint64_t* const seqs =
+      load_prefixes ? (uint64_t*)malloc(sizeof(uint64_t) * state->history_len)
+                    : NULL;
+
+    if ((prefixes || !has_prefixes) && (words || !has_words) &&
+        (seqs || !load_prefixes) &&
+        index_catch_up(state, prefixes, words, seqs, bytes, size, fresh)) {
+        if (load_prefixes) {
+            prefix_index_free(state->prefixes);
+            state->prefixes = prefixes;
+            prefixes = NULL;
+            memcpy(state->history_seqs,
+                   seqs,
+                   sizeof(uint64_t) * state->history_len);
+        }
+
+        if (load_words) {
+            prefix_index_free(state->words);
+            state->words = words;
+            words = NULL;
+        }
+    }
+
+    free(seqs);
+    prefix_index_free(words);
+    prefix_index_free(prefixes);
+    munmap(data, size);
+}
+
+// Load entries from a binary or text history file
+static ComlinStatus
+history_load_file(ComlinState* const state, char const* const filename)
 {
     ComlinStatus st = COMLIN_SUCCESS;
     StringBuf buf = {NULL, 0U, 0U};
@@ -1267,13 +5772,43 @@ comlin_history_load(ComlinState* const state, char const* const filename)
         return COMLIN_NO_FILE;
     }
 
+    HistoryFile file = {NULL, 0U, 0U, 0U, NULL, NULL, 0U, 0U, -1};
+    st = history_file_map(&file, fd);
+    if (st != COMLIN_BAD_READ) {
+        st = st ? st : history_load_binary(state, &file);
+        return close(fd) < 0 ? COMLIN_BAD_READ : st;
+    }
+
+    st = COMLIN_SUCCESS;
+
+    // Only parse metadata if it's recorded or the file is marked as having it
+    bool has_metadata = state->metamode;
+    bool first = true;
     while (!st) {
         char c = '\0';
         st = read_char(fd, &c);
 
         if (st == COMLIN_SUCCESS) {
             if (c == '\n' && buf.length) {
-                comlin_history_add(state, buf.data);
+                if (first && !strcmp(buf.data, history_metadata_marker)) {
+                    has_metadata = true;
+                    first = false;
+                    buf.length = 0U;
+                    continue;
+                }
+
+                ComlinHistoryMetadata metadata = {0, 0U, 0};
+                uint32_t score = 0U;
+                size_t const offset =
+                  has_metadata ? parse_metadata(buf.data, &metadata, &score)
+                               : 0U;
+                first = false;
+                if (buf.data[offset]) {
+                    history_push(state,
+                                 buf.data + offset,
+                                 offset ? &metadata : NULL,
+                                 score ? &score : NULL);
+                }
                 buf.length = 0U;
             } else if (c >= 0x20 && c != DEL) {
                 buf_append(&buf, &c, 1U);
@@ -1287,3 +5822,21 @@ comlin_history_load(ComlinState* const state, char const* const filename)
     buf_free(&buf);
     return close(fd) < 0 ? COMLIN_BAD_READ : st;
 }
+
+ComlinStatus
+comlin_history_load(ComlinState* const state, char const* const filename)
+{
+    /* Indices can only be loaded into an empty history, otherwise they would
+     * be missing the existing entries, so they will be rebuilt if needed. */
+    bool const was_empty = !state->history_len;
+    ComlinStatus const st = history_load_file(state, filename);
+    if (!st && was_empty) {
+        state->history_path.length = 0U;
+        buf_append(&state->history_path, filename, strlen(filename));
+        if (state->history_len) {
+            history_load_index(state, filename);
+        }
+    }
+
+    return st;
+}
@@ -0,0 +1,214 @@
+// Copyright 2023 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "fuzzy.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    define COMLIN_FUZZY_X86 1
+#    include <immintrin.h>
+#else
+#    define COMLIN_FUZZY_X86 0
+#endif
+
+// Scores, loosely based on fzf
+#define SCORE_MATCH 16
+#define SCORE_GAP_START (-3)
+#define SCORE_GAP_EXTENSION (-1)
+#define BONUS_BOUNDARY 8
+#define BONUS_CAMEL 7
+#define BONUS_CONSECUTIVE 4
+#define BONUS_FIRST_MULTIPLIER 2
+
+static char
+to_lower(char const c)
+{
+    return (char)((c >= 'A' && c <= 'Z') ? (c + ('a' - 'A')) : c);
+}
+
+static char
+to_upper(char const c)
+{
+    return (char)((c >= 'a' && c <= 'z') ? (c - ('a' - 'A')) : c);
+}
+
+static bool
+is_boundary(char const c)
+{
+    return c == ' ' || c == '/' || c == '-' || c == '_' || c == '.' ||
+           c == ':' || c == ',' || c == '=' || c == '\t';
+}
+
+static size_t
+find_scalar(char const* const text,
+            size_t const len,
+            char const a,
+            char const b)
+{
+    for (size_t i = 0U; i < len; ++i) {
+        if (text[i] == a || text[i] == b) {
+            return i;
+        }
+    }
+
+    return len;
+}
+
+#if COMLIN_FUZZY_X86
+
+__attribute__((target("sse2"))) static size_t
+find_sse2(char const* const text,
+          size_t const len,
+          char const a,
+          char const b)
+{
+    __m128i const va = _mm_set1_epi8(a);
+    __m128i const vb = _mm_set1_epi8(b);
+
+    size_t i = 0U;
+    for (; i + 16U <= len; i += 16U) {
+        __m128i const v =
+          _mm_loadu_si128((__m128i const*)(void const*)(text + i));
+        __m128i const eq =
+          _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb));
+        unsigned const mask = (unsigned)_mm_movemask_epi8(eq);
+        if (mask) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+
+    return i + find_scalar(text + i, len - i, a, b);
+}
+
+__attribute__((target("avx2"))) static size_t
+find_avx2(char const* const text,
+          size_t const len,
+          char const a,
+          char const b)
+{
+    __m256i const va = _mm256_set1_epi8(a);
+    __m256i const vb = _mm256_set1_epi8(b);
+
+    size_t i = 0U;
+    for (; i + 32U <= len; i += 32U) {
+        __m256i const v =
+          _mm256_loadu_si256((__m256i const*)(void const*)(text + i));
+        __m256i const eq =
+          _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb));
+        unsigned const mask = (unsigned)_mm256_movemask_epi8(eq);
+        if (mask) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+
+    return i + find_sse2(text + i, len - i, a, b);
+}
+
+#endif
+
+// The best byte search for the CPU, chosen once on first use
+static FuzzyFindFunc fuzzy_find = find_scalar;
+static pthread_once_t fuzzy_find_once = PTHREAD_ONCE_INIT;
+
+static void
+fuzzy_select_find(void)
+{
+#if COMLIN_FUZZY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        fuzzy_find = find_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        fuzzy_find = find_sse2;
+    }
+#endif
+}
+
+FuzzyMatcher
+fuzzy_matcher(void)
+{
+    pthread_once(&fuzzy_find_once, fuzzy_select_find);
+
+    FuzzyMatcher const matcher = {fuzzy_find};
+    return matcher;
+}
+
+// Return the bonus for matching the character at `i` in `text`
+static int32_t
+position_bonus(char const* const text, size_t const i)
+{
+    if (i == 0U || is_boundary(text[i - 1U])) {
+        return BONUS_BOUNDARY;
+    }
+
+    char const prev = text[i - 1U];
+    char const c = text[i];
+    return (prev >= 'a' && prev <= 'z' && c >= 'A' && c <= 'Z') ? BONUS_CAMEL
+                                                                : 0;
+}
+
+bool
+fuzzy_match(FuzzyMatcher const matcher,
+            char const* const pattern,
+            size_t const pattern_len,
+            char const* const text,
+            size_t const text_len,
+            int32_t* const score)
+{
+    *score = 0;
+    if (!pattern_len) {
+        return true;
+    }
+
+    /* Find the end of the first (leftmost) match with the vectorised search.
+     * This is done for each candidate, and stops early if it doesn't match. */
+    size_t end = 0U;
+    for (size_t p = 0U; p < pattern_len; ++p) {
+        char const c = pattern[p];
+        size_t const offset =
+          matcher.find(text + end, text_len - end, to_lower(c), to_upper(c));
+
+        end += offset;
+        if (end == text_len) {
+            return false;
+        }
+
+        ++end;
+    }
+
+    // Scan backwards from the end to find the shortest match window
+    size_t start = end;
+    for (size_t p = pattern_len; p > 0U; --start) {
+        if (to_lower(text[start - 1U]) == to_lower(pattern[p - 1U])) {
+            --p;
+        }
+    }
+
+    // Score the window
+    int32_t total = 0;
+    bool in_gap = false;
+    bool consecutive = false;
+    for (size_t i = start, p = 0U; i < end; ++i) {
+        if (p < pattern_len && to_lower(text[i]) == to_lower(pattern[p])) {
+            int32_t bonus = position_bonus(text, i);
+            if (consecutive && bonus < BONUS_CONSECUTIVE) {
+                bonus = BONUS_CONSECUTIVE;
+            }
+
+            total += SCORE_MATCH + (p ? bonus : bonus * BONUS_FIRST_MULTIPLIER);
+            consecutive = true;
+            in_gap = false;
+            ++p;
+        } else {
+            total += in_gap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+            consecutive = false;
+            in_gap = true;
+        }
+    }
+
+    *score = total;
+    return true;
+}
@@ -0,0 +1,48 @@
+// Copyright 2023 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef COMLIN_SRC_FUZZY_H
+#define COMLIN_SRC_FUZZY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fuzzy subsequence matching.
+ *
+ * A pattern matches text if every character of the pattern appears in the
+ * text in order, ignoring ASCII case.  Matches are scored similarly to fzf,
+ * with bonuses for characters at the start of words and consecutive runs.
+ */
+
+/// A function that finds the first byte in text that equals `a` or `b`
+typedef size_t (*FuzzyFindFunc)(char const* text, size_t len, char a, char b);
+
+/// A fuzzy matcher that uses the best implementation for the CPU
+typedef struct {
+    FuzzyFindFunc find; ///< Byte search function
+} FuzzyMatcher;
+
+/// Return a matcher for the current CPU
+FuzzyMatcher
+fuzzy_matcher(void);
+
+/** Match a pattern against some text.
+ *
+ * @param matcher The matcher returned by #fuzzy_matcher.
+ * @param pattern The pattern to match.
+ * @param pattern_len The length of `pattern` in bytes.
+ * @param text The text to match against.
+ * @param text_len The length of `text` in bytes.
+ * @param[out] score Set to the score of the match, higher is better.
+ * @return True if the text matches the pattern.
+ */
+bool
+fuzzy_match(FuzzyMatcher matcher,
+            char const* pattern,
+            size_t pattern_len,
+            char const* text,
+            size_t text_len,
+            int32_t* score);
+
+#endif // COMLIN_SRC_FUZZY_H
@@ -0,0 +1,605 @@
+// Copyright 2023 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "grammar.h"
+#include "token.h"
+
+#include "comlin/comlin.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A transition on a keyword
+typedef struct {
+    char const* label; ///< Keyword (points into the rule text)
+    size_t len;        ///< Length of keyword
+    size_t target;     ///< Index of target state
+} GrammarEdge;
+
+/* A state in the grammar automaton.
+ *
+ * A token follows a keyword edge if there is one, otherwise the integer edge
+ * if it's an integer, otherwise the word edge.  Since the automaton is
+ * deterministic, a keyword edge also covers any typed argument it matches.
+ * Zero means there is no typed edge, since no transition ever leads back to
+ * the initial state.
+ */
+typedef struct {
+    GrammarEdge* edges; ///< Keyword edges, sorted once compiled
+    size_t n_edges;     ///< Number of keyword edges
+    size_t integer;     ///< Target state for an integer, or zero
+    size_t word;        ///< Target state for any word, or zero
+    bool accepting;     ///< A complete command ends here
+} GrammarState;
+
+struct ComlinGrammarImpl {
+    char* text;           ///< Copy of all rule text
+    GrammarState* states; ///< States, where the first is the initial state
+    size_t n_states;      ///< Number of states
+};
+
+// The kind of token at a position in a rule
+typedef enum {
+    RULE_KEYWORDS, ///< One of a set of keywords
+    RULE_INTEGER,  ///< An integer argument
+    RULE_WORD,     ///< Any word
+    RULE_END,      ///< The end of the rule
+} RuleTokenKind;
+
+/* A position in a rule, which is a state of a nondeterministic automaton.
+ *
+ * The positions of each rule are stored consecutively and followed by an end
+ * position, so the only transition from a position is to the next one.
+ */
+typedef struct {
+    RuleTokenKind kind; ///< Kind of token expected here
+    char const* alts;   ///< Keywords separated by '|' (points into rule text)
+    size_t alts_len;    ///< Length of keywords
+} RulePosition;
+
+// A set of rule positions, which is a state of the deterministic automaton
+typedef struct {
+    size_t* positions; ///< Sorted indices of rule positions
+    size_t n;          ///< Number of positions
+} PositionSet;
+
+// Compilation state
+typedef struct {
+    RulePosition* positions; ///< Positions of all rules
+    size_t n_positions;      ///< Number of rule positions
+    PositionSet* sets;       ///< Position set of each automaton state
+} GrammarCompiler;
+
+// Order keyword edges by label
+static int
+compare_edges(void const* const a, void const* const b)
+{
+    GrammarEdge const* const lhs = (GrammarEdge const*)a;
+    GrammarEdge const* const rhs = (GrammarEdge const*)b;
+    size_t const len = lhs->len < rhs->len ? lhs->len : rhs->len;
+    int const cmp = memcmp(lhs->label, rhs->label, len);
+
+    return cmp                     ? cmp
+           : (lhs->len < rhs->len) ? -1
+           : (lhs->len > rhs->len) ? 1
+                                   : 0;
+}
+
+// Return the index of the first edge with a label not less than a prefix
+static size_t
+lower_bound(GrammarState const* const state,
+            char const* const prefix,
+            size_t const len)
+{
+    size_t lo = 0U;
+    size_t hi = state->n_edges;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        GrammarEdge const* const edge = &state->edges[mid];
+        size_t const n = edge->len < len ? edge->len : len;
+        int const cmp = memcmp(edge->label, prefix, n);
+        if (cmp < 0 || (!cmp && edge->len < len)) {
+            lo = mid + 1U;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// Return true if a token is an optionally signed decimal integer
+static bool
+is_integer(char const* const token, size_t const len)
+{
+    size_t i = (len > 1U && (token[0] == '-' || token[0] == '+')) ? 1U : 0U;
+    if (i == len) {
+        return false;
+    }
+
+    for (; i < len; ++i) {
+        if (token[i] < '0' || token[i] > '9') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Return the state after a token, or zero if there is no transition
+static size_t
+step(ComlinGrammar const* const grammar,
+     size_t const from,
+     char const* const token,
+     size_t const len)
+{
+    GrammarState const* const state = &grammar->states[from];
+    size_t const i = lower_bound(state, token, len);
+    if (i < state->n_edges && state->edges[i].len == len &&
+        !memcmp(state->edges[i].label, token, len)) {
+        return state->edges[i].target;
+    }
+
+    return (state->integer && is_integer(token, len)) ? state->integer
+                                                      : state->word;
+}
+
+// Return the target of a keyword edge before compilation, or zero
+static size_t
+find_edge(GrammarState const* const state,
+          char const* const label,
+          size_t const len)
+{
+    for (size_t i = 0U; i < state->n_edges; ++i) {
+        GrammarEdge const* const edge = &state->edges[i];
+        if (edge->len == len && !memcmp(edge->label, label, len)) {
+            return edge->target;
+        }
+    }
+
+    return 0U;
+}
+
+// Add a keyword edge, returning false on allocation failure
+static bool
+add_edge(GrammarState* const state,
+         char const* const label,
+         size_t const len,
+         size_t const target)
+{
+    GrammarEdge* const edges = (GrammarEdge*)realloc(
+      state->edges, sizeof(GrammarEdge) * (state->n_edges + 1U));
+    if (!edges) {
+        return false;
+    }
+
+    GrammarEdge const edge = {label, len, target};
+    edges[state->n_edges++] = edge;
+    state->edges = edges;
+    return true;
+}
+
+// Return the length of the alternative in keywords that starts at `start`
+static size_t
+alt_length(char const* const alts, size_t const alts_len, size_t const start)
+{
+    size_t end = start;
+    while (end < alts_len && alts[end] != '|') {
+        ++end;
+    }
+
+    return end - start;
+}
+
+// Return true if a rule position matches a keyword
+static bool
+position_matches(RulePosition const* const position,
+                 char const* const keyword,
+                 size_t const len)
+{
+    char const* const alts = position->alts;
+    size_t const alts_len = position->alts_len;
+
+    switch (position->kind) {
+    case RULE_KEYWORDS:
+        for (size_t start = 0U; start <= alts_len;) {
+            size_t const n = alt_length(alts, alts_len, start);
+            if (n == len && !memcmp(alts + start, keyword, len)) {
+                return true;
+            }
+
+            start += n + 1U;
+        }
+
+        return false;
+    case RULE_INTEGER:
+        return is_integer(keyword, len);
+    case RULE_WORD:
+        return true;
+    case RULE_END:
+        break;
+    }
+
+    return false;
+}
+
+// Parse a rule token into a position, returning false if it's invalid
+static bool
+parse_token(char const* const token,
+            size_t const len,
+            RulePosition* const position)
+{
+    // Typed arguments like <int> or <name>
+    if (token[0] == '<') {
+        position->kind = (len == 5U && !memcmp(token, "<int>", 5U))
+                           ? RULE_INTEGER
+                           : RULE_WORD;
+        return len >= 3U && token[len - 1U] == '>';
+    }
+
+    // Keywords, or enumerations of them like (a|b|c)
+    position->kind = RULE_KEYWORDS;
+    position->alts = token;
+    position->alts_len = len;
+    if (token[0] == '(') {
+        if (len < 3U || token[len - 1U] != ')') {
+            return false;
+        }
+
+        position->alts = token + 1U;
+        position->alts_len = len - 2U;
+    }
+
+    char const* const alts = position->alts;
+    size_t const alts_len = position->alts_len;
+    for (size_t start = 0U; start <= alts_len;) {
+        size_t const n = alt_length(alts, alts_len, start);
+        char const* const alt = alts + start;
+        if (!n || memchr(alt, '(', n) || memchr(alt, ')', n)) {
+            return false;
+        }
+
+        start += n + 1U;
+    }
+
+    return true;
+}
+
+// Add a position to the rules, returning false on allocation failure
+static bool
+add_position(GrammarCompiler* const compiler, RulePosition const position)
+{
+    RulePosition* const positions = (RulePosition*)realloc(
+      compiler->positions,
+      sizeof(RulePosition) * (compiler->n_positions + 1U));
+    if (!positions) {
+        return false;
+    }
+
+    positions[compiler->n_positions++] = position;
+    compiler->positions = positions;
+    return true;
+}
+
+/* Return the state for a set of positions, adding it if it's new.
+ *
+ * The set is taken by the new state, or freed if it already exists.  Returns
+ * zero on allocation failure.
+ */
+static size_t
+intern_state(ComlinGrammar* const grammar,
+             GrammarCompiler* const compiler,
+             PositionSet const set)
+{
+    for (size_t s = 0U; s < grammar->n_states; ++s) {
+        PositionSet const* const other = &compiler->sets[s];
+        if (other->n == set.n &&
+            !memcmp(other->positions, set.positions, sizeof(size_t) * set.n)) {
+            free(set.positions);
+            return s;
+        }
+    }
+
+    size_t const n = grammar->n_states + 1U;
+    GrammarState* const states =
+      (GrammarState*)realloc(grammar->states, sizeof(GrammarState) * n);
+    if (states) {
+        grammar->states = states;
+    }
+
+    PositionSet* const sets =
+      (PositionSet*)realloc(compiler->sets, sizeof(PositionSet) * n);
+    if (sets) {
+        compiler->sets = sets;
+    }
+
+    if (!states || !sets) {
+        free(set.positions);
+        return 0U;
+    }
+
+    memset(&states[n - 1U], 0, sizeof(GrammarState));
+    sets[n - 1U] = set;
+    grammar->n_states = n;
+    return n - 1U;
+}
+
+/* Return the state reached from a state by a token, or zero if there is none.
+ *
+ * This is the set of positions after every position in the state's set that
+ * matches the token.  The token is a keyword if `keyword` is non-null,
+ * otherwise any integer if `integer` is true, otherwise any other word.
+ */
+static size_t
+add_target(ComlinGrammar* const grammar,
+           GrammarCompiler* const compiler,
+           size_t const from,
+           char const* const keyword,
+           size_t const len,
+           bool const integer,
+           bool* const ok)
+{
+    PositionSet const* const from_set = &compiler->sets[from];
+    PositionSet set = {(size_t*)malloc(sizeof(size_t) * from_set->n), 0U};
+    if (!set.positions) {
+        *ok = false;
+        return 0U;
+    }
+
+    // The positions are sorted, so the following positions are too
+    for (size_t i = 0U; i < from_set->n; ++i) {
+        size_t const p = from_set->positions[i];
+        RulePosition const* const position = &compiler->positions[p];
+        if (keyword ? position_matches(position, keyword, len)
+                    : (position->kind == RULE_WORD ||
+                       (integer && position->kind == RULE_INTEGER))) {
+            set.positions[set.n++] = p + 1U;
+        }
+    }
+
+    if (!set.n) {
+        free(set.positions);
+        return 0U;
+    }
+
+    size_t const target = intern_state(grammar, compiler, set);
+    *ok = target != 0U;
+    return target;
+}
+
+// Add the transitions and acceptance of a state from its set of positions
+static bool
+build_state(ComlinGrammar* const grammar,
+            GrammarCompiler* const compiler,
+            size_t const s)
+{
+    bool ok = true;
+    bool has_integer = false;
+    for (size_t i = 0U; ok && i < compiler->sets[s].n; ++i) {
+        RulePosition const position =
+          compiler->positions[compiler->sets[s].positions[i]];
+
+        has_integer = has_integer || position.kind == RULE_INTEGER;
+        if (position.kind == RULE_END) {
+            grammar->states[s].accepting = true;
+        } else if (position.kind == RULE_KEYWORDS) {
+            // Add an edge for every keyword that doesn't have one yet
+            for (size_t start = 0U; ok && start <= position.alts_len;) {
+                char const* const alt = position.alts + start;
+                size_t const n =
+                  alt_length(position.alts, position.alts_len, start);
+                if (!find_edge(&grammar->states[s], alt, n)) {
+                    size_t const target =
+                      add_target(grammar, compiler, s, alt, n, false, &ok);
+                    ok = ok && add_edge(&grammar->states[s], alt, n, target);
+                }
+
+                start += n + 1U;
+            }
+        }
+    }
+
+    if (ok && has_integer) {
+        size_t const target =
+          add_target(grammar, compiler, s, NULL, 0U, true, &ok);
+        grammar->states[s].integer = target;
+    }
+
+    if (ok) {
+        size_t const target =
+          add_target(grammar, compiler, s, NULL, 0U, false, &ok);
+        grammar->states[s].word = target;
+    }
+
+    return ok;
+}
+
+/* Parse the rules into positions, and return the set of their starts.
+ *
+ * Edges point to keywords in the rule text, so all rules are copied into one
+ * buffer that is kept by the grammar.
+ */
+static bool
+parse_rules(ComlinGrammar* const grammar,
+            GrammarCompiler* const compiler,
+            char const* const* const rules,
+            size_t const n_rules,
+            PositionSet* const starts)
+{
+    size_t total_size = 0U;
+    for (size_t r = 0U; r < n_rules; ++r) {
+        total_size += strlen(rules[r]) + 1U;
+    }
+
+    grammar->text = (char*)malloc(total_size + 1U);
+    starts->positions = (size_t*)malloc(sizeof(size_t) * (n_rules + 1U));
+    if (!grammar->text || !starts->positions) {
+        return false;
+    }
+
+    char* text = grammar->text;
+    for (size_t r = 0U; r < n_rules; ++r) {
+        size_t const len = strlen(rules[r]);
+        memcpy(text, rules[r], len + 1U);
+        starts->positions[starts->n++] = compiler->n_positions;
+
+        size_t n_tokens = 0U;
+        for (size_t pos = 0U, n = 0U; (n = token_next(text, len, &pos));
+             pos += n) {
+            RulePosition position = {RULE_END, NULL, 0U};
+            if (!parse_token(text + pos, n, &position) ||
+                !add_position(compiler, position)) {
+                return false;
+            }
+
+            ++n_tokens;
+        }
+
+        RulePosition const end = {RULE_END, NULL, 0U};
+        if (!n_tokens || !add_position(compiler, end)) {
+            return false;
+        }
+
+        text += len + 1U;
+    }
+
+    return true;
+}
+
+/* Compile rules into a deterministic automaton by subset construction.
+ *
+ * The rules form a nondeterministic automaton, where each position in a rule
+ * is a state.  Each state of the compiled automaton is a set of positions
+ * that can be reached by the same tokens, so alternatives or arguments that
+ * lead into different rules are never confused, and a keyword that is also
+ * matched by an argument leads to the positions after both.
+ */
+ComlinGrammar*
+comlin_grammar_new(char const* const* const rules, size_t const n_rules)
+{
+    ComlinGrammar* const grammar =
+      (ComlinGrammar*)calloc(1U, sizeof(ComlinGrammar));
+    if (!grammar) {
+        return NULL;
+    }
+
+    GrammarCompiler compiler = {NULL, 0U, NULL};
+    PositionSet starts = {NULL, 0U};
+    bool ok = parse_rules(grammar, &compiler, rules, n_rules, &starts);
+    if (ok) {
+        // The initial state is the set of all rule starts, which are sorted
+        ok = !intern_state(grammar, &compiler, starts) && grammar->n_states;
+        starts.positions = NULL;
+    }
+
+    // Build every state, which may add more states to build later
+    for (size_t s = 0U; ok && s < grammar->n_states; ++s) {
+        ok = build_state(grammar, &compiler, s);
+    }
+
+    for (size_t s = 0U; s < grammar->n_states; ++s) {
+        free(compiler.sets[s].positions);
+    }
+
+    free(compiler.sets);
+    free(compiler.positions);
+    free(starts.positions);
+    if (!ok) {
+        comlin_grammar_free(grammar);
+        return NULL;
+    }
+
+    // Sort keyword edges so they can be found with a binary search
+    for (size_t s = 0U; s < grammar->n_states; ++s) {
+        GrammarState* const state = &grammar->states[s];
+        if (state->n_edges) {
+            qsort(state->edges,
+                  state->n_edges,
+                  sizeof(GrammarEdge),
+                  compare_edges);
+        }
+    }
+
+    return grammar;
+}
+
+void
+comlin_grammar_free(ComlinGrammar* const grammar)
+{
+    if (grammar) {
+        for (size_t s = 0U; s < grammar->n_states; ++s) {
+            free(grammar->states[s].edges);
+        }
+
+        free(grammar->states);
+        free(grammar->text);
+        free(grammar);
+    }
+}
+
+// Run the tokens in part of a line through the automaton in a single pass
+static bool
+run(ComlinGrammar const* const grammar,
+    char const* const line,
+    size_t const len,
+    size_t* const state)
+{
+    *state = 0U;
+    for (size_t pos = 0U, n = 0U; (n = token_next(line, len, &pos));
+         pos += n) {
+        if (!(*state = step(grammar, *state, line + pos, n))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+ComlinStatus
+comlin_grammar_check(ComlinGrammar const* const grammar,
+                     char const* const line,
+                     size_t const len)
+{
+    size_t state = 0U;
+    return !run(grammar, line, len, &state)   ? COMLIN_BAD_ARG
+           : grammar->states[state].accepting ? COMLIN_SUCCESS
+                                              : COMLIN_EDITING;
+}
+
+void
+grammar_complete(ComlinGrammar const* const grammar,
+                 char const* const line,
+                 size_t const pos,
+                 ComlinCompletions* const lc)
+{
+    // Find the start of the word before the cursor, which may be empty
+    size_t start = pos;
+    while (start && !token_is_space(line[start - 1U])) {
+        --start;
+    }
+
+    // Run the tokens before the word, and stop if they don't match
+    size_t state = 0U;
+    if (!run(grammar, line, start, &state)) {
+        return;
+    }
+
+    // Add every keyword that starts with the word
+    GrammarState const* const s = &grammar->states[state];
+    char const* const word = line + start;
+    size_t const word_len = pos - start;
+    for (size_t i = lower_bound(s, word, word_len); i < s->n_edges; ++i) {
+        GrammarEdge const* const edge = &s->edges[i];
+        if (edge->len < word_len || memcmp(edge->label, word, word_len)) {
+            break;
+        }
+
+        if (edge->len > word_len &&
+            comlin_add_completion_range(
+              lc, start, pos, edge->label, edge->len)) {
+            break;
+        }
+    }
+}
@@ -0,0 +1,23 @@
+// Copyright 2023 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef COMLIN_SRC_GRAMMAR_H
+#define COMLIN_SRC_GRAMMAR_H
+
+#include "comlin/comlin.h"
+
+#include <stddef.h>
+
+/** Add completions for the word before the cursor from a grammar.
+ *
+ * The tokens before the word are run through the grammar automaton, and
+ * every keyword that can follow them and starts with the word is added as a
+ * completion that replaces the word.
+ */
+void
+grammar_complete(ComlinGrammar const* grammar,
+                 char const* line,
+                 size_t pos,
+                 ComlinCompletions* lc);
+
+#endif // COMLIN_SRC_GRAMMAR_H
@@ -0,0 +1,344 @@
+// Copyright 2023 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "path.h"
+
+#include "comlin/comlin.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Number of directory listings to keep in the cache
+#define N_LISTINGS 4U
+
+// A sorted listing of a directory
+typedef struct {
+    char* path;            ///< Path of directory, or null if unused
+    dev_t dev;             ///< Device of directory when listed
+    ino_t ino;             ///< Inode of directory when listed
+    struct timespec mtime; ///< Modification time of directory when listed
+    bool racy;             ///< Listed too soon after modification to trust
+    char* text;            ///< Names of all entries, each null-terminated
+    PathEntry* entries;    ///< Entries sorted by name
+    size_t n_entries;      ///< Number of entries
+    uint64_t last_used;    ///< Time of last use, for replacement
+} PathListing;
+
+struct PathCacheImpl {
+    PathListing listings[N_LISTINGS]; ///< Cached listings
+    uint64_t clock;                   ///< Incremented on every use
+};
+
+PathCache*
+path_cache_new(void)
+{
+    return (PathCache*)calloc(1U, sizeof(PathCache));
+}
+
+static void
+free_listing(PathListing* const listing)
+{
+    free(listing->entries);
+    free(listing->text);
+    free(listing->path);
+    memset(listing, 0, sizeof(PathListing));
+}
+
+void
+path_cache_free(PathCache* const cache)
+{
+    if (cache) {
+        for (size_t i = 0U; i < N_LISTINGS; ++i) {
+            free_listing(&cache->listings[i]);
+        }
+
+        free(cache);
+    }
+}
+
+struct timespec
+path_mtime(struct stat const* const st)
+{
+#ifdef __APPLE__
+    return st->st_mtimespec;
+#else
+    return st->st_mtim;
+#endif
+}
+
+// Return true if two times are equal
+static bool
+times_equal(struct timespec const a, struct timespec const b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// Order entries by name
+static int
+compare_entries(void const* const a, void const* const b)
+{
+    return strcmp(((PathEntry const*)a)->name, ((PathEntry const*)b)->name);
+}
+
+// Return true if a directory entry is a directory, avoiding stat if possible
+static bool
+is_directory(DIR* const dir, struct dirent const* const entry)
+{
+#ifdef DT_DIR
+    if (entry->d_type == DT_DIR) {
+        return true;
+    }
+
+    if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) {
+        return false;
+    }
+#endif
+
+    // The type is unknown, or this is a link that may be to a directory
+    struct stat st;
+    return !fstatat(dirfd(dir), entry->d_name, &st, 0) && S_ISDIR(st.st_mode);
+}
+
+// Append text to a growing buffer, returning false on allocation failure
+static bool
+append_text(char** const text,
+            size_t* const size,
+            size_t* const capacity,
+            char const* const str,
+            size_t const len)
+{
+    if (*size + len > *capacity) {
+        size_t new_capacity = *capacity ? *capacity : 256U;
+        while (new_capacity < *size + len) {
+            new_capacity *= 2U;
+        }
+
+        char* const new_text = (char*)realloc(*text, new_capacity);
+        if (!new_text) {
+            return false;
+        }
+
+        *text = new_text;
+        *capacity = new_capacity;
+    }
+
+    memcpy(*text + *size, str, len);
+    *size += len;
+    return true;
+}
+
+// Append an entry to a growing array, returning false on allocation failure
+static bool
+append_entry(PathEntry** const entries,
+             size_t* const n_entries,
+             size_t* const capacity,
+             size_t const len)
+{
+    if (*n_entries == *capacity) {
+        size_t const new_capacity = *capacity ? *capacity * 2U : 64U;
+        PathEntry* const new_entries =
+          (PathEntry*)realloc(*entries, sizeof(PathEntry) * new_capacity);
+        if (!new_entries) {
+            return false;
+        }
+
+        *entries = new_entries;
+        *capacity = new_capacity;
+    }
+
+    PathEntry const entry = {NULL, len};
+    (*entries)[(*n_entries)++] = entry;
+    return true;
+}
+
+/* Read and sort the entries of a directory.
+ *
+ * Names are read into one buffer, each with a trailing slash if it's a
+ * directory and a null terminator.  Since the buffer may move as it grows,
+ * the entries only point to the names once everything has been read.
+ */
+static ComlinStatus
+read_listing(PathListing* const listing, char const* const path)
+{
+    DIR* const dir = opendir(path);
+    if (!dir) {
+        return COMLIN_NO_FILE;
+    }
+
+    char* text = NULL;
+    size_t text_size = 0U;
+    size_t text_capacity = 0U;
+    PathEntry* entries = NULL;
+    size_t n_entries = 0U;
+    size_t entries_capacity = 0U;
+    bool ok = true;
+
+    struct dirent const* entry = NULL;
+    while (ok && (entry = readdir(dir))) {
+        char const* const name = entry->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..")) {
+            continue;
+        }
+
+        size_t const len = strlen(name);
+        bool const is_dir = is_directory(dir, entry);
+        ok = append_text(&text, &text_size, &text_capacity, name, len) &&
+             (!is_dir ||
+              append_text(&text, &text_size, &text_capacity, "/", 1U)) &&
+             append_text(&text, &text_size, &text_capacity, "", 1U) &&
+             append_entry(
+               &entries, &n_entries, &entries_capacity, len + is_dir);
+    }
+
+    closedir(dir);
+    if (!ok) {
+        free(entries);
+        free(text);
+        return COMLIN_NO_MEMORY;
+    }
+
+    size_t offset = 0U;
+    for (size_t i = 0U; i < n_entries; ++i) {
+        entries[i].name = text + offset;
+        offset += entries[i].len + 1U;
+    }
+
+    qsort(entries, n_entries, sizeof(PathEntry), compare_entries);
+
+    free(listing->entries);
+    free(listing->text);
+    listing->text = text;
+    listing->entries = entries;
+    listing->n_entries = n_entries;
+    return COMLIN_SUCCESS;
+}
+
+/* Return true if a listing is of a directory and still up to date.
+ *
+ * Modification times have a coarse resolution on many filesystems, so a
+ * directory could be modified again without changing its time, just after
+ * being listed.  Such a racy listing is still used, but is read again once
+ * on the first lookup after the clock has moved on, to catch any such change.
+ */
+static bool
+is_current(PathListing const* const listing,
+           char const* const path,
+           struct stat const* const st,
+           struct timespec const now)
+{
+    return listing->path && !strcmp(listing->path, path) &&
+           listing->dev == st->st_dev && listing->ino == st->st_ino &&
+           times_equal(listing->mtime, path_mtime(st)) &&
+           (!listing->racy || now.tv_sec <= listing->mtime.tv_sec + 1);
+}
+
+// Return the listing of a directory, reading it if necessary
+static PathListing*
+get_listing(PathCache* const cache,
+            char const* const path,
+            ComlinStatus* const status)
+{
+    struct stat st;
+    if (stat(path, &st) || !S_ISDIR(st.st_mode)) {
+        *status = COMLIN_NO_FILE;
+        return NULL;
+    }
+
+    // Find the listing for this path, or the least recently used one
+    PathListing* listing = &cache->listings[0];
+    for (size_t i = 0U; i < N_LISTINGS; ++i) {
+        PathListing* const l = &cache->listings[i];
+        if (l->path && !strcmp(l->path, path)) {
+            listing = l;
+            break;
+        }
+
+        if (l->last_used < listing->last_used) {
+            listing = l;
+        }
+    }
+
+    // Read the directory if it isn't cached or has been modified since
+    struct timespec now = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (!is_current(listing, path, &st, now)) {
+        if (!listing->path || strcmp(listing->path, path)) {
+            size_t const len = strlen(path);
+            free_listing(listing);
+            if (!(listing->path = (char*)malloc(len + 1U))) {
+                *status = COMLIN_NO_MEMORY;
+                return NULL;
+            }
+
+            memcpy(listing->path, path, len + 1U);
+        }
+
+        if ((*status = read_listing(listing, path))) {
+            free_listing(listing);
+            return NULL;
+        }
+
+        listing->dev = st.st_dev;
+        listing->ino = st.st_ino;
+        listing->mtime = path_mtime(&st);
+        listing->racy = now.tv_sec <= listing->mtime.tv_sec + 1;
+    }
+
+    listing->last_used = ++cache->clock;
+    *status = COMLIN_SUCCESS;
+    return listing;
+}
+
+ComlinStatus
+path_cache_find(PathCache* const cache,
+                char const* const dir,
+                char const* const prefix,
+                size_t const len,
+                PathEntry const** const entries,
+                size_t* const n_entries)
+{
+    *entries = NULL;
+    *n_entries = 0U;
+
+    ComlinStatus st = COMLIN_SUCCESS;
+    PathListing const* const listing = get_listing(cache, dir, &st);
+    if (!listing || !listing->n_entries) {
+        return st;
+    }
+
+    // Find the first entry that isn't less than the prefix
+    size_t lo = 0U;
+    size_t hi = listing->n_entries;
+    while (lo < hi) {
+        size_t const mid = lo + ((hi - lo) / 2U);
+        if (strncmp(listing->entries[mid].name, prefix, len) < 0) {
+            lo = mid + 1U;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // Find the end of the entries that start with the prefix
+    size_t end = lo;
+    hi = listing->n_entries;
+    while (end < hi) {
+        size_t const mid = end + ((hi - end) / 2U);
+        if (strncmp(listing->entries[mid].name, prefix, len) <= 0) {
+            end = mid + 1U;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *entries = listing->entries + lo;
+    *n_entries = end - lo;
+    return COMLIN_SUCCESS;
+}
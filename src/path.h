@@ -0,0 +1,66 @@
+// Copyright 2023 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef COMLIN_SRC_PATH_H
+#define COMLIN_SRC_PATH_H
+
+#include "comlin/comlin.h"
+
+#include <sys/stat.h>
+
+#include <stddef.h>
+#include <time.h>
+
+/* A cache of directory listings for path completion.
+ *
+ * Each listing is read once, sorted, and kept until the modification time of
+ * the directory changes, so completing a path only needs to stat the
+ * directory, then find the entries that start with a prefix with a binary
+ * search.  Only a few of the most recently used directories are kept.
+ */
+
+/// Return the modification time of a file with nanoseconds
+struct timespec
+path_mtime(struct stat const* st);
+
+/// A directory entry in a listing
+typedef struct {
+    char* name; ///< Name, with a trailing slash for directories
+    size_t len; ///< Length of name
+} PathEntry;
+
+/// A cache of directory listings
+typedef struct PathCacheImpl PathCache;
+
+/// Return a new empty path cache, or null on allocation failure
+PathCache*
+path_cache_new(void);
+
+/// Free a path cache
+void
+path_cache_free(PathCache* cache);
+
+/** Find the entries in a directory that start with a prefix.
+ *
+ * The directory is only read if it isn't in the cache, or has been modified
+ * since it was cached.  The found entries are sorted, and are valid until
+ * the next call.
+ *
+ * @param cache The cache of directory listings.
+ * @param dir Path of the directory.
+ * @param prefix Start of entry names to find, which needn't be terminated.
+ * @param len Length of prefix.
+ * @param[out] entries Set to the first matching entry.
+ * @param[out] n_entries Set to the number of matching entries.
+ * @return #COMLIN_SUCCESS, #COMLIN_NO_FILE if the directory can't be read,
+ * or #COMLIN_NO_MEMORY.
+ */
+ComlinStatus
+path_cache_find(PathCache* cache,
+                char const* dir,
+                char const* prefix,
+                size_t len,
+                PathEntry const** entries,
+                size_t* n_entries);
+
+#endif // COMLIN_SRC_PATH_H
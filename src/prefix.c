@@ -0,0 +1,757 @@
+// Copyright 2023 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "prefix.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct PrefixNodeImpl {
+    struct PrefixNodeImpl* child; ///< First child
+    struct PrefixNodeImpl* next;  ///< Next sibling
+    char* label;                  ///< Bytes on the edge to this node
+    size_t label_len;             ///< Length of label
+    size_t count;                 ///< Number of strings that end here
+    uint64_t last;                ///< Sequence number of string that ends here
+    uint64_t best;                ///< Greatest sequence number in subtree
+};
+
+typedef struct PrefixNodeImpl PrefixNode;
+
+static PrefixNode*
+new_node(char const* const label, size_t const label_len)
+{
+    PrefixNode* const node = (PrefixNode*)calloc(1, sizeof(PrefixNode));
+    if (node && label_len) {
+        if (!(node->label = (char*)malloc(label_len))) {
+            free(node);
+            return NULL;
+        }
+
+        memcpy(node->label, label, label_len);
+        node->label_len = label_len;
+    }
+
+    return node;
+}
+
+static void
+free_node(PrefixNode* const node)
+{
+    free(node->label);
+    free(node);
+}
+
+// Return the link to the child whose label starts with `c`, or to null
+static PrefixNode**
+find_link(PrefixNode* const node, char const c)
+{
+    PrefixNode** link = &node->child;
+    while (*link && (*link)->label[0] != c) {
+        link = &(*link)->next;
+    }
+
+    return link;
+}
+
+static PrefixNode const*
+find_child(PrefixNode const* const node, char const c)
+{
+    PrefixNode const* child = node->child;
+    while (child && child->label[0] != c) {
+        child = child->next;
+    }
+
+    return child;
+}
+
+// Recalculate the greatest sequence number in the subtree under a node
+static void
+update_best(PrefixNode* const node)
+{
+    node->best = node->count ? node->last : 0U;
+    for (PrefixNode const* c = node->child; c; c = c->next) {
+        if (c->best > node->best) {
+            node->best = c->best;
+        }
+    }
+}
+
+// Merge a node that no strings end at with its only child
+static void
+merge_child(PrefixNode* const node)
+{
+    PrefixNode* const child = node->child;
+    size_t const len = node->label_len + child->label_len;
+    char* const label = (char*)realloc(node->label, len);
+    if (!label) {
+        return; // Leave the tree uncompressed, which is still correct
+    }
+
+    memcpy(label + node->label_len, child->label, child->label_len);
+    node->child = child->child;
+    node->label = label;
+    node->label_len = len;
+    node->count = child->count;
+    node->last = child->last;
+    node->best = child->best;
+    free_node(child);
+}
+
+PrefixIndex*
+prefix_index_new(void)
+{
+    return new_node(NULL, 0U);
+}
+
+void
+prefix_index_free(PrefixIndex* const index)
+{
+    /* Free nodes from a list that starts with the root, moving the children of
+     * each node to the front of the rest of the list before freeing it.  This
+     * avoids recursion without allocating a stack to free memory. */
+    PrefixNode* node = index;
+    while (node) {
+        if (node->child) {
+            PrefixNode* last = node->child;
+            while (last->next) {
+                last = last->next;
+            }
+
+            last->next = node->next;
+            node->next = node->child;
+        }
+
+        PrefixNode* const next = node->next;
+        free_node(node);
+        node = next;
+    }
+}
+
+bool
+prefix_index_insert(PrefixIndex* const index,
+                    char const* const text,
+                    size_t const len,
+                    uint64_t const seq)
+{
+    PrefixNode* node = index;
+    size_t pos = 0U;
+    while (pos < len) {
+        PrefixNode** const link = find_link(node, text[pos]);
+        PrefixNode* child = *link;
+        if (!child) {
+            // Add a new leaf for the rest of the string
+            if (!(child = new_node(text + pos, len - pos))) {
+                return false;
+            }
+
+            child->next = node->child;
+            node->child = child;
+            node = child;
+            break;
+        }
+
+        // Find the length of the common prefix with the child's label
+        size_t common = 0U;
+        while (common < child->label_len && pos + common < len &&
+               child->label[common] == text[pos + common]) {
+            ++common;
+        }
+
+        if (common < child->label_len) {
+            // Split the child's edge with a new node at the end of the prefix
+            PrefixNode* const mid = new_node(child->label, common);
+            if (!mid) {
+                return false;
+            }
+
+            mid->best = child->best;
+            mid->child = child;
+            mid->next = child->next;
+            child->next = NULL;
+            child->label_len -= common;
+            memmove(child->label, child->label + common, child->label_len);
+            *link = mid;
+            child = mid;
+        }
+
+        node = child;
+        pos += common;
+    }
+
+    ++node->count;
+    if (seq > node->last) {
+        node->last = seq;
+    }
+
+    // Update the greatest sequence number along the now complete path
+    node = index;
+    pos = 0U;
+    while (node) {
+        if (seq > node->best) {
+            node->best = seq;
+        }
+
+        // The path was just inserted, so every node along it exists
+        pos += node->label_len;
+        node = (pos < len) ? *find_link(node, text[pos]) : NULL;
+        assert(node || pos >= len);
+    }
+
+    return true;
+}
+
+// Remove a string from under a node, returning true if it was found
+static bool
+remove_from(PrefixNode* const node, char const* const text, size_t const len)
+{
+    if (!len) {
+        if (!node->count) {
+            return false;
+        }
+
+        if (!--node->count) {
+            node->last = 0U;
+        }
+
+        update_best(node);
+        return true;
+    }
+
+    PrefixNode** const link = find_link(node, text[0]);
+    PrefixNode* const child = *link;
+    if (!child || child->label_len > len ||
+        memcmp(child->label, text, child->label_len) ||
+        !remove_from(child, text + child->label_len, len - child->label_len)) {
+        return false;
+    }
+
+    if (!child->count && !child->child) {
+        *link = child->next;
+        free_node(child);
+    } else if (!child->count && !child->child->next) {
+        merge_child(child);
+    }
+
+    update_best(node);
+    return true;
+}
+
+void
+prefix_index_remove(PrefixIndex* const index,
+                    char const* const text,
+                    size_t const len)
+{
+    remove_from(index, text, len);
+}
+
+// Append to a suffix with snprintf semantics
+static size_t
+append(char* const suffix,
+       size_t const size,
+       size_t const offset,
+       char const* const text,
+       size_t const len)
+{
+    if (len && offset + 1U < size) {
+        size_t const n = (len < size - offset - 1U) ? len : size - offset - 1U;
+        memcpy(suffix + offset, text, n);
+    }
+
+    return offset + len;
+}
+
+// Return true if a label matches `n` bytes at `pos` in a prefix in two parts
+static bool
+label_matches(char const* const label,
+              size_t const n,
+              char const* const head,
+              size_t const head_len,
+              char const* const tail,
+              size_t const pos)
+{
+    if (pos >= head_len) {
+        return !memcmp(label, tail + (pos - head_len), n);
+    }
+
+    size_t const in_head = (n < head_len - pos) ? n : head_len - pos;
+    return !memcmp(label, head + pos, in_head) &&
+           (in_head == n || !memcmp(label + in_head, tail, n - in_head));
+}
+
+/* Find the node where a prefix ends, and how much of its label is in it.
+ *
+ * The prefix is `head` followed by `tail`, so text that is stored in two
+ * parts can be used without joining it first.
+ */
+static PrefixNode const*
+find_prefix(PrefixNode const* const index,
+            char const* const head,
+            size_t const head_len,
+            char const* const tail,
+            size_t const tail_len,
+            size_t* const skip)
+{
+    PrefixNode const* node = index;
+    size_t const len = head_len + tail_len;
+    size_t pos = 0U;
+    *skip = 0U;
+    while (pos < len) {
+        char const c = (pos < head_len) ? head[pos] : tail[pos - head_len];
+        PrefixNode const* const child = find_child(node, c);
+        if (!child) {
+            return NULL;
+        }
+
+        size_t const rest = len - pos;
+        *skip = child->label_len < rest ? child->label_len : rest;
+        if (!label_matches(child->label, *skip, head, head_len, tail, pos)) {
+            return NULL;
+        }
+
+        node = child;
+        pos += *skip;
+    }
+
+    return node->best ? node : NULL;
+}
+
+uint64_t
+prefix_index_find(PrefixIndex const* const index,
+                  char const* const text,
+                  size_t const len)
+{
+    size_t skip = 0U;
+    PrefixNode const* const node =
+      find_prefix(index, text, len, NULL, 0U, &skip);
+
+    return (node && skip == node->label_len && node->count) ? node->last : 0U;
+}
+
+size_t
+prefix_index_suggest(PrefixIndex const* const index,
+                     char const* const head,
+                     size_t const head_len,
+                     char const* const tail,
+                     size_t const tail_len,
+                     char* const suffix,
+                     size_t const size)
+{
+    size_t skip = 0U;
+    PrefixNode const* node =
+      find_prefix(index, head, head_len, tail, tail_len, &skip);
+    if (!node) {
+        return 0U;
+    }
+
+    // Follow the greatest sequence number down to where that string ends
+    size_t n = node->label_len > skip ? append(suffix,
+                                               size,
+                                               0U,
+                                               node->label + skip,
+                                               node->label_len - skip)
+                                      : 0U;
+    while (!node->count || node->last != node->best) {
+        PrefixNode const* child = node->child;
+        while (child && child->best != node->best) {
+            child = child->next;
+        }
+
+        if (!child) {
+            return 0U;
+        }
+
+        n = append(suffix, size, n, child->label, child->label_len);
+        node = child;
+    }
+
+    if (size) {
+        suffix[n < size ? n : size - 1U] = '\0';
+    }
+
+    return n;
+}
+
+/* A pending item in a best-first search.
+ *
+ * This is either a whole subtree, or only the string that ends at the node,
+ * where the text of the string so far is stored in a shared buffer.
+ */
+typedef struct {
+    PrefixNode const* node; ///< Node at the end of the text
+    uint64_t key;           ///< Greatest sequence number of the item
+    size_t offset;          ///< Offset of text in the buffer
+    size_t length;          ///< Length of text including the node's label
+    bool whole;             ///< True if this is just the string at the node
+} SearchItem;
+
+// A binary max-heap of search items, with a buffer for their text
+typedef struct {
+    SearchItem* items; ///< Heap of items
+    size_t n_items;    ///< Number of items in heap
+    size_t capacity;   ///< Number of items allocated
+    char* text;        ///< Text of all items
+    size_t text_len;   ///< Length of text
+    size_t text_size;  ///< Size of allocated text
+} SearchHeap;
+
+static bool
+heap_push(SearchHeap* const heap, SearchItem const item)
+{
+    if (heap->n_items == heap->capacity) {
+        size_t const capacity = heap->capacity ? heap->capacity * 2U : 16U;
+        SearchItem* const items =
+          (SearchItem*)realloc(heap->items, capacity * sizeof(SearchItem));
+        if (!items) {
+            return false;
+        }
+
+        heap->items = items;
+        heap->capacity = capacity;
+    }
+
+    // Sift the new item up to its place
+    size_t i = heap->n_items++;
+    while (i && heap->items[(i - 1U) / 2U].key < item.key) {
+        heap->items[i] = heap->items[(i - 1U) / 2U];
+        i = (i - 1U) / 2U;
+    }
+
+    heap->items[i] = item;
+    return true;
+}
+
+static SearchItem
+heap_pop(SearchHeap* const heap)
+{
+    SearchItem const top = heap->items[0];
+    SearchItem const last = heap->items[--heap->n_items];
+
+    // Sift the last item down from the top to its place
+    size_t i = 0U;
+    for (size_t c = 1U; c < heap->n_items; c = (2U * i) + 1U) {
+        if (c + 1U < heap->n_items &&
+            heap->items[c + 1U].key > heap->items[c].key) {
+            ++c;
+        }
+
+        if (heap->items[c].key <= last.key) {
+            break;
+        }
+
+        heap->items[i] = heap->items[c];
+        i = c;
+    }
+
+    heap->items[i] = last;
+    return top;
+}
+
+// Reserve space for more text in the heap's buffer
+static bool
+heap_reserve(SearchHeap* const heap, size_t const len)
+{
+    if (heap->text_len + len > heap->text_size) {
+        size_t size = heap->text_size ? heap->text_size : 256U;
+        while (size < heap->text_len + len) {
+            size *= 2U;
+        }
+
+        char* const text = (char*)realloc(heap->text, size);
+        if (!text) {
+            return false;
+        }
+
+        heap->text = text;
+        heap->text_size = size;
+    }
+
+    return true;
+}
+
+// Push a subtree whose text is the text of a parent item followed by a label
+static bool
+heap_push_subtree(SearchHeap* const heap,
+                  PrefixNode const* const node,
+                  size_t const parent_offset,
+                  size_t const parent_length,
+                  char const* const label,
+                  size_t const label_len)
+{
+    size_t const offset = heap->text_len;
+    if (!heap_reserve(heap, parent_length + label_len)) {
+        return false;
+    }
+
+    if (parent_length) {
+        memcpy(heap->text + offset, heap->text + parent_offset, parent_length);
+    }
+
+    if (label_len) {
+        memcpy(heap->text + offset + parent_length, label, label_len);
+    }
+
+    heap->text_len += parent_length + label_len;
+
+    SearchItem const item = {
+      node, node->best, offset, parent_length + label_len, false};
+
+    return heap_push(heap, item);
+}
+
+size_t
+prefix_index_visit(PrefixIndex const* const index,
+                   char const* const prefix,
+                   size_t const len,
+                   size_t const max,
+                   PrefixVisitFunc const visit,
+                   void* const data)
+{
+    size_t skip = 0U;
+    PrefixNode const* const start =
+      find_prefix(index, prefix, len, NULL, 0U, &skip);
+    if (!start) {
+        return 0U;
+    }
+
+    // Start with the subtree at the end of the prefix
+    SearchHeap heap = {NULL, 0U, 0U, NULL, 0U, 0U};
+    bool ok = heap_reserve(&heap, len);
+    if (ok && len) {
+        memcpy(heap.text, prefix, len);
+        heap.text_len = len;
+    }
+
+    size_t const rest = start->label_len - skip;
+    char const* const label = rest ? start->label + skip : NULL;
+    ok = ok && heap_push_subtree(&heap, start, 0U, len, label, rest);
+
+    /* Expand items in order of their greatest sequence number, so strings
+     * are visited newest first without visiting the whole subtree. */
+    size_t n_visited = 0U;
+    while (ok && heap.n_items && n_visited < max) {
+        SearchItem const item = heap_pop(&heap);
+        if (item.whole) {
+            visit(data, heap.text + item.offset, item.length);
+            ++n_visited;
+            continue;
+        }
+
+        if (item.node->count) {
+            SearchItem const whole = {
+              item.node, item.node->last, item.offset, item.length, true};
+
+            ok = heap_push(&heap, whole);
+        }
+
+        for (PrefixNode const* c = item.node->child; ok && c; c = c->next) {
+            ok = heap_push_subtree(
+              &heap, c, item.offset, item.length, c->label, c->label_len);
+        }
+    }
+
+    free(heap.items);
+    free(heap.text);
+    return n_visited;
+}
+
+static void
+encode_u64(char* const bytes, uint64_t const value)
+{
+    for (unsigned i = 0U; i < 8U; ++i) {
+        bytes[i] = (char)((value >> (8U * i)) & 0xFFU);
+    }
+}
+
+static uint64_t
+decode_u64(char const* const bytes)
+{
+    unsigned char const* const b = (unsigned char const*)bytes;
+    uint64_t value = 0U;
+    for (unsigned i = 0U; i < 8U; ++i) {
+        value |= (uint64_t)b[i] << (8U * i);
+    }
+
+    return value;
+}
+
+// Size of a serialised node without its label
+static size_t const node_header_size = 40U;
+
+// Write a node without its children if there is room, and return its size
+static size_t
+write_node(PrefixNode const* const node, char* const buf, size_t const size)
+{
+    size_t n_children = 0U;
+    for (PrefixNode const* c = node->child; c; c = c->next) {
+        ++n_children;
+    }
+
+    size_t const len = node_header_size + node->label_len;
+    if (len <= size) {
+        encode_u64(buf, node->label_len);
+        encode_u64(buf + 8U, node->count);
+        encode_u64(buf + 16U, node->last);
+        encode_u64(buf + 24U, node->best);
+        encode_u64(buf + 32U, n_children);
+        if (node->label_len) {
+            memcpy(buf + node_header_size, node->label, node->label_len);
+        }
+    }
+
+    return len;
+}
+
+size_t
+prefix_index_serialise(PrefixIndex const* const index,
+                       char* const buf,
+                       size_t const size)
+{
+    /* Write nodes in preorder, with an explicit stack to limit recursion.
+     * Each entry is the next sibling to write at that depth, or null. */
+    size_t depth = 0U;
+    size_t capacity = 16U;
+    PrefixNode const** stack =
+      (PrefixNode const**)malloc(capacity * sizeof(PrefixNode const*));
+    if (!stack) {
+        return 0U;
+    }
+
+    size_t total = 0U;
+    stack[depth++] = index;
+    while (depth) {
+        PrefixNode const* const node = stack[depth - 1U];
+        if (!node) {
+            --depth;
+            continue;
+        }
+
+        // Write the node, or just measure it if there's no room
+        stack[depth - 1U] = node->next;
+        total += (total < size) ? write_node(node, buf + total, size - total)
+                                : write_node(node, NULL, 0U);
+
+        if (depth == capacity) {
+            capacity *= 2U;
+            PrefixNode const** const new_stack = (PrefixNode const**)realloc(
+              stack, capacity * sizeof(PrefixNode const*));
+            if (!new_stack) {
+                free(stack);
+                return 0U;
+            }
+
+            stack = new_stack;
+        }
+
+        stack[depth++] = node->child;
+    }
+
+    free(stack);
+    return total;
+}
+
+// A node being deserialised, with the number of children left to read
+typedef struct {
+    PrefixNode* node;      ///< Node
+    PrefixNode** link;     ///< Link to set to the next child
+    uint64_t n_remaining;  ///< Number of children left to read
+} PendingNode;
+
+// Read a serialised node, or return null if it's invalid or truncated
+static PrefixNode*
+read_node(char const* const data,
+          size_t const size,
+          size_t* const offset,
+          uint64_t* const n_children)
+{
+    if (size - *offset < node_header_size) {
+        return NULL;
+    }
+
+    char const* const header = data + *offset;
+    uint64_t const label_len = decode_u64(header);
+    size_t const rest = size - *offset - node_header_size;
+    if (label_len > rest) {
+        return NULL;
+    }
+
+    PrefixNode* const node =
+      new_node(header + node_header_size, (size_t)label_len);
+    if (node) {
+        node->count = (size_t)decode_u64(header + 8U);
+        node->last = decode_u64(header + 16U);
+        node->best = decode_u64(header + 24U);
+        *n_children = decode_u64(header + 32U);
+        *offset += node_header_size + (size_t)label_len;
+    }
+
+    return node;
+}
+
+PrefixIndex*
+prefix_index_deserialise(char const* const data,
+                         size_t const size,
+                         size_t* const used)
+{
+    size_t offset = 0U;
+    uint64_t n_children = 0U;
+    PrefixNode* const root = read_node(data, size, &offset, &n_children);
+    if (!root) {
+        return NULL;
+    }
+
+    // Read children in preorder, with an explicit stack to limit recursion
+    size_t depth = 0U;
+    size_t capacity = 16U;
+    PendingNode* stack = (PendingNode*)malloc(capacity * sizeof(PendingNode));
+    bool ok = stack;
+    if (ok) {
+        PendingNode const top = {root, &root->child, n_children};
+        stack[depth++] = top;
+    }
+
+    while (ok && depth) {
+        PendingNode* const parent = &stack[depth - 1U];
+        if (!parent->n_remaining) {
+            --depth;
+            continue;
+        }
+
+        --parent->n_remaining;
+        PrefixNode* const node = read_node(data, size, &offset, &n_children);
+        if (!(ok = node && node->label_len)) {
+            free(node);
+            break;
+        }
+
+        *parent->link = node;
+        parent->link = &node->next;
+
+        if (depth == capacity) {
+            capacity *= 2U;
+            PendingNode* const new_stack =
+              (PendingNode*)realloc(stack, capacity * sizeof(PendingNode));
+            if (!(ok = new_stack)) {
+                break;
+            }
+
+            stack = new_stack;
+        }
+
+        PendingNode const pending = {node, &node->child, n_children};
+        stack[depth++] = pending;
+    }
+
+    free(stack);
+    if (!ok) {
+        prefix_index_free(root);
+        return NULL;
+    }
+
+    *used = offset;
+    return root;
+}
@@ -0,0 +1,123 @@
+// Copyright 2023 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef COMLIN_SRC_PREFIX_H
+#define COMLIN_SRC_PREFIX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A prefix index of strings.
+ *
+ * This is a radix tree where every string is inserted with a sequence number,
+ * and each node records the greatest sequence number beneath it.  This makes
+ * finding the string with the greatest sequence number that starts with a
+ * given prefix take time proportional to the length of the result, regardless
+ * of how many strings are in the index.
+ */
+
+/// A prefix index, which is the root node of the tree
+typedef struct PrefixNodeImpl PrefixIndex;
+
+/// Return a new empty prefix index, or null on allocation failure
+PrefixIndex*
+prefix_index_new(void);
+
+/// Free a prefix index
+void
+prefix_index_free(PrefixIndex* index);
+
+/** Insert a string into a prefix index.
+ *
+ * A string may be inserted several times, in which case it has the greatest
+ * sequence number it was inserted with.
+ *
+ * @return True on success, or false if memory allocation failed.
+ */
+bool
+prefix_index_insert(PrefixIndex* index,
+                    char const* text,
+                    size_t len,
+                    uint64_t seq);
+
+/** Remove one instance of a string from a prefix index.
+ *
+ * If the string was inserted several times, then it keeps its greatest
+ * sequence number until every instance has been removed.
+ */
+void
+prefix_index_remove(PrefixIndex* index, char const* text, size_t len);
+
+/** Find a string in a prefix index.
+ *
+ * @return The greatest sequence number the string was inserted with, or zero
+ * if it isn't in the index.
+ */
+uint64_t
+prefix_index_find(PrefixIndex const* index, char const* text, size_t len);
+
+/** Find the most recent string that extends a prefix.
+ *
+ * This finds the string with the greatest sequence number that starts with
+ * the prefix, and writes the rest of it to `suffix`.  The prefix is given in
+ * two parts, `head` then `tail`, so text with a gap in it can be used as it
+ * is.  Like snprintf, at most `size` bytes are written including a null
+ * terminator, and the full length is returned.
+ *
+ * @return The length of the suffix, or zero if there is no such string or it
+ * is equal to the prefix.
+ */
+size_t
+prefix_index_suggest(PrefixIndex const* index,
+                     char const* head,
+                     size_t head_len,
+                     char const* tail,
+                     size_t tail_len,
+                     char* suffix,
+                     size_t size);
+
+/// A function called with a string found in a prefix index
+typedef void (*PrefixVisitFunc)(void* data, char const* text, size_t len);
+
+/** Visit the most recent strings that start with a prefix.
+ *
+ * Strings are visited in order from greatest to least sequence number, with
+ * each distinct string visited once.  This only expands as much of the tree
+ * as necessary to find `max` strings.
+ *
+ * @return The number of strings visited.
+ */
+size_t
+prefix_index_visit(PrefixIndex const* index,
+                   char const* prefix,
+                   size_t len,
+                   size_t max,
+                   PrefixVisitFunc visit,
+                   void* data);
+
+/** Serialise a prefix index to a buffer.
+ *
+ * Like snprintf, this returns the required size, so it can be called with a
+ * null buffer to measure the index, and the output is only complete if the
+ * returned size is at most `size`.
+ * Nodes are written in preorder, with integers in little-endian order.
+ *
+ * @return The size of the serialised index in bytes, or zero if memory
+ * allocation failed.
+ */
+size_t
+prefix_index_serialise(PrefixIndex const* index, char* buf, size_t size);
+
+/** Deserialise a prefix index written by #prefix_index_serialise.
+ *
+ * @param data The serialised index, which may be followed by other data.
+ * @param size The number of bytes available at `data`.
+ * @param[out] used Set to the size of the serialised index.
+ * @return A new index, or null if the data is invalid or memory allocation
+ * failed.
+ */
+PrefixIndex*
+prefix_index_deserialise(char const* data, size_t size, size_t* used);
+
+#endif // COMLIN_SRC_PREFIX_H
@@ -0,0 +1,45 @@
+// Copyright 2023 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "token.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+bool
+token_is_space(char const c)
+{
+    return c == ' ' || c == '\t';
+}
+
+size_t
+token_next(char const* const text, size_t const len, size_t* const pos)
+{
+    size_t i = *pos;
+    while (i < len && token_is_space(text[i])) {
+        ++i;
+    }
+
+    *pos = i;
+    while (i < len && !token_is_space(text[i])) {
+        ++i;
+    }
+
+    return i - *pos;
+}
+
+size_t
+token_last(char const* const text, size_t const len)
+{
+    size_t end = len;
+    while (end && token_is_space(text[end - 1U])) {
+        --end;
+    }
+
+    size_t start = end;
+    while (start && !token_is_space(text[start - 1U])) {
+        --start;
+    }
+
+    return start;
+}
@@ -0,0 +1,29 @@
+// Copyright 2023 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef COMLIN_SRC_TOKEN_H
+#define COMLIN_SRC_TOKEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Splitting lines into tokens.
+ *
+ * Tokens are separated by spaces or tabs, and have no quoting or escaping.
+ * This is shared by completion, history words, and grammars, so they all
+ * agree on what a token is.
+ */
+
+/// Return true if a character separates tokens
+bool
+token_is_space(char c);
+
+/// Find the next token in text at or after `*pos` and return its length
+size_t
+token_next(char const* text, size_t len, size_t* pos);
+
+/// Return the start of the last token in text, or `len` if there is none
+size_t
+token_last(char const* text, size_t len);
+
+#endif // COMLIN_SRC_TOKEN_H
@@ -12,7 +12,10 @@ typedef struct {
     char const* save_path;
     bool dumb;
     bool mask;
+    bool menu;
     bool multiline;
+    bool suggest;
+    bool words;
 } Options;
 
 static bool
@@ -30,6 +33,13 @@ completion(char const* const line, ComlinCompletions* const lc)
     } else if (starts_with(line, "second")) {
         comlin_add_completion(lc, "second");
         comlin_add_completion(lc, "secondish");
+    } else if (starts_with(line, "item")) {
+        char item[8] = {'i', 't', 'e', 'm', '0', '0', '\0', '\0'};
+        for (unsigned i = 1U; i <= 12U; ++i) {
+            item[4] = (char)('0' + (i / 10U));
+            item[5] = (char)('0' + (i % 10U));
+            comlin_add_completion(lc, item);
+        }
     }
 }
 
@@ -43,9 +53,12 @@ print_usage(char const* const name, bool const error)
       "  --dumb          Force dumb terminal mode.\n"
       "  --help          Display this help and exit.\n"
       "  --mask          Use mask mode.\n"
+      "  --menu          Show completions in a menu.\n"
       "  --multi         Use multi-line mode.\n"
       "  --restore FILE  Load history from FILE before run.\n"
-      "  --save FILE     Save history to FILE after run.\n";
+      "  --save FILE     Save history to FILE after run.\n"
+      "  --suggest       Suggest lines from history.\n"
+      "  --words         Complete words from history.\n";
 
     FILE* const os = error ? stderr : stdout;
     fprintf(os, "%s", error ? "\n" : "");
@@ -65,7 +78,10 @@ static int
 run(int const ifd, int const ofd, Options const opts)
 {
     bool const mask = opts.mask;
+    bool const menu = opts.menu;
     bool const multiline = opts.multiline;
+    bool const suggest = opts.suggest;
+    bool const words = opts.words;
     char const* const restore_path = opts.restore_path;
     char const* const save_path = opts.save_path;
 
@@ -75,7 +91,10 @@ run(int const ifd, int const ofd, Options const opts)
     comlin_set_completion_callback(state, completion);
     comlin_set_mode(state,
                     (mask ? COMLIN_MODE_MASKED : 0U) |
-                      (multiline ? COMLIN_MODE_MULTI_LINE : 0U));
+                      (menu ? COMLIN_MODE_COMPLETION_MENU : 0U) |
+                      (multiline ? COMLIN_MODE_MULTI_LINE : 0U) |
+                      (suggest ? COMLIN_MODE_AUTOSUGGEST : 0U) |
+                      (words ? COMLIN_MODE_HISTORY_WORDS : 0U));
 
     // Load initial history
     if (restore_path) {
@@ -113,7 +132,7 @@ int
 main(int const argc, char const* const* const argv)
 {
     // Parse command line options
-    Options opts = {NULL, NULL, false, false, false};
+    Options opts = {NULL, NULL, false, false, false, false, false, false};
     int a = 1;
     for (; a < argc && argv[a][0] == '-'; ++a) {
         if (!strcmp(argv[a], "--help")) {
@@ -124,8 +143,14 @@ main(int const argc, char const* const* const argv)
             opts.dumb = true;
         } else if (!strcmp(argv[a], "--mask")) {
             opts.mask = true;
+        } else if (!strcmp(argv[a], "--menu")) {
+            opts.menu = true;
         } else if (!strcmp(argv[a], "--multi")) {
             opts.multiline = true;
+        } else if (!strcmp(argv[a], "--suggest")) {
+            opts.suggest = true;
+        } else if (!strcmp(argv[a], "--words")) {
+            opts.words = true;
         } else if (!strcmp(argv[a], "--restore")) {
             if (++a == argc) {
                 return missing_arg(argv[0], "--restore");
@@ -0,0 +1,727 @@
+// Copyright 2023 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#undef NDEBUG
+
+#include "comlin/comlin.h"
+#include "test_utils.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t n_completion_calls = 0U;
+
+static void
+count_completions(char const* const buf, ComlinCompletions* const lc)
+{
+    ++n_completion_calls;
+    if (buf[0] == 'f') {
+        comlin_add_completion(lc, "first");
+        comlin_add_completion(lc, "firstish");
+    }
+}
+
+static void
+test_completion_cache(void)
+{
+    // Cycling through completions only gets them once
+    int fds[2] = {-1, -1};
+    ComlinState* const state = new_piped_state("f\t\t\tx\t\n", fds);
+    comlin_set_completion_callback(state, count_completions);
+    assert(!comlin_edit_start(state, "> "));
+    for (size_t i = 0U; i < 4U; ++i) {
+        assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    }
+
+    assert(n_completion_calls == 1U);
+
+    // Showing the line again uses the same completions
+    assert(!comlin_hide(state));
+    assert(!comlin_show(state));
+    assert(n_completion_calls == 1U);
+
+    // Changing the line gets new completions
+    assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "fx"));
+    assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    assert(n_completion_calls == 2U);
+    assert(comlin_edit_feed(state) == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(state), "first"));
+    assert(!comlin_edit_stop(state));
+    free_piped_state(state, fds);
+}
+
+static void
+test_completion_narrowing(void)
+{
+    // Extending the line filters the previous completions
+    int fds[2] = {-1, -1};
+    ComlinState* const state = new_piped_state("f\t\t\tirstis\t\n", fds);
+    comlin_set_completion_callback(state, count_completions);
+    assert(!comlin_set_mode(state, COMLIN_MODE_NARROWING));
+    n_completion_calls = 0U;
+    assert(!comlin_read_line(state, "> "));
+    assert(!strcmp(comlin_text(state), "firstish"));
+    assert(n_completion_calls == 1U);
+    free_piped_state(state, fds);
+}
+
+static void
+complete_range(char const* const line,
+               size_t const len,
+               size_t const pos,
+               ComlinCompletions* const lc)
+{
+    static char const* const words[] = {"first", "firstish", "second"};
+
+    ++n_completion_calls;
+    assert(pos == len);
+    assert(strlen(line) == len);
+
+    // Complete the word before the cursor, leaving the rest of the line
+    size_t start = pos;
+    while (start > 0U && line[start - 1U] != ' ') {
+        --start;
+    }
+
+    for (size_t i = 0U; i < sizeof(words) / sizeof(words[0]); ++i) {
+        if (!strncmp(words[i], line + start, pos - start)) {
+            assert(!comlin_add_completion_range(
+              lc, start, pos, words[i], strlen(words[i])));
+        }
+    }
+}
+
+static void
+complete_mixed(char const* const line,
+               size_t const len,
+               size_t const pos,
+               ComlinCompletions* const lc)
+{
+    (void)line;
+    (void)pos;
+
+    assert(!comlin_add_completion(lc, "one"));
+    assert(comlin_add_completion_range(lc, 2U, 1U, "x", 1U) ==
+           COMLIN_BAD_ARG);
+    assert(!comlin_add_completion_range(lc, 1U, len, "two", 3U));
+}
+
+static void
+test_range_completion(void)
+{
+    // Completions replace the word rather than the whole line
+    int fds[2] = {-1, -1};
+    ComlinState* state = new_piped_state("echo f\t\t\n", fds);
+    comlin_set_range_completion_callback(state, complete_range);
+    assert(!comlin_read_line(state, "> "));
+    assert(!strcmp(comlin_text(state), "echo firstish"));
+    free_piped_state(state, fds);
+
+    // Range completions can be narrowed as the word is extended
+    n_completion_calls = 0U;
+    state = new_piped_state("echo f\t\t\tirstis\t\n", fds);
+    comlin_set_range_completion_callback(state, complete_range);
+    assert(!comlin_set_mode(state, COMLIN_MODE_NARROWING));
+    assert(!comlin_read_line(state, "> "));
+    assert(!strcmp(comlin_text(state), "echo firstish"));
+    assert(n_completion_calls == 1U);
+    free_piped_state(state, fds);
+
+    // Whole line and range completions can be mixed
+    state = new_piped_state("ab\t\t\n", fds);
+    comlin_set_range_completion_callback(state, complete_mixed);
+    assert(!comlin_read_line(state, "> "));
+    assert(!strcmp(comlin_text(state), "atwo"));
+    free_piped_state(state, fds);
+
+    state = new_piped_state("ab\t\n", fds);
+    comlin_set_range_completion_callback(state, complete_mixed);
+    assert(!comlin_read_line(state, "> "));
+    assert(!strcmp(comlin_text(state), "one"));
+    free_piped_state(state, fds);
+}
+
+static void
+complete_long(char const* const buf, ComlinCompletions* const lc)
+{
+    if (buf[0] == 'c') {
+        comlin_add_completion(lc, "configuration-file-one");
+        comlin_add_completion(lc, "configuration-file-two");
+    }
+}
+
+static char const*
+read_prefix_line(char const* const input, bool const range)
+{
+    static char line[64];
+
+    int fds[2] = {-1, -1};
+    ComlinState* const state = new_piped_state(input, fds);
+    if (range) {
+        comlin_set_range_completion_callback(state, complete_range);
+    } else {
+        comlin_set_completion_callback(state, complete_long);
+    }
+
+    assert(!comlin_set_mode(state, COMLIN_MODE_COMMON_PREFIX));
+    assert(!comlin_read_line(state, "> "));
+    snprintf(line, sizeof(line), "%s", comlin_text(state));
+    free_piped_state(state, fds);
+    return line;
+}
+
+static void
+test_common_prefix(void)
+{
+    // The first Tab inserts the common prefix, and later ones cycle
+    assert(!strcmp(read_prefix_line("echo f\t\n", true), "echo first"));
+    assert(!strcmp(read_prefix_line("echo f\t\t\n", true), "echo first"));
+    assert(!strcmp(read_prefix_line("echo f\t\t\t\n", true),
+                   "echo firstish"));
+    assert(!strcmp(read_prefix_line("echo s\t\n", true), "echo second"));
+    assert(!strcmp(read_prefix_line("echo x\t\n", true), "echo x"));
+
+    // Long prefixes are found a word at a time
+    assert(!strcmp(read_prefix_line("c\t\n", false), "configuration-file-"));
+    assert(!strcmp(read_prefix_line("c\t\tt\n", false),
+                   "configuration-file-onet"));
+}
+
+static void
+complete_many(char const* const buf, ComlinCompletions* const lc)
+{
+    if (buf[0] == 'i') {
+        char item[8] = {'i', 't', 'e', 'm', '0', '0', '0', '\0'};
+        for (unsigned i = 0U; i < 1000U; ++i) {
+            item[4] = (char)('0' + (i / 100U));
+            item[5] = (char)('0' + ((i / 10U) % 10U));
+            item[6] = (char)('0' + (i % 10U));
+            assert(!comlin_add_completion(lc, item));
+        }
+    }
+}
+
+static void
+test_completion_menu(void)
+{
+    static char const* const path = "comlin_test_menu.txt";
+
+    char input[80] = {'i', '\t', '\t'};
+    memset(input + 3U, '\t', 64U);
+    input[67] = '\n';
+
+    int in[2] = {-1, -1};
+    assert(!pipe(in));
+    assert(write(in[1], input, strlen(input)) == (ssize_t)strlen(input));
+    assert(!close(in[1]));
+
+    int const out = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    assert(out >= 0);
+
+    ComlinState* const state = comlin_new_state(in[0], out, "vt100", 8U);
+    comlin_set_completion_callback(state, complete_many);
+    assert(!comlin_set_mode(state, COMLIN_MODE_COMPLETION_MENU));
+    assert(!comlin_edit_start(state, "> "));
+
+    // Only the first page is drawn, regardless of the number of completions
+    assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    off_t const start = lseek(out, 0, SEEK_CUR);
+    assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    off_t const shown = lseek(out, 0, SEEK_CUR);
+    assert(shown - start > 8 * 64);
+    assert(shown - start < 80 * 16);
+
+    // Moving the selection only repaints the line and two cells
+    assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    assert(lseek(out, 0, SEEK_CUR) - shown < 80);
+
+    // Cycling past the first page shows the next one
+    ComlinStatus st = COMLIN_EDITING;
+    while (st == COMLIN_EDITING) {
+        st = comlin_edit_feed(state);
+    }
+
+    assert(!st);
+    assert(!strcmp(comlin_text(state), "item065"));
+    assert(!comlin_edit_stop(state));
+
+    comlin_free_state(state);
+    assert(!close(in[0]));
+    assert(!close(out));
+    assert(!remove(path));
+}
+
+static size_t n_stream_calls = 0U;
+
+static bool
+stream_items(char const* const line,
+             size_t const offset,
+             size_t const count,
+             ComlinCompletions* const lc)
+{
+    assert(!strcmp(line, "i"));
+    assert(lc->len == offset);
+    ++n_stream_calls;
+
+    // Generate an endless sequence of items
+    char item[16];
+    for (size_t i = offset; i < offset + count; ++i) {
+        snprintf(item, sizeof(item), "item%05u", (unsigned)i);
+        assert(!comlin_add_completion(lc, item));
+    }
+
+    return true;
+}
+
+static char const*
+read_streamed_line(char const* const input,
+                   ComlinModeFlags const flags,
+                   size_t const limit)
+{
+    static char line[64];
+
+    int fds[2] = {-1, -1};
+    ComlinState* const state = new_piped_state(input, fds);
+    assert(comlin_set_stream_completion_callback(
+             state, stream_items, 0U, 10U) == COMLIN_BAD_ARG);
+    assert(!comlin_set_stream_completion_callback(
+      state, stream_items, 4U, limit));
+    assert(!comlin_set_mode(state, flags));
+
+    n_stream_calls = 0U;
+    assert(!comlin_read_line(state, "> "));
+    snprintf(line, sizeof(line), "%s", comlin_text(state));
+    free_piped_state(state, fds);
+    return line;
+}
+
+static void
+test_stream_completion(void)
+{
+    // Batches are only fetched when cycling past the last completion
+    assert(!strcmp(read_streamed_line("i\t\n", 0U, 10U), "item00000"));
+    assert(n_stream_calls == 1U);
+    assert(!strcmp(read_streamed_line("i\t\t\t\t\n", 0U, 10U), "item00003"));
+    assert(n_stream_calls == 1U);
+    assert(!strcmp(read_streamed_line("i\t\t\t\t\t\n", 0U, 10U), "item00004"));
+    assert(n_stream_calls == 2U);
+
+    // Streaming stops at the limit
+    assert(!strcmp(read_streamed_line("i\t\t\t\t\t\t\t\t\t\t\n", 0U, 10U),
+                   "item00009"));
+    assert(n_stream_calls == 3U);
+    assert(!strcmp(read_streamed_line("i\t\t\t\t\t\t\t\t\t\t\t\n", 0U, 10U),
+                   "i"));
+    assert(n_stream_calls == 3U);
+
+    // A limit of zero means there is no limit
+    assert(!strcmp(read_streamed_line("i\t\t\t\t\t\t\t\t\t\t\t\n", 0U, 0U),
+                   "item00010"));
+    assert(n_stream_calls == 3U);
+
+    // The common prefix of a partial set of completions isn't inserted
+    assert(!strcmp(read_streamed_line("i\t\n", COMLIN_MODE_COMMON_PREFIX, 10U),
+                   "item00000"));
+}
+
+static void
+touch(char const* const path)
+{
+    FILE* const file = fopen(path, "w");
+    assert(file);
+    assert(!fclose(file));
+}
+
+static char const*
+read_path_line(ComlinState* const state)
+{
+    static char line[64];
+
+    assert(!comlin_read_line(state, "> "));
+    snprintf(line, sizeof(line), "%s", comlin_text(state));
+    return line;
+}
+
+static void
+test_path_completion(void)
+{
+    assert(!mkdir("comlin_test_dir", 0700));
+    assert(!mkdir("comlin_test_dir/alpine", 0700));
+    touch("comlin_test_dir/alpha");
+    touch("comlin_test_dir/.hidden");
+
+    int fds[2] = {-1, -1};
+    ComlinState* const state = new_piped_state("x comlin_test_d\t\n"
+                                               "x comlin_test_dir/\t\t\n"
+                                               "x comlin_test_dir/alpi\t\n"
+                                               "x comlin_test_dir/.\t\n"
+                                               "x comlin_test_dir/n\t\n"
+                                               "x comlin_test_dir/n\t\n"
+                                               "x nonexistent/\t\n",
+                                               fds);
+
+    assert(!comlin_set_mode(state, COMLIN_MODE_PATHS));
+
+    // Entries are completed with a slash after directories
+    assert(!strcmp(read_path_line(state), "x comlin_test_dir/"));
+    assert(!strcmp(read_path_line(state), "x comlin_test_dir/alpine/"));
+    assert(!strcmp(read_path_line(state), "x comlin_test_dir/alpine/"));
+
+    // Hidden entries are only completed after a dot
+    assert(!strcmp(read_path_line(state), "x comlin_test_dir/.hidden"));
+
+    // Changes to the directory are noticed
+    assert(!strcmp(read_path_line(state), "x comlin_test_dir/n"));
+    touch("comlin_test_dir/new");
+    assert(!strcmp(read_path_line(state), "x comlin_test_dir/new"));
+
+    // Directories that can't be read have no completions
+    assert(!strcmp(read_path_line(state), "x nonexistent/"));
+
+    free_piped_state(state, fds);
+    assert(!remove("comlin_test_dir/new"));
+    assert(!remove("comlin_test_dir/.hidden"));
+    assert(!remove("comlin_test_dir/alpha"));
+    assert(!remove("comlin_test_dir/alpine"));
+    assert(!remove("comlin_test_dir"));
+}
+
+static char const*
+read_dictionary_line(char const* const input)
+{
+    static char const* const words[] = {"show", "set", "select", "set"};
+    static char line[64];
+
+    int fds[2] = {-1, -1};
+    ComlinState* const state = new_piped_state(input, fds);
+    assert(!comlin_set_dictionary(state, words, 4U));
+    assert(!comlin_read_line(state, "> "));
+    snprintf(line, sizeof(line), "%s", comlin_text(state));
+    assert(!comlin_set_dictionary(state, NULL, 0U));
+    free_piped_state(state, fds);
+    return line;
+}
+
+static void
+test_dictionary(void)
+{
+    assert(!strcmp(read_dictionary_line("se\t\n"), "select"));
+    assert(!strcmp(read_dictionary_line("se\t\t\n"), "set"));
+    assert(!strcmp(read_dictionary_line("se\t\t\t\t\n"), "select"));
+    assert(!strcmp(read_dictionary_line("x sh\t\n"), "x show"));
+    assert(!strcmp(read_dictionary_line("sh x\x1B[D\x1B[D\t\n"), "show x"));
+    assert(!strcmp(read_dictionary_line("set\t\n"), "set"));
+    assert(!strcmp(read_dictionary_line("z\t\n"), "z"));
+}
+
+static char const* const grammar_rules[] = {
+  "show tables",
+  "show table <name>",
+  "set mode (fast|slow)",
+  "count <int>",
+};
+
+static char const*
+read_grammar_line(ComlinGrammar const* const grammar, char const* const input)
+{
+    static char line[64];
+
+    int fds[2] = {-1, -1};
+    ComlinState* const state = new_piped_state(input, fds);
+    comlin_set_grammar(state, grammar);
+    assert(!comlin_read_line(state, "> "));
+    snprintf(line, sizeof(line), "%s", comlin_text(state));
+    free_piped_state(state, fds);
+    return line;
+}
+
+static void
+test_grammar(void)
+{
+    static char const* const bad_rules[] = {"", "(a|)", "<x", "()", "(a|b"};
+
+    for (size_t i = 0U; i < sizeof(bad_rules) / sizeof(char*); ++i) {
+        assert(!comlin_grammar_new(&bad_rules[i], 1U));
+    }
+
+    ComlinGrammar* const grammar = comlin_grammar_new(grammar_rules, 4U);
+    assert(grammar);
+
+    // Lines are checked against the grammar
+    assert(!comlin_grammar_check(grammar, "show tables", 11U));
+    assert(!comlin_grammar_check(grammar, " show  table t1 ", 16U));
+    assert(!comlin_grammar_check(grammar, "set mode slow", 13U));
+    assert(!comlin_grammar_check(grammar, "count -12", 9U));
+    assert(comlin_grammar_check(grammar, "", 0U) == COMLIN_EDITING);
+    assert(comlin_grammar_check(grammar, "set mode", 8U) == COMLIN_EDITING);
+    assert(comlin_grammar_check(grammar, "show table", 10U) == COMLIN_EDITING);
+    assert(comlin_grammar_check(grammar, "count x", 7U) == COMLIN_BAD_ARG);
+    assert(comlin_grammar_check(grammar, "set fast", 8U) == COMLIN_BAD_ARG);
+    assert(comlin_grammar_check(grammar, "shows", 5U) == COMLIN_BAD_ARG);
+
+    // Tab completes keywords that can follow the preceding tokens
+    assert(!strcmp(read_grammar_line(grammar, "sh\t\n"), "show"));
+    assert(!strcmp(read_grammar_line(grammar, "set mode f\t\n"),
+                   "set mode fast"));
+    assert(!strcmp(read_grammar_line(grammar, "set mode \t\t\n"),
+                   "set mode slow"));
+    assert(!strcmp(read_grammar_line(grammar, "show t\t\n"), "show table"));
+    assert(!strcmp(read_grammar_line(grammar, "count \t\n"), "count "));
+    assert(!strcmp(read_grammar_line(grammar, "set x f\t\n"), "set x f"));
+
+    comlin_grammar_free(grammar);
+
+    // Alternatives of an enumeration only lead to the rest of their rule
+    static char const* const enum_rules[] = {"x (a|b)", "x a y"};
+    ComlinGrammar* const enums = comlin_grammar_new(enum_rules, 2U);
+    assert(enums);
+    assert(!comlin_grammar_check(enums, "x a", 3U));
+    assert(!comlin_grammar_check(enums, "x b", 3U));
+    assert(!comlin_grammar_check(enums, "x a y", 5U));
+    assert(comlin_grammar_check(enums, "x b y", 5U) == COMLIN_BAD_ARG);
+    comlin_grammar_free(enums);
+
+    // A keyword can also be an argument of another rule
+    static char const* const arg_rules[] = {"x <name> z", "x foo"};
+    ComlinGrammar* const args = comlin_grammar_new(arg_rules, 2U);
+    assert(args);
+    assert(!comlin_grammar_check(args, "x foo", 5U));
+    assert(!comlin_grammar_check(args, "x foo z", 7U));
+    assert(!comlin_grammar_check(args, "x bar z", 7U));
+    assert(comlin_grammar_check(args, "x bar", 5U) == COMLIN_EDITING);
+    assert(comlin_grammar_check(args, "x foo z z", 9U) == COMLIN_BAD_ARG);
+    comlin_grammar_free(args);
+}
+
+static uint64_t requested_generation = 0U;
+static bool submit_immediately = false;
+
+static void
+request_completions(ComlinState* const state,
+                    uint64_t const generation,
+                    char const* const line)
+{
+    assert(!strcmp(line, "f"));
+    requested_generation = generation;
+    if (submit_immediately) {
+        ComlinCompletions lc = {0U, NULL};
+        assert(!comlin_add_completion(&lc, "fast"));
+        assert(!comlin_submit_completions(state, generation, &lc));
+        assert(!lc.len);
+    }
+}
+
+static void*
+submit_completions(void* const data)
+{
+    ComlinCompletions lc = {0U, NULL};
+    assert(!comlin_add_completion(&lc, "first"));
+    assert(!comlin_submit_completions(
+      (ComlinState*)data, requested_generation, &lc));
+    return NULL;
+}
+
+static void
+test_async_completion(void)
+{
+    // Completions submitted from another thread are shown on the next feed
+    int fds[2] = {-1, -1};
+    ComlinState* state = new_piped_state("f\t\n", fds);
+    comlin_set_completion_request_callback(state, request_completions);
+    assert(!comlin_edit_start(state, "> "));
+    assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    assert(!strcmp(comlin_text(state), "f"));
+    assert(!comlin_completion_status(state, requested_generation));
+
+    pthread_t thread;
+    assert(!pthread_create(&thread, NULL, submit_completions, state));
+    assert(!pthread_join(thread, NULL));
+    assert(comlin_edit_feed(state) == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(state), "first"));
+    assert(!comlin_edit_stop(state));
+    free_piped_state(state, fds);
+
+    // Typing ahead cancels the request
+    state = new_piped_state("f\tx\n", fds);
+    comlin_set_completion_request_callback(state, request_completions);
+    assert(!comlin_edit_start(state, "> "));
+    assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    uint64_t const generation = requested_generation;
+    assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    assert(comlin_completion_status(state, generation) == COMLIN_INTERRUPTED);
+
+    ComlinCompletions lc = {0U, NULL};
+    assert(!comlin_add_completion(&lc, "first"));
+    assert(comlin_submit_completions(state, generation, &lc) ==
+           COMLIN_INTERRUPTED);
+    assert(!lc.len);
+    assert(comlin_edit_feed(state) == COMLIN_SUCCESS);
+    assert(!strcmp(comlin_text(state), "fx"));
+    assert(!comlin_edit_stop(state));
+    free_piped_state(state, fds);
+
+    // Completions submitted by the request callback are shown immediately
+    submit_immediately = true;
+    state = new_piped_state("f\t\n", fds);
+    comlin_set_completion_request_callback(state, request_completions);
+    assert(!comlin_read_line(state, "> "));
+    assert(!strcmp(comlin_text(state), "fast"));
+    free_piped_state(state, fds);
+}
+
+static void
+test_add_completions(void)
+{
+    static size_t const n = 10000U;
+    static char const* const text = "abcdefghijklmnopqrstuvwxyz";
+
+    // Add many completions of different lengths, without terminators
+    ComlinCompletions lc = {0U, NULL};
+    for (size_t i = 0U; i < n; ++i) {
+        assert(!comlin_add_completion_len(&lc, text, i % 27U));
+    }
+
+    // Add one larger than any arena block so far
+    char* const big = (char*)calloc(1U, 65536U);
+    assert(big);
+    memset(big, 'x', 65535U);
+    assert(!comlin_add_completion(&lc, big));
+
+    assert(lc.len == n + 1U);
+    for (size_t i = 0U; i < n; ++i) {
+        assert(strlen(lc.cvec[i]) == i % 27U);
+        assert(!strncmp(lc.cvec[i], text, i % 27U));
+    }
+
+    assert(!strcmp(lc.cvec[n], big));
+
+    comlin_free_completions(&lc);
+    assert(!lc.len);
+    assert(!lc.cvec);
+    free(big);
+}
+
+static void
+complete_swapped(char const* const buf, ComlinCompletions* const lc)
+{
+    (void)buf;
+
+    assert(!comlin_add_completion(lc, "a"));
+    assert(!comlin_add_completion(lc, "abcdefghij"));
+
+    char* const first = lc->cvec[0];
+    lc->cvec[0] = lc->cvec[1];
+    lc->cvec[1] = first;
+}
+
+static void
+complete_swapped_range(char const* const line,
+                       size_t const len,
+                       size_t const pos,
+                       ComlinCompletions* const lc)
+{
+    (void)line;
+    (void)pos;
+
+    assert(!comlin_add_completion_range(lc, 1U, len, "bc", 2U));
+    assert(!comlin_add_completion(lc, "whole"));
+
+    char* const first = lc->cvec[0];
+    lc->cvec[0] = lc->cvec[1];
+    lc->cvec[1] = first;
+}
+
+static void
+test_reordered_completions(void)
+{
+    // Completions can be reordered by the callback
+    int fds[2] = {-1, -1};
+    ComlinState* state = new_piped_state("a\t\n", fds);
+    comlin_set_completion_callback(state, complete_swapped);
+    assert(!comlin_read_line(state, "> "));
+    assert(!strcmp(comlin_text(state), "abcdefghij"));
+    free_piped_state(state, fds);
+
+    state = new_piped_state("a\t\t\n", fds);
+    comlin_set_completion_callback(state, complete_swapped);
+    assert(!comlin_read_line(state, "> "));
+    assert(!strcmp(comlin_text(state), "a"));
+    free_piped_state(state, fds);
+
+    // Including those that replace a range of the line
+    state = new_piped_state("ab\t\n", fds);
+    comlin_set_range_completion_callback(state, complete_swapped_range);
+    assert(!comlin_read_line(state, "> "));
+    assert(!strcmp(comlin_text(state), "whole"));
+    free_piped_state(state, fds);
+
+    state = new_piped_state("ab\t\t\n", fds);
+    comlin_set_range_completion_callback(state, complete_swapped_range);
+    assert(!comlin_read_line(state, "> "));
+    assert(!strcmp(comlin_text(state), "abc"));
+    free_piped_state(state, fds);
+
+    // Completions made by the application can be reordered and shortened
+    ComlinCompletions lc = {0U, NULL};
+    complete_swapped("", &lc);
+    lc.len = 1U;
+    assert(!comlin_filter_completions(&lc, "j"));
+    assert(lc.len == 1U);
+    assert(!strcmp(lc.cvec[0], "abcdefghij"));
+    comlin_free_completions(&lc);
+}
+
+static void
+test_filter_completions(void)
+{
+    ComlinCompletions lc = {0U, NULL};
+    assert(!comlin_filter_completions(&lc, "x"));
+
+    comlin_add_completion(&lc, "git checkout");
+    comlin_add_completion(&lc, "make check");
+    comlin_add_completion(&lc, "echo hello");
+    comlin_add_completion(&lc, "Git Commit");
+    comlin_add_completion(&lc, "gc");
+
+    assert(!comlin_filter_completions(&lc, "gc"));
+    assert(lc.len == 3U);
+    assert(!strcmp(lc.cvec[0], "gc"));
+    assert(!strcmp(lc.cvec[1], "git checkout"));
+    assert(!strcmp(lc.cvec[2], "Git Commit"));
+
+    assert(!comlin_filter_completions(&lc, "zz"));
+    assert(lc.len == 0U);
+
+    comlin_free_completions(&lc);
+}
+
+int
+main(void)
+{
+    test_completion_cache();
+    test_completion_narrowing();
+    test_range_completion();
+    test_common_prefix();
+    test_completion_menu();
+    test_stream_completion();
+    test_path_completion();
+    test_dictionary();
+    test_grammar();
+    test_async_completion();
+    test_add_completions();
+    test_reordered_completions();
+    test_filter_completions();
+    return 0;
+}
@@ -0,0 +1,235 @@
+// Copyright 2023 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#undef NDEBUG
+
+#include "comlin/comlin.h"
+#include "test_utils.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// Read a line from some input, and return the resulting text
+static char const*
+read_edited_line(char const* const input)
+{
+    static char line[320];
+
+    int fds[2] = {-1, -1};
+    ComlinState* const state = new_piped_state(input, fds);
+    assert(!comlin_read_line(state, "> "));
+    snprintf(line, sizeof(line), "%s", comlin_text(state));
+    free_piped_state(state, fds);
+    return line;
+}
+
+static void
+test_gap_editing(void)
+{
+    // Insertions, deletions, and moves around the middle of the line
+    assert(!strcmp(read_edited_line("hello world\001say \005!\002\002"
+                                    "\177\004LD\n"),
+                   "say hello worLD!"));
+
+    assert(!strcmp(read_edited_line("abc\x1B[D\x1B[DX\x1B[C\x1B[CY\n"),
+                   "aXbcY"));
+
+    // Moving the gap across, and growing it within, a long line
+    char input[300] = {0};
+    char expected[300] = {0};
+    memset(input, 'a', 200U);
+    memcpy(input + 200U, "\001b\005c\001\004\n", 7U);
+    memset(expected, 'a', 200U);
+    expected[200] = 'c';
+    assert(!strcmp(read_edited_line(input), expected));
+
+    // An edit with a gap in the line is kept while navigating history
+    int fds[2] = {-1, -1};
+    ComlinState* const nav = new_piped_state("ab\002X\x1B[A\x1B[B\n", fds);
+    assert(!comlin_history_add(nav, "one"));
+    assert(!comlin_history_add(nav, ""));
+    assert(!comlin_read_line(nav, "> "));
+    assert(!strcmp(comlin_text(nav), "aXb"));
+    free_piped_state(nav, fds);
+
+    // The whole line is available between keys, and editing can continue
+    int in[2] = {-1, -1};
+    assert(!pipe(in));
+    int const out = open("/dev/null", O_WRONLY);
+    ComlinState* const state = comlin_new_state(in[0], out, "vt100", 8U);
+    assert(!comlin_edit_start(state, "> "));
+    assert(write(in[1], "ac\002b", 4U) == 4);
+    for (size_t i = 0U; i < 4U; ++i) {
+        assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    }
+
+    assert(!strcmp(comlin_text(state), "abc"));
+    assert(write(in[1], "\002\002x", 3U) == 3);
+    for (size_t i = 0U; i < 3U; ++i) {
+        assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    }
+
+    assert(!strcmp(comlin_text(state), "xabc"));
+    assert(write(in[1], "\n", 1U) == 1);
+    assert(comlin_edit_feed(state) == COMLIN_SUCCESS);
+    assert(!comlin_edit_stop(state));
+    assert(!strcmp(comlin_text(state), "xabc"));
+    comlin_free_state(state);
+    assert(!close(in[0]));
+    assert(!close(in[1]));
+    assert(!close(out));
+}
+
+static void
+test_undo(void)
+{
+    // Typing is undone in one step, and other edits separately
+    assert(!strcmp(read_edited_line("hello world\037\n"), ""));
+    assert(!strcmp(read_edited_line("hello world\027\037\n"), "hello world"));
+    assert(!strcmp(read_edited_line("ab\002c\037\n"), "ab"));
+    assert(!strcmp(read_edited_line("ab\002c\037\037\n"), ""));
+    assert(!strcmp(read_edited_line("abc\001\004\037\n"), "abc"));
+    assert(!strcmp(read_edited_line("abc\177\177\037\037\n"), "abc"));
+    assert(!strcmp(read_edited_line("ab\002\024\037\n"), "ab"));
+    assert(!strcmp(read_edited_line("abc\001\013\037\n"), "abc"));
+    assert(!strcmp(read_edited_line("abc\025\037\n"), "abc"));
+
+    // Undone steps can be redone until there's another edit
+    assert(!strcmp(read_edited_line("abc\037\x1B/\n"), "abc"));
+    assert(!strcmp(read_edited_line("ab\002\024\037\x1B/\n"), "ba"));
+    assert(!strcmp(read_edited_line("ab\037c\x1B/\n"), "c"));
+    assert(!strcmp(read_edited_line("\037\x1B/x\n"), "x"));
+
+    // Only the most recent steps are kept
+    char input[1024] = {0};
+    for (size_t i = 0U; i < 300U; ++i) {
+        memcpy(input + (i * 2U), "a\002", 2U);
+    }
+
+    memset(input + 600U, '\037', 300U);
+    input[900] = '\n';
+    assert(strlen(read_edited_line(input)) == 300U - 256U);
+
+    // Old steps are discarded to make room for a step with several operations
+    memset(input, 0, sizeof(input));
+    for (size_t i = 0U; i < 255U; ++i) {
+        memcpy(input + (i * 2U), "a\002", 2U);
+    }
+
+    memcpy(input + 510U, "\006\024\024", 3U);
+    memset(input + 513U, '\037', 300U);
+    input[813] = '\n';
+    assert(strlen(read_edited_line(input)) == 255U - 253U);
+}
+
+static void
+test_kill_ring(void)
+{
+    // Killed text can be yanked back
+    assert(!strcmp(read_edited_line("one two\027\001\031\n"), "twoone "));
+    assert(!strcmp(read_edited_line("ab\025\031\031\n"), "abab"));
+    assert(!strcmp(read_edited_line("\031x\n"), "x"));
+
+    // Consecutive kills are yanked back together
+    assert(!strcmp(read_edited_line("a b c\027\027\031\n"), "a b c"));
+    assert(!strcmp(read_edited_line("abcd\002\002\013\025\031\n"), "abcd"));
+    assert(!strcmp(read_edited_line("ab\025cd\025\031\n"), "cd"));
+
+    // Older kills can be yanked in place of the last yanked text
+    assert(!strcmp(read_edited_line("one\025two\025\031\x1By\n"), "one"));
+    assert(!strcmp(read_edited_line("one\025two\025\031\x1By\x1By\n"),
+                   "two"));
+    assert(!strcmp(read_edited_line("x\025y\x1By\n"), "y"));
+    assert(!strcmp(read_edited_line("one\025two\025\031\x1By\037\n"),
+                   "two"));
+
+    // Nothing is yanked from an empty ring
+    assert(!strcmp(read_edited_line("\x1Byx\n"), "x"));
+    assert(!strcmp(read_edited_line("a\031\x1By\x1Byb\n"), "ab"));
+
+    // Text killed while editing a previous line is still in the ring
+    int fds[2] = {-1, -1};
+    ComlinState* const state = new_piped_state("first\025\n\031\n", fds);
+    assert(!comlin_read_line(state, "> "));
+    assert(!strcmp(comlin_text(state), ""));
+    assert(!comlin_read_line(state, "> "));
+    assert(!strcmp(comlin_text(state), "first"));
+    free_piped_state(state, fds);
+
+    // Kills are dropped once newer ones wrap around the ring and replace them
+    static char input[18016];
+    char* p = input;
+    for (char c = 'a'; c <= 'c'; ++c) {
+        memset(p, c, 6000U);
+        p[6000] = '\025';
+        p += 6001U;
+    }
+
+    memcpy(p, "\031\x1By\x1By\n", 7U);
+
+    ComlinState* const large = new_piped_state(input, fds);
+    assert(!comlin_read_line(large, "> "));
+    char const* const text = comlin_text(large);
+    assert(strlen(text) == 6000U && text[0] == 'c' && text[5999] == 'c');
+    free_piped_state(large, fds);
+}
+
+static void
+test_large_line(void)
+{
+    static char const* const path = "comlin_test_large.txt";
+
+    // Paste a large line, then insert at the start
+    static char input[5004];
+    memset(input, 'x', 5000U);
+    memcpy(input + 5000U, "\001y\n", 4U);
+
+    int in[2] = {-1, -1};
+    assert(!pipe(in));
+    assert(write(in[1], input, strlen(input)) == (ssize_t)strlen(input));
+    assert(!close(in[1]));
+
+    int const out = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    assert(out >= 0);
+
+    ComlinState* const state = comlin_new_state(in[0], out, "vt100", 8U);
+    assert(!comlin_set_mode(state, COMLIN_MODE_MULTI_LINE));
+    assert(!comlin_edit_start(state, "> "));
+    for (size_t i = 0U; i < 4095U; ++i) {
+        assert(comlin_edit_feed(state) == COMLIN_EDITING);
+    }
+
+    // Once the line is large, it's only shown on one row after the paste
+    off_t const start = lseek(out, 0, SEEK_CUR);
+    ComlinStatus st = COMLIN_EDITING;
+    while (st == COMLIN_EDITING) {
+        st = comlin_edit_feed(state);
+    }
+
+    assert(!st);
+    assert(!comlin_edit_stop(state));
+    assert(lseek(out, 0, SEEK_CUR) - start < 80 * 32);
+
+    char const* const text = comlin_text(state);
+    assert(strlen(text) == 5001U);
+    assert(text[0] == 'y' && text[1] == 'x' && text[5000] == 'x');
+
+    comlin_free_state(state);
+    assert(!close(in[0]));
+    assert(!close(out));
+    assert(!remove(path));
+}
+
+int
+main(void)
+{
+    test_gap_editing();
+    test_undo();
+    test_kill_ring();
+    test_large_line();
+    return 0;
+}
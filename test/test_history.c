@@ -4,8 +4,17 @@
 #undef NDEBUG
 
 #include "comlin/comlin.h"
+#include "test_utils.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 static int const ifd = 0; // stdin
 static int const ofd = 1; // stdout
@@ -39,11 +48,575 @@ test_bad_save(void)
     comlin_free_state(state);
 }
 
+static bool
+file_equals(char const* const path, char const* const expected)
+{
+    char buf[512] = {0};
+    FILE* const file = fopen(path, "rb");
+    size_t const len = file ? fread(buf, 1U, sizeof(buf) - 1U, file) : 0U;
+    if (file) {
+        fclose(file);
+    }
+
+    return len == strlen(expected) && !strcmp(buf, expected);
+}
+
+static void
+test_binary(void)
+{
+    static char const* const bin_path = "test_history.bin";
+    static char const* const txt_path = "test_history.txt";
+
+    // Save a binary history file
+    ComlinState* state = comlin_new_state(ifd, ofd, "> ", 8U);
+    assert(state);
+    assert(!comlin_history_add(state, "one"));
+    assert(!comlin_history_add(state, ""));
+    assert(!comlin_history_add(state, "two"));
+    assert(!comlin_history_add(state, "three"));
+    assert(!comlin_history_save_as(state, bin_path, COMLIN_HISTORY_BINARY));
+    comlin_free_state(state);
+
+    // Load it lazily into a smaller history and add to the end
+    state = comlin_new_state(ifd, ofd, "> ", 3U);
+    assert(state);
+    assert(!comlin_history_load(state, bin_path));
+    assert(!comlin_history_add(state, "four"));
+    assert(!comlin_history_save(state, txt_path));
+    assert(file_equals(txt_path, "two\nthree\nfour\n"));
+
+    // Overwrite the mapped file while it is in use, then load it again
+    assert(!comlin_history_save_as(state, bin_path, COMLIN_HISTORY_BINARY));
+    assert(!comlin_history_load(state, bin_path));
+    assert(!comlin_history_save(state, txt_path));
+    assert(file_equals(txt_path, "two\nthree\nfour\n"));
+    comlin_free_state(state);
+
+    // Saving a file that isn't mapped writes it in place
+    struct stat st;
+    assert(!chmod(txt_path, 0640));
+    state = comlin_new_state(ifd, ofd, "> ", 3U);
+    assert(!comlin_history_add(state, "five"));
+    assert(!comlin_history_save(state, txt_path));
+    assert(!stat(txt_path, &st));
+    assert((st.st_mode & 0777U) == 0640U);
+    assert(file_equals(txt_path, "five\n"));
+    comlin_free_state(state);
+
+    // Entries of a mapped file that another program truncates are empty
+    state = comlin_new_state(ifd, ofd, "> ", 3U);
+    assert(!comlin_history_load(state, bin_path));
+    assert(!truncate(bin_path, 0));
+    assert(!comlin_history_add(state, "six"));
+    assert(comlin_history_count(state) == 3U);
+    size_t length = 1U;
+    assert(!strcmp(comlin_history_entry(state, 0U, &length), ""));
+    assert(!length);
+    assert(!comlin_history_save(state, txt_path));
+    assert(file_equals(txt_path, "six\n"));
+
+    // Saving through a symbolic link writes to its target
+    static char const* const link_path = "test_history_link";
+    assert(!symlink(txt_path, link_path));
+    assert(!comlin_history_save(state, link_path));
+    assert(!lstat(link_path, &st) && S_ISLNK(st.st_mode));
+    assert(file_equals(txt_path, "six\n"));
+    comlin_free_state(state);
+
+    // Including when the target is a mapped file that is replaced
+    assert(!remove(link_path));
+    assert(!symlink(bin_path, link_path));
+    state = comlin_new_state(ifd, ofd, "> ", 3U);
+    assert(!comlin_history_add(state, "seven"));
+    assert(!comlin_history_save_as(state, link_path, COMLIN_HISTORY_BINARY));
+    comlin_free_state(state);
+
+    state = comlin_new_state(ifd, ofd, "> ", 3U);
+    assert(!comlin_history_load(state, link_path));
+    assert(!comlin_history_add(state, "eight"));
+    assert(!comlin_history_save_as(state, link_path, COMLIN_HISTORY_BINARY));
+    assert(!lstat(link_path, &st) && S_ISLNK(st.st_mode));
+    comlin_free_state(state);
+
+    state = comlin_new_state(ifd, ofd, "> ", 3U);
+    assert(!comlin_history_load(state, bin_path));
+    assert(!comlin_history_save(state, txt_path));
+    assert(file_equals(txt_path, "seven\neight\n"));
+    comlin_free_state(state);
+
+    assert(!remove(link_path));
+    assert(!remove(bin_path));
+    assert(!remove(txt_path));
+}
+
+static void
+test_limits(void)
+{
+    static char const* const path = "test_history_limits.txt";
+
+    // Add entries with sizes 4, 7, 5, and 6 bytes (including terminators)
+    ComlinState* const state = comlin_new_state(ifd, ofd, "> ", 8U);
+    assert(state);
+    assert(!comlin_history_add(state, "one"));
+    assert(!comlin_history_add(state, "sixsix"));
+    assert(!comlin_history_add(state, "four"));
+    assert(!comlin_history_add(state, "fives"));
+
+    // Oversized entries are ignored
+    assert(!comlin_history_set_limits(state, 0U, 6U, COMLIN_EVICT_OLDEST));
+    assert(!comlin_history_add(state, "toolong"));
+    assert(!comlin_history_save(state, path));
+    assert(file_equals(path, "one\nsixsix\nfour\nfives\n"));
+
+    // Removing the largest entry is enough to get within budget
+    assert(!comlin_history_set_limits(state, 16U, 0U, COMLIN_EVICT_LARGEST));
+    assert(!comlin_history_save(state, path));
+    assert(file_equals(path, "one\nfour\nfives\n"));
+
+    // Adding a new entry removes the oldest to make room
+    assert(!comlin_history_set_limits(state, 16U, 0U, COMLIN_EVICT_OLDEST));
+    assert(!comlin_history_add(state, "two"));
+    assert(!comlin_history_save(state, path));
+    assert(file_equals(path, "four\nfives\ntwo\n"));
+    comlin_free_state(state);
+    assert(!remove(path));
+
+    // Entries with sizes 2, 5, 3, 6, 2, and 3 are saved to a binary file
+    static char const* const bin_path = "test_history_limits.bin";
+    static char const* const entries[] = {
+      "a", "bbbb", "cc", "ddddd", "e", "ff"};
+    ComlinState* lazy = comlin_new_state(ifd, ofd, "> ", 8U);
+    for (size_t i = 0U; i < 6U; ++i) {
+        assert(!comlin_history_add(lazy, entries[i]));
+    }
+
+    assert(!comlin_history_save_as(lazy, bin_path, COMLIN_HISTORY_BINARY));
+    comlin_free_state(lazy);
+
+    // The largest entries can be removed from the middle of the file
+    lazy = comlin_new_state(ifd, ofd, "> ", 8U);
+    assert(!comlin_history_load(lazy, bin_path));
+    assert(!comlin_history_set_limits(lazy, 14U, 0U, COMLIN_EVICT_LARGEST));
+    assert(comlin_history_count(lazy) == 4U);
+    assert(!strcmp(comlin_history_entry(lazy, 0U, NULL), "a"));
+    assert(!strcmp(comlin_history_entry(lazy, 1U, NULL), "cc"));
+    assert(!strcmp(comlin_history_entry(lazy, 2U, NULL), "e"));
+    assert(!strcmp(comlin_history_entry(lazy, 3U, NULL), "ff"));
+
+    // The oldest of the largest entries is removed to make room for a new one
+    assert(!comlin_history_add(lazy, "gggg"));
+    assert(comlin_history_count(lazy) == 4U);
+    assert(!strcmp(comlin_history_entry(lazy, 1U, NULL), "e"));
+    assert(!strcmp(comlin_history_entry(lazy, 2U, NULL), "ff"));
+    assert(!strcmp(comlin_history_entry(lazy, 3U, NULL), "gggg"));
+
+    comlin_free_state(lazy);
+    assert(!remove(bin_path));
+}
+
+typedef struct {
+    char text[64];
+    size_t n_visited;
+} VisitState;
+
+static ComlinStatus
+visit_entry(void* const data,
+            size_t const index,
+            char const* const text,
+            size_t const length)
+{
+    VisitState* const state = (VisitState*)data;
+
+    assert(strlen(text) == length);
+    (void)index;
+
+    strcat(state->text, text);
+    return ++state->n_visited == 3U ? COMLIN_INTERRUPTED : COMLIN_SUCCESS;
+}
+
+static void
+test_query(void)
+{
+    ComlinState* const state = comlin_new_state(ifd, ofd, "> ", 8U);
+    assert(state);
+    assert(!comlin_history_count(state));
+    assert(!comlin_history_entry(state, 0U, NULL));
+
+    assert(!comlin_history_add(state, "one"));
+    assert(!comlin_history_add(state, "two"));
+    assert(!comlin_history_add(state, "three"));
+    assert(comlin_history_count(state) == 3U);
+
+    size_t length = 0U;
+    char const* const first = comlin_history_entry(state, 0U, &length);
+    assert(!strcmp(first, "one"));
+    assert(length == 3U);
+    assert(!strcmp(comlin_history_entry(state, 2U, &length), "three"));
+    assert(length == 5U);
+    assert(!comlin_history_entry(state, 3U, &length));
+
+    // Visit a range forwards
+    VisitState visit = {{0}, 0U};
+    assert(!comlin_history_visit(
+      state, 1U, 3U, COMLIN_HISTORY_NEXT, visit_entry, &visit));
+    assert(!strcmp(visit.text, "twothree"));
+
+    // Visit a clamped range backwards, which stops after 3 entries
+    memset(&visit, 0, sizeof(visit));
+    assert(comlin_history_visit(
+             state, 0U, 8U, COMLIN_HISTORY_PREV, visit_entry, &visit) ==
+           COMLIN_INTERRUPTED);
+    assert(!strcmp(visit.text, "threetwoone"));
+
+    comlin_free_state(state);
+}
+
+static void
+test_metadata(void)
+{
+    static char const* const txt_path = "test_history_metadata.txt";
+    static char const* const bin_path = "test_history_metadata.bin";
+
+    ComlinState* state = comlin_new_state(ifd, ofd, "> ", 8U);
+    assert(state);
+    assert(!comlin_set_mode(state, COMLIN_MODE_HISTORY_METADATA));
+    assert(!comlin_history_add(state, "one"));
+    assert(!comlin_history_add(state, "two"));
+    assert(!comlin_history_add(state, "three"));
+    assert(!comlin_history_set_status(state, 0U, 1));
+    assert(!comlin_history_set_status(state, 2U, -2));
+    assert(comlin_history_set_status(state, 3U, 1) == COMLIN_BAD_ARG);
+
+    ComlinHistoryMetadata metadata = {0, 0U, 0};
+    assert(!comlin_history_metadata(state, 2U, &metadata));
+    assert(metadata.time > 0);
+    assert(metadata.status == -2);
+
+    // Query for "failed" entries with a non-zero status
+    ComlinHistoryQuery const query = {
+      metadata.time - 3600, 0, COMLIN_STATUS_NOT_EQUAL, 0};
+
+    VisitState visit = {{0}, 0U};
+    assert(!comlin_history_query(
+      state, &query, COMLIN_HISTORY_PREV, visit_entry, &visit));
+    assert(!strcmp(visit.text, "threeone"));
+
+    // Round-trip through text and binary files
+    assert(!comlin_history_save(state, txt_path));
+    comlin_free_state(state);
+    state = comlin_new_state(ifd, ofd, "> ", 8U);
+    assert(!comlin_history_load(state, txt_path));
+    assert(!comlin_history_save_as(state, bin_path, COMLIN_HISTORY_BINARY));
+    comlin_free_state(state);
+    state = comlin_new_state(ifd, ofd, "> ", 8U);
+    assert(!comlin_history_load(state, bin_path));
+    assert(comlin_history_count(state) == 3U);
+    assert(!strcmp(comlin_history_entry(state, 2U, NULL), "three"));
+
+    ComlinHistoryMetadata loaded = {0, 0U, 0};
+    assert(!comlin_history_metadata(state, 2U, &loaded));
+    assert(loaded.time == metadata.time);
+    assert(loaded.duration == metadata.duration);
+    assert(loaded.status == metadata.status);
+
+    memset(&visit, 0, sizeof(visit));
+    assert(!comlin_history_query(
+      state, &query, COMLIN_HISTORY_NEXT, visit_entry, &visit));
+    assert(!strcmp(visit.text, "onethree"));
+
+    comlin_free_state(state);
+    assert(!remove(bin_path));
+    assert(!remove(txt_path));
+}
+
+static void
+test_metadata_format(void)
+{
+    static char const* const path = "test_history_format.txt";
+
+    FILE* const file = fopen(path, "wb");
+    assert(file);
+    fprintf(file,
+            "#comlin-metadata\n"
+            "plain\n"
+            ": 1700000000:1500:-3;extended\n"
+            ": 12;bad\n"
+            ": 99999999999999999999:0:0;huge\n"
+            ": 1700000000:-5:0;negative\n"
+            ": 1700000000:4294967296:0;long\n"
+            ": 1700000000:0:2147483648;status\n"
+            ": 1700000000:0:0:-1;unloved\n"
+            ": 1700000000:0:0:4294967296;loved\n");
+    assert(!fclose(file));
+
+    ComlinState* const state = comlin_new_state(ifd, ofd, "> ", 16U);
+    assert(!comlin_history_load(state, path));
+    assert(comlin_history_count(state) == 9U);
+    assert(!strcmp(comlin_history_entry(state, 0U, NULL), "plain"));
+    assert(!strcmp(comlin_history_entry(state, 1U, NULL), "extended"));
+    assert(!strcmp(comlin_history_entry(state, 2U, NULL), ": 12;bad"));
+    assert(!strcmp(comlin_history_entry(state, 3U, NULL),
+                   ": 99999999999999999999:0:0;huge"));
+    assert(!strcmp(comlin_history_entry(state, 4U, NULL),
+                   ": 1700000000:-5:0;negative"));
+    assert(!strcmp(comlin_history_entry(state, 5U, NULL),
+                   ": 1700000000:4294967296:0;long"));
+    assert(!strcmp(comlin_history_entry(state, 6U, NULL),
+                   ": 1700000000:0:2147483648;status"));
+    assert(!strcmp(comlin_history_entry(state, 7U, NULL),
+                   ": 1700000000:0:0:-1;unloved"));
+    assert(!strcmp(comlin_history_entry(state, 8U, NULL),
+                   ": 1700000000:0:0:4294967296;loved"));
+
+    ComlinHistoryMetadata metadata = {0, 0U, 0};
+    assert(!comlin_history_metadata(state, 0U, &metadata));
+    assert(!metadata.time && !metadata.duration && !metadata.status);
+    assert(!comlin_history_metadata(state, 1U, &metadata));
+    assert(metadata.time == 1700000000);
+    assert(metadata.duration == 1500U);
+    assert(metadata.status == -3);
+
+    assert(!comlin_history_save(state, path));
+    assert(file_equals(path,
+                       "#comlin-metadata\n"
+                       ": 0:0:0;plain\n"
+                       ": 1700000000:1500:-3;extended\n"
+                       ": 0:0:0;: 12;bad\n"
+                       ": 0:0:0;: 99999999999999999999:0:0;huge\n"
+                       ": 0:0:0;: 1700000000:-5:0;negative\n"
+                       ": 0:0:0;: 1700000000:4294967296:0;long\n"
+                       ": 0:0:0;: 1700000000:0:2147483648;status\n"
+                       ": 0:0:0;: 1700000000:0:0:-1;unloved\n"
+                       ": 0:0:0;: 1700000000:0:0:4294967296;loved\n"));
+
+    comlin_free_state(state);
+
+    // Lines that look like metadata are kept if the file has none
+    FILE* const plain = fopen(path, "wb");
+    assert(plain);
+    fprintf(plain, ": 1:2:3;echo\n");
+    assert(!fclose(plain));
+
+    ComlinState* const plain_state = comlin_new_state(ifd, ofd, "> ", 8U);
+    assert(!comlin_history_load(plain_state, path));
+    assert(!strcmp(comlin_history_entry(plain_state, 0U, NULL),
+                   ": 1:2:3;echo"));
+    comlin_free_state(plain_state);
+    assert(!remove(path));
+}
+
+static bool
+approx_equal(double const a, double const b)
+{
+    return a - b < 0.001 && b - a < 0.001;
+}
+
+static void
+test_frecency(void)
+{
+    static char const* const txt_path = "test_history_frecency.txt";
+    static char const* const bin_path = "test_history_frecency.bin";
+    static int64_t const week = 7 * 24 * 60 * 60;
+
+    // Load scores from a file and check that they decay
+    FILE* const file = fopen(txt_path, "wb");
+    assert(file);
+    fprintf(file, ": 1700000000:0:0:4000;make\n: 1700000000:0:0;ls\n");
+    assert(!fclose(file));
+
+    ComlinState* state = comlin_new_state(ifd, ofd, "> ", 8U);
+    assert(!comlin_set_mode(state, COMLIN_MODE_HISTORY_FRECENCY));
+    assert(!comlin_history_load(state, txt_path));
+    assert(comlin_history_count(state) == 2U);
+    assert(approx_equal(comlin_history_frecency(state, 0U, 1700000000), 4.0));
+    assert(approx_equal(comlin_history_frecency(state, 1U, 1700000000), 1.0));
+    assert(approx_equal(
+      comlin_history_frecency(state, 0U, 1700000000 + week), 2.0));
+    assert(approx_equal(
+      comlin_history_frecency(state, 0U, 1700000000 + (week * 5 / 2)),
+      0.70711));
+    assert(comlin_history_frecency(state, 2U, 1700000000) == 0.0);
+    comlin_free_state(state);
+
+    // Entering a line again moves it to the end and increases its score
+    state = comlin_new_state(ifd, ofd, "> ", 8U);
+    assert(!comlin_set_mode(state, COMLIN_MODE_HISTORY_FRECENCY));
+    assert(!comlin_history_add(state, "a"));
+    assert(!comlin_history_add(state, "b"));
+    assert(!comlin_history_add(state, "a"));
+    assert(comlin_history_count(state) == 2U);
+    assert(!strcmp(comlin_history_entry(state, 0U, NULL), "b"));
+    assert(!strcmp(comlin_history_entry(state, 1U, NULL), "a"));
+
+    ComlinHistoryMetadata metadata = {0, 0U, 0};
+    assert(!comlin_history_metadata(state, 1U, &metadata));
+    assert(metadata.time > 0);
+
+    int64_t const now = metadata.time;
+    assert(approx_equal(comlin_history_frecency(state, 0U, now), 1.0));
+    assert(approx_equal(comlin_history_frecency(state, 1U, now), 2.0));
+
+    // Round-trip through a binary file
+    assert(!comlin_history_save_as(state, bin_path, COMLIN_HISTORY_BINARY));
+    comlin_free_state(state);
+    state = comlin_new_state(ifd, ofd, "> ", 8U);
+    assert(!comlin_history_load(state, bin_path));
+    assert(comlin_history_count(state) == 2U);
+    assert(approx_equal(comlin_history_frecency(state, 1U, now), 2.0));
+
+    // Entries loaded from the file are merged too
+    assert(!comlin_set_mode(state, COMLIN_MODE_HISTORY_FRECENCY));
+    assert(!comlin_history_add(state, "b"));
+    assert(!comlin_history_add(state, "c"));
+    assert(!comlin_history_add(state, "a"));
+    assert(comlin_history_count(state) == 3U);
+    assert(!strcmp(comlin_history_entry(state, 0U, NULL), "b"));
+    assert(!strcmp(comlin_history_entry(state, 1U, NULL), "c"));
+    assert(!strcmp(comlin_history_entry(state, 2U, NULL), "a"));
+    assert(approx_equal(comlin_history_frecency(state, 2U, now), 3.0));
+
+    comlin_free_state(state);
+    assert(!remove(bin_path));
+    assert(!remove(txt_path));
+}
+
+// Read a line from some input with suggestions, and return whether it matches
+static bool
+read_suggested(char const* const path,
+               char const* const input,
+               char const* const expected)
+{
+    int fds[2] = {-1, -1};
+    ComlinState* const state = new_piped_state(input, fds);
+    assert(!comlin_set_mode(state, COMLIN_MODE_AUTOSUGGEST));
+    assert(!comlin_history_load(state, path));
+    assert(!comlin_read_line(state, "> "));
+
+    bool const matches = !strcmp(comlin_text(state), expected);
+    assert(!comlin_history_add(state, comlin_text(state)));
+    assert(!comlin_history_save(state, path));
+    free_piped_state(state, fds);
+    return matches;
+}
+
+// Replace a file with some text, like a program that saves a new copy
+static void
+replace_file(char const* const path, char const* const text)
+{
+    static char const* const tmp_path = "test_history_replace.tmp";
+
+    FILE* const file = fopen(tmp_path, "wb");
+    assert(file);
+    assert(fwrite(text, 1U, strlen(text), file) == strlen(text));
+    assert(!fclose(file));
+    assert(!rename(tmp_path, path));
+}
+
+static void
+test_index(void)
+{
+    static char const* const path = "test_history_index.txt";
+    static char const* const idx_path = "test_history_index.txt.idx";
+
+    FILE* file = fopen(path, "wb");
+    assert(file);
+    fprintf(file, "git status\nls\n");
+    assert(!fclose(file));
+
+    // Using suggestions builds the index, which is saved with the history
+    assert(read_suggested(path, "gi\x1B[C\n", "git status"));
+    assert((file = fopen(idx_path, "rb")));
+    assert(!fclose(file));
+
+    // The index is loaded and updated for entries appended by another program
+    assert((file = fopen(path, "ab")));
+    fprintf(file, "git commit\n");
+    assert(!fclose(file));
+    assert(read_suggested(path, "gi\x1B[C\n", "git commit"));
+    assert(read_suggested(path, "l\x1B[C\n", "ls"));
+
+    // A truncated index is ignored and rebuilt
+    char buf[4096] = {0};
+    assert((file = fopen(idx_path, "rb")));
+    size_t const len = fread(buf, 1U, sizeof(buf), file);
+    assert(!fclose(file));
+    assert((file = fopen(idx_path, "wb")));
+    assert(fwrite(buf, 1U, len - 8U, file) == len - 8U);
+    assert(!fclose(file));
+    assert(read_suggested(path, "git s\x1B[C\n", "git status"));
+    assert(read_suggested(path, "gi\x1B[C\n", "git status"));
+
+    // Exporting the history elsewhere doesn't write an index
+    static char const* const export_path = "test_history_index.bin";
+    int fds[2] = {-1, -1};
+    ComlinState* const state = new_piped_state("gi\x1B[C\n", fds);
+    assert(!comlin_set_mode(state, COMLIN_MODE_AUTOSUGGEST));
+    assert(!comlin_history_load(state, path));
+    assert(!comlin_read_line(state, "> "));
+    assert(!comlin_history_save_as(state, export_path, COMLIN_HISTORY_BINARY));
+    assert(!(file = fopen("test_history_index.bin.idx", "rb")));
+    free_piped_state(state, fds);
+    assert(!remove(export_path));
+
+    // Saving to a file that failed to load doesn't write an index either
+    static char const* const new_path = "test_history_index_new.txt";
+    ComlinState* const fresh = new_piped_state("gi\n", fds);
+    assert(!comlin_set_mode(fresh, COMLIN_MODE_AUTOSUGGEST));
+    assert(comlin_history_load(fresh, new_path) == COMLIN_NO_FILE);
+    assert(!comlin_read_line(fresh, "> "));
+    assert(!comlin_history_add(fresh, comlin_text(fresh)));
+    assert(!comlin_history_save(fresh, new_path));
+    assert(!(file = fopen("test_history_index_new.txt.idx", "rb")));
+    free_piped_state(fresh, fds);
+    assert(!remove(new_path));
+
+    // An index with entries that were changed by another program is rebuilt
+    replace_file(path, "git status\nls\n");
+    assert(read_suggested(path, "l\x1B[C\n", "ls"));
+    replace_file(path, "git status\ncd\ncd\n");
+    assert(read_suggested(path, "c\x1B[C\n", "cd"));
+    assert(read_suggested(path, "l\x1B[C\n", "l"));
+
+    // So is one with entries that were dropped by another program
+    replace_file(path, "cd\n");
+    assert(read_suggested(path, "git s\x1B[C\n", "git s"));
+
+    // Loaded and appended entries are found in the index to merge with them
+    replace_file(path, "git status\nls\n");
+    assert(read_suggested(path, "l\x1B[C\n", "ls"));
+    assert((file = fopen(path, "ab")));
+    fprintf(file, "cd\n");
+    assert(!fclose(file));
+
+    ComlinState* const merged = new_piped_state("", fds);
+    assert(!comlin_set_mode(merged, COMLIN_MODE_AUTOSUGGEST));
+    assert(!comlin_set_mode(merged, COMLIN_MODE_HISTORY_FRECENCY));
+    assert(!comlin_history_load(merged, path));
+    assert(comlin_history_count(merged) == 3U);
+    assert(!comlin_history_add(merged, "git status"));
+    assert(!comlin_history_add(merged, "cd"));
+    assert(comlin_history_count(merged) == 3U);
+    assert(!strcmp(comlin_history_entry(merged, 0U, NULL), "ls"));
+    assert(!strcmp(comlin_history_entry(merged, 1U, NULL), "git status"));
+    assert(!strcmp(comlin_history_entry(merged, 2U, NULL), "cd"));
+    free_piped_state(merged, fds);
+
+    assert(!remove(idx_path));
+    assert(!remove(path));
+}
+
 int
 main(void)
 {
     test_empty();
     test_bad_load();
     test_bad_save();
+    test_binary();
+    test_limits();
+    test_query();
+    test_metadata();
+    test_metadata_format();
+    test_frecency();
+    test_index();
     return 0;
 }
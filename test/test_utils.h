@@ -0,0 +1,42 @@
+// Copyright 2023 David Robillard <d@drobilla.net>
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef COMLIN_TEST_TEST_UTILS_H
+#define COMLIN_TEST_TEST_UTILS_H
+
+#include "comlin/comlin.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <string.h>
+
+// Return a new state that reads the given input and discards its output
+static inline ComlinState*
+new_piped_state(char const* const input, int* const fds)
+{
+    int in[2] = {-1, -1};
+    assert(!pipe(in));
+    assert(write(in[1], input, strlen(input)) == (ssize_t)strlen(input));
+    assert(!close(in[1]));
+
+    fds[0] = in[0];
+    fds[1] = open("/dev/null", O_WRONLY);
+    assert(fds[1] >= 0);
+
+    ComlinState* const state = comlin_new_state(fds[0], fds[1], "vt100", 8U);
+    assert(state);
+    return state;
+}
+
+// Free a state made by new_piped_state()
+static inline void
+free_piped_state(ComlinState* const state, int const* const fds)
+{
+    comlin_free_state(state);
+    assert(!close(fds[0]));
+    assert(!close(fds[1]));
+}
+
+#endif // COMLIN_TEST_TEST_UTILS_H